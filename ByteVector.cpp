@@ -2,77 +2,212 @@
 #include "ByteVector.h"
 
 #include <cstring>
+#include <cstdlib>
+#include <new>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 using namespace FCInterface;
 using namespace std;
 
+static const unsigned int HugePageSize = 2 * 1024 * 1024;
+
+// round size up to a multiple of unit (a power of two); 0 if that overflows
+static unsigned int roundUp(unsigned int size, unsigned int unit)
+{
+	unsigned int rounded = (size + unit - 1) & ~(unit - 1);
+	return rounded < size ? 0 : rounded;
+}
+
+static void releaseHeap(unsigned char* pBuffer, unsigned int, void*)
+{
+	free(pBuffer);
+}
+
+#ifdef __linux__
+static void releaseMapping(unsigned char* pBuffer, unsigned int size, void*)
+{
+	munmap(pBuffer, size);
+}
+#endif
 
 ByteVector::ByteVector()
 {
 	bufferSize_ = 0;
+	capacity_ = 0;
 	pBuffer_ = 0;
+	release_ = 0;
+	releaseContext_ = 0;
 }
 /* copy constructor*/
 ByteVector::ByteVector(const ByteVector &b) : ByteVector(b.size())
 {
-	memcpy(pBuffer_, b.buffer(), b.size());
+	if (b.size() > 0)
+		memcpy(pBuffer_, b.buffer(), b.size());
 }
 
-ByteVector::ByteVector( ByteVector &&b)
+ByteVector::ByteVector( ByteVector &&b) : ByteVector()
 {
 	swap(b);
 }
 
-ByteVector::ByteVector(unsigned int size)
+ByteVector::ByteVector(unsigned int size) : ByteVector()
 {
-	bufferSize_ = size;
-	pBuffer_ = new unsigned char[bufferSize_];
+	resize(size);
 }
 
 ByteVector::~ByteVector()
 {
-	delete pBuffer_;
+	release();
+}
+
+// capacity is rounded up to what was allocated; throws bad_alloc like new does
+unsigned char* ByteVector::allocate(unsigned int& capacity, ReleaseFunc& release)
+{
+	void* pBuffer = 0;
+#if defined(__linux__) && BYTEVECTOR_HUGEPAGE_THRESHOLD > 0
+	if (capacity >= BYTEVECTOR_HUGEPAGE_THRESHOLD) {
+		unsigned int mapSize = roundUp(capacity, HugePageSize);
+		if (mapSize > 0) {
+			pBuffer = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (pBuffer != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+				madvise(pBuffer, mapSize, MADV_HUGEPAGE);
+#endif
+				capacity = mapSize;
+				release = releaseMapping;
+				return (unsigned char*)pBuffer;
+			}
+		}
+	}
+#endif
+	// whole alignment units, so vector loops may run on to the end of the last one
+	unsigned int allocSize = roundUp(capacity, BYTEVECTOR_ALIGNMENT);
+	if (allocSize == 0 || posix_memalign(&pBuffer, BYTEVECTOR_ALIGNMENT, allocSize) != 0)
+		throw std::bad_alloc();
+	capacity = allocSize;
+	release = releaseHeap;
+	return (unsigned char*)pBuffer;
+}
+
+void ByteVector::release()
+{
+	if (release_)
+		release_(pBuffer_, capacity_, releaseContext_);
+}
+
+// move the contents to new heap storage of at least capacity bytes
+void ByteVector::reallocate(unsigned int capacity)
+{
+	ReleaseFunc releaseNew;
+	unsigned char* pBuffer = allocate(capacity, releaseNew);
+	if (bufferSize_ > 0)
+		memcpy(pBuffer, pBuffer_, bufferSize_ < capacity ? bufferSize_ : capacity);
+	release();
+	pBuffer_ = pBuffer;
+	capacity_ = capacity;
+	release_ = releaseNew;
+	releaseContext_ = 0;
 }
 
 void ByteVector::clear()
 {
-	delete pBuffer_;
+	release();
 	bufferSize_ = 0;
+	capacity_ = 0;
 	pBuffer_ = 0;
+	release_ = 0;
+	releaseContext_ = 0;
 }
 
 void ByteVector::setArray(unsigned char* pBuffer, unsigned int bufferSize, bool deleteExistingBuffer)
 {
 	if (deleteExistingBuffer) {
-		delete pBuffer_;
+		release();
 	}
 	pBuffer_ = pBuffer;
 	bufferSize_ = bufferSize;
+	capacity_ = bufferSize;
+	release_ = releaseHeap;
+	releaseContext_ = 0;
 }
 
-void ByteVector::resize(unsigned int width, unsigned int height, unsigned int bytesPerPixel)
+void ByteVector::setExternal(unsigned char* pBuffer, unsigned int bufferSize, ReleaseFunc release, void* context)
 {
-	bufferSize_ = width * height * bytesPerPixel;
+	this->release();
+	pBuffer_ = pBuffer;
+	bufferSize_ = bufferSize;
+	capacity_ = bufferSize;
+	release_ = release;
+	releaseContext_ = context;
+}
 
-	delete pBuffer_;
-	pBuffer_ = new unsigned char[bufferSize_];
+bool ByteVector::mapFile(const std::string& filename)
+{
+#ifdef __linux__
+	int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (unsigned long long)st.st_size > 0xffffffffu) {
+		close(fd);
+		return false;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		clear();
+		return true;
+	}
+	void* map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+	setExternal((unsigned char*)map, (unsigned int)st.st_size, releaseMapping, 0);
+	return true;
+#else
+	(void)filename;
+	return false;
+#endif
+}
+
+void ByteVector::resize(unsigned int width, unsigned int height, unsigned int bytesPerPixel)
+{
+	resize(width * height * bytesPerPixel);
 }
 
 
 void ByteVector::resize(unsigned int size)
 {
+	if (size > capacity_)
+		reallocate(size);
 	bufferSize_ = size;
+}
 
-	delete pBuffer_;
-	pBuffer_ = new unsigned char[bufferSize_];
+void ByteVector::reserve(unsigned int capacity)
+{
+	if (capacity > capacity_)
+		reallocate(capacity);
+}
+
+void ByteVector::shrinkToFit()
+{
+	if (bufferSize_ == 0)
+		clear();
+	else if (roundUp(bufferSize_, BYTEVECTOR_ALIGNMENT) < capacity_ && release_ == releaseHeap)
+		reallocate(bufferSize_);
 }
 
 void ByteVector::swap(ByteVector& v)
 {
-	unsigned char *pVBuff = v.buffer();
-	unsigned int vSize = v.size();
-	v.setArray(pBuffer_, bufferSize_, false);
-	setArray(pVBuff, vSize, false);
+	std::swap(bufferSize_, v.bufferSize_);
+	std::swap(capacity_, v.capacity_);
+	std::swap(pBuffer_, v.pBuffer_);
+	std::swap(release_, v.release_);
+	std::swap(releaseContext_, v.releaseContext_);
 }
 
 void ByteVector::copyIn(unsigned int pos, const unsigned char* pBytes, unsigned int numBytes)
@@ -84,4 +219,3 @@ void ByteVector::copyIn(unsigned int pos, const unsigned char* pBytes, unsigned
 		memcpy(pBuffer_ + pos, pBytes, numBytes);
 	}
 }
-
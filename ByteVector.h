@@ -5,8 +5,20 @@
 
 
 #include <stdexcept>
+#include <string>
 #include <vector>
 
+// storage is aligned to this many bytes (a power of two), for SIMD loads and DMA
+#ifndef BYTEVECTOR_ALIGNMENT
+#define BYTEVECTOR_ALIGNMENT 64
+#endif
+
+// buffers of at least this many bytes are mapped and backed by transparent
+// hugepages where the system has them; 0 keeps everything on the heap
+#ifndef BYTEVECTOR_HUGEPAGE_THRESHOLD
+#define BYTEVECTOR_HUGEPAGE_THRESHOLD 0
+#endif
+
 namespace FCInterface {
 	class ByteVector {
 	public:
@@ -15,14 +27,25 @@ namespace FCInterface {
 		ByteVector(ByteVector &&b);
 		ByteVector(unsigned int size); 
 		~ByteVector();
+		// takes over a buffer from malloc (as lodepng's are), it is released with free()
 		void setArray(unsigned char* pBuffer, unsigned int bufferSize, bool deleteExistingBuffer = true);
+		// maps a whole file copy-on-write, so it can be parsed without reading it; writes stay private.
+		// Returns false where files can't be mapped (non-Linux builds), so callers need a read fallback.
+		// Touching the mapping after the file has been truncated raises SIGBUS.
+		bool mapFile(const std::string& filename);
+		// releases the storage; resize(0) keeps it for reuse
 		void clear();
 		bool empty() const { return bufferSize_ == 0; }
+		// the storage is only reallocated when growing past the capacity; the
+		// contents up to the smaller of the old and new size are kept
 		void resize(unsigned int width, unsigned int height, unsigned int bytesPerPixel);
 		void resize(unsigned int size);
+		void reserve(unsigned int capacity);
+		void shrinkToFit();
 		unsigned char* buffer() const { return pBuffer_; }
 		void swap(ByteVector& v);
 		unsigned int size() const { return bufferSize_; }
+		unsigned int capacity() const { return capacity_; }
 
 		void copyIn(unsigned int pos, const unsigned char* pBytes, unsigned int numBytes);
 
@@ -32,8 +55,22 @@ namespace FCInterface {
 			return (this->pBuffer_[pos]);
 		}
 	private:
+		// gives back memory the vector doesn't own; size is the size it was handed over with
+		typedef void (*ReleaseFunc)(unsigned char* pBuffer, unsigned int size, void* context);
+
+		// wraps memory owned elsewhere (a mapping); release, if not NULL, is called with context
+		// once the vector lets go of it. Growing the vector past bufferSize moves the contents to
+		// the heap and releases the external memory.
+		void setExternal(unsigned char* pBuffer, unsigned int bufferSize, ReleaseFunc release, void* context);
+		static unsigned char* allocate(unsigned int& capacity, ReleaseFunc& release);
+		void reallocate(unsigned int capacity);
+		void release();
+
 		unsigned int bufferSize_;
+		unsigned int capacity_;
 		unsigned char* pBuffer_;
+		ReleaseFunc release_;
+		void* releaseContext_;
 	};
 
 
@@ -0,0 +1,47 @@
+#ifndef BYTEVIEW_H_
+#define BYTEVIEW_H_
+#ifndef FCUI_BYTE_VIEW_H
+#define FCUI_BYTE_VIEW_H
+
+
+#include "ByteVector.h"
+
+#include <stdexcept>
+
+namespace FCInterface {
+	// read-only bytes owned by someone else: a ByteVector, a mapped file, a slice
+	// of either. The owner has to outlive the view.
+	class ByteView {
+	public:
+		ByteView() : pBuffer_(0), bufferSize_(0) {}
+		ByteView(const unsigned char* pBuffer, unsigned int bufferSize) : pBuffer_(pBuffer), bufferSize_(bufferSize) {}
+		ByteView(const ByteVector& v) : pBuffer_(v.buffer()), bufferSize_(v.size()) {}
+
+		bool empty() const { return bufferSize_ == 0; }
+		const unsigned char* buffer() const { return pBuffer_; }
+		unsigned int size() const { return bufferSize_; }
+
+		// numBytes bytes from pos on, without copying them
+		ByteView slice(unsigned int pos, unsigned int numBytes) const {
+			if (pos > bufferSize_ || numBytes > bufferSize_ - pos)
+				throw std::out_of_range("ByteView: slice out of bounds");
+			return ByteView(pBuffer_ + pos, numBytes);
+		}
+
+		const unsigned char& operator[](const unsigned int pos) const {
+			if (pos >= bufferSize_)
+				throw std::out_of_range("ByteView: index out of bounds");
+			return (this->pBuffer_[pos]);
+		}
+	private:
+		const unsigned char* pBuffer_;
+		unsigned int bufferSize_;
+	};
+
+
+}
+
+#endif //!defined FCUI_BYTE_VIEW_H
+
+
+#endif // BYTEVIEW_H_
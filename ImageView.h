@@ -0,0 +1,51 @@
+#ifndef IMAGEVIEW_H_
+#define IMAGEVIEW_H_
+#ifndef FCUI_IMAGE_VIEW_H
+#define FCUI_IMAGE_VIEW_H
+
+
+#include "ByteVector.h"
+#include "PixelFormat.h"
+
+#include <cstddef>
+#include <stdexcept>
+
+namespace FCInterface {
+	// pixels owned by someone else: a ByteVector, a mapped texture or buffer object,
+	// a tile of an atlas. Lines are stride bytes apart; the owner has to outlive the view.
+	struct ImageView {
+		unsigned char* pixels;
+		unsigned int width;
+		unsigned int height;
+		unsigned int stride;
+		PixelFormat format;
+
+		ImageView() : pixels(0), width(0), height(0), stride(0), format(PixelFormatNone) {}
+		ImageView(unsigned char* pixels, unsigned int width, unsigned int height, unsigned int stride, PixelFormat format)
+			: pixels(pixels), width(width), height(height), stride(stride), format(format) {}
+		// a tightly packed image filling the vector
+		ImageView(ByteVector& v, unsigned int width, unsigned int height, PixelFormat format)
+			: pixels(v.buffer()), width(width), height(height), stride(width * PixelFormatToBytesPerPixel(format)), format(format) {
+			if ((unsigned long long)stride * height > v.size())
+				throw std::out_of_range("ImageView: image is bigger than the vector");
+		}
+
+		bool empty() const { return width == 0 || height == 0; }
+		unsigned int bytesPerPixel() const { return PixelFormatToBytesPerPixel(format); }
+		unsigned char* line(unsigned int y) const { return pixels + (size_t)y * stride; }
+
+		// the cropWidth x cropHeight rectangle at (x, y), sharing the pixels
+		ImageView crop(unsigned int x, unsigned int y, unsigned int cropWidth, unsigned int cropHeight) const {
+			if (x > width || cropWidth > width - x || y > height || cropHeight > height - y)
+				throw std::out_of_range("ImageView: crop out of bounds");
+			return ImageView(line(y) + x * bytesPerPixel(), cropWidth, cropHeight, stride, format);
+		}
+	};
+
+
+}
+
+#endif //!defined FCUI_IMAGE_VIEW_H
+
+
+#endif // IMAGEVIEW_H_
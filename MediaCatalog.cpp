@@ -0,0 +1,266 @@
+#include "MediaCatalog.h"
+
+#include "Log.h"
+#include "FileInfo.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace FCInterface;
+using namespace std;
+
+#define CATALOG_MAGIC 0xCA7A
+#define CATALOG_VERSION 0x01
+
+// fixed part of an index record; the name follows it
+#define CATALOG_RECORD_SIZE 44
+
+static bool entryNameLess(const MediaCatalog::Entry& a, const MediaCatalog::Entry& b)
+{
+	return a.name < b.name;
+}
+
+// the index is only ever read back on the device that wrote it, so values are
+// stored in native byte order, as saveFImage does
+template <typename T> static void put(string& out, T value)
+{
+	out.append((const char*)&value, sizeof(T));
+}
+
+template <typename T> static T get(const unsigned char*& p)
+{
+	T value;
+	memcpy(&value, p, sizeof(T));
+	p += sizeof(T);
+	return value;
+}
+
+MediaCatalog::MediaCatalog()
+{
+}
+
+bool MediaCatalog::load(const std::string& indexFile)
+{
+	entries_.clear();
+
+	ifstream fh(indexFile, ios_base::binary | ios_base::in);
+	if (!fh.is_open())
+		return false;
+
+	fh.seekg(0, std::ios_base::end);
+	unsigned int fileSize = (unsigned int)fh.tellg();
+	fh.seekg(0, std::ios_base::beg);
+	if (fileSize < 12) {
+		Log(LOG_ERROR, "Media catalog %s appears truncated - ignoring it", indexFile.c_str());
+		return false;
+	}
+
+	ByteVector contents(fileSize);
+	fh.read((char*)contents.buffer(), fileSize);
+	if (!fh) {
+		Log(LOG_ERROR, "Could not read media catalog %s", indexFile.c_str());
+		return false;
+	}
+
+	const unsigned char* p = contents.buffer();
+	const unsigned char* end = p + fileSize;
+	unsigned int magic = get<uint32_t>(p);
+	unsigned int version = get<uint32_t>(p);
+	unsigned int count = get<uint32_t>(p);
+	if (magic != CATALOG_MAGIC || version != CATALOG_VERSION) {
+		Log(LOG_ERROR, "Media catalog %s has an unknown format - ignoring it", indexFile.c_str());
+		return false;
+	}
+
+	entries_.reserve(count);
+	for (unsigned int i = 0; i < count; i++) {
+		if (end - p < CATALOG_RECORD_SIZE)
+			break;
+		Entry entry;
+		entry.size = get<uint64_t>(p);
+		entry.mtimeSec = get<int64_t>(p);
+		entry.mtimeNsec = get<uint32_t>(p);
+		entry.info.width = get<uint32_t>(p);
+		entry.info.height = get<uint32_t>(p);
+		entry.info.thumbOffset = get<uint32_t>(p);
+		entry.info.thumbLength = get<uint32_t>(p);
+		entry.info.mediaType = (FileMediaType)get<uint8_t>(p);
+		entry.info.pixelFormat = (PixelFormat)get<uint8_t>(p);
+		entry.info.orientation = get<uint8_t>(p);
+		p++;
+		unsigned int nameLength = get<uint16_t>(p);
+		p += 2;
+		if ((unsigned int)(end - p) < nameLength)
+			break;
+		entry.name.assign((const char*)p, nameLength);
+		p += nameLength;
+		entries_.push_back(entry);
+	}
+
+	if (entries_.size() != count) {
+		Log(LOG_ERROR, "Media catalog %s appears truncated - ignoring it", indexFile.c_str());
+		entries_.clear();
+		return false;
+	}
+
+	// save() writes the entries sorted, but don't rely on it for lookups
+	if (!is_sorted(entries_.begin(), entries_.end(), entryNameLess))
+		sort(entries_.begin(), entries_.end(), entryNameLess);
+	return true;
+}
+
+bool MediaCatalog::save(const std::string& indexFile) const
+{
+	string out;
+	out.reserve(12 + entries_.size() * (CATALOG_RECORD_SIZE + 32));
+	put<uint32_t>(out, CATALOG_MAGIC);
+	put<uint32_t>(out, CATALOG_VERSION);
+	put<uint32_t>(out, (uint32_t)entries_.size());
+	for (const Entry& entry : entries_) {
+		put<uint64_t>(out, entry.size);
+		put<int64_t>(out, entry.mtimeSec);
+		put<uint32_t>(out, entry.mtimeNsec);
+		put<uint32_t>(out, entry.info.width);
+		put<uint32_t>(out, entry.info.height);
+		put<uint32_t>(out, entry.info.thumbOffset);
+		put<uint32_t>(out, entry.info.thumbLength);
+		put<uint8_t>(out, (uint8_t)entry.info.mediaType);
+		put<uint8_t>(out, (uint8_t)entry.info.pixelFormat);
+		put<uint8_t>(out, (uint8_t)entry.info.orientation);
+		put<uint8_t>(out, 0);
+		put<uint16_t>(out, (uint16_t)entry.name.size());
+		put<uint16_t>(out, 0);
+		out.append(entry.name);
+	}
+
+	string tempFile = indexFile + ".tmp";
+	{
+		ofstream fh(tempFile, ios_base::binary | ios_base::trunc | ios_base::out);
+		if (!fh.is_open()) {
+			Log(LOG_ERROR, "Could not write media catalog %s", tempFile.c_str());
+			return false;
+		}
+		fh.write(out.data(), out.size());
+		if (!fh.flush()) {
+			Log(LOG_ERROR, "Could not write media catalog %s", tempFile.c_str());
+			remove(tempFile.c_str());
+			return false;
+		}
+	}
+
+	if (rename(tempFile.c_str(), indexFile.c_str()) != 0) {
+		Log(LOG_ERROR, "Could not replace media catalog %s", indexFile.c_str());
+		remove(tempFile.c_str());
+		return false;
+	}
+	return true;
+}
+
+// collect the images below directory; only the directory entries and an lstat() per
+// image are needed here, the files themselves are not opened
+static void listImages(const string& directory, const string& prefix, vector<MediaCatalog::Entry>& out)
+{
+	DIR* dir = opendir(directory.c_str());
+	if (!dir) {
+		Log(LOG_ERROR, "Media catalog: could not open directory %s", directory.c_str());
+		return;
+	}
+
+	struct dirent* de;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		string path = directory + "/" + de->d_name;
+		struct stat st;
+		if (lstat(path.c_str(), &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			listImages(path, prefix + de->d_name + "/", out);
+		}
+		else if (S_ISREG(st.st_mode)) {
+			FileMediaType mediaType = MediaLoader::guessMediaType(de->d_name);
+			if (mediaType != FileMediaType::FMT_JPEG && mediaType != FileMediaType::FMT_PNG)
+				continue;
+
+			MediaCatalog::Entry entry;
+			entry.name = prefix + de->d_name;
+			entry.size = (uint64_t)st.st_size;
+			entry.mtimeSec = (int64_t)st.st_mtim.tv_sec;
+			entry.mtimeNsec = (uint32_t)st.st_mtim.tv_nsec;
+			entry.info.mediaType = FileMediaType::FMT_UNKNOWN;
+			out.push_back(entry);
+		}
+	}
+	closedir(dir);
+}
+
+unsigned int MediaCatalog::scan(const std::string& directory, unsigned int threadCount)
+{
+	vector<Entry> current;
+	listImages(directory, "", current);
+	sort(current.begin(), current.end(), entryNameLess);
+
+	// carry over everything that hasn't changed since the last scan
+	vector<Entry*> pending;
+	for (Entry& entry : current) {
+		const Entry* previous = find(entry.name);
+		if (previous && previous->size == entry.size && previous->mtimeSec == entry.mtimeSec && previous->mtimeNsec == entry.mtimeNsec)
+			entry.info = previous->info;
+		else
+			pending.push_back(&entry);
+	}
+
+	if (threadCount == 0)
+		threadCount = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threadCount > pending.size())
+		threadCount = (unsigned int)pending.size();
+
+	// probing is dominated by open() and the first read of each file, so the files are
+	// handed out one at a time to keep that latency overlapped
+	atomic<size_t> next(0);
+	auto worker = [&]() {
+		size_t i;
+		while ((i = next++) < pending.size()) {
+			Entry& entry = *pending[i];
+			if (!MediaLoader::probe(directory + "/" + entry.name, entry.info))
+				entry.info.mediaType = FileMediaType::FMT_UNKNOWN;
+		}
+	};
+
+	vector<thread> threads;
+	for (unsigned int i = 1; i < threadCount; i++)
+		threads.emplace_back(worker);
+	worker();
+	for (thread& t : threads)
+		t.join();
+
+	entries_.swap(current);
+	return (unsigned int)pending.size();
+}
+
+const MediaCatalog::Entry* MediaCatalog::find(const std::string& name) const
+{
+	Entry key;
+	key.name = name;
+	vector<Entry>::const_iterator it = lower_bound(entries_.begin(), entries_.end(), key, entryNameLess);
+	if (it == entries_.end() || it->name != name)
+		return NULL;
+	return &*it;
+}
+
+FileMediaType MediaCatalog::mediaType(const std::string& name) const
+{
+	const Entry* entry = find(name);
+	if (entry && entry->info.mediaType != FileMediaType::FMT_UNKNOWN)
+		return entry->info.mediaType;
+	return MediaLoader::guessMediaType(name);
+}
@@ -0,0 +1,55 @@
+#ifndef MEDIACATALOG_H_
+#define MEDIACATALOG_H_
+
+
+#ifndef MEDIACATALOG_H
+#define MEDIACATALOG_H
+
+#include "MediaLoader.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace FCInterface {
+
+	// Metadata for every image below a directory, taken from the file headers only
+	// (see MediaLoader::probe). The catalog is kept in an index file; on later scans
+	// only files whose size or modification time changed are probed again.
+	class MediaCatalog {
+	public:
+		struct Entry {
+			std::string name;			// path relative to the scanned directory
+			uint64_t size;
+			int64_t mtimeSec;
+			uint32_t mtimeNsec;
+			MediaLoader::ProbeInfo info;	// mediaType is FMT_UNKNOWN if the file could not be probed
+		};
+
+		MediaCatalog();
+
+		// replace the catalog with the contents of an index file written by save()
+		bool load(const std::string& indexFile);
+		// written to a temporary file first, so a power cut never leaves a truncated index
+		bool save(const std::string& indexFile) const;
+
+		// bring the catalog in line with the directory tree, probing new and changed files
+		// on threadCount threads (0 = one per CPU); returns the number of files probed
+		unsigned int scan(const std::string& directory, unsigned int threadCount = 0);
+
+		const Entry* find(const std::string& name) const;
+		const std::vector<Entry>& entries() const { return entries_; }
+
+		// the media type recorded for a file, which is based on its contents; files that
+		// are not in the catalog fall back to MediaLoader::guessMediaType
+		FileMediaType mediaType(const std::string& name) const;
+
+	private:
+		std::vector<Entry> entries_;	// sorted by name
+	};
+}
+
+#endif //!defined MEDIACATALOG_H
+
+
+#endif // MEDIACATALOG_H_
@@ -8,11 +8,114 @@
 #include "FileInfo.h"
 
 #include <fstream>
+#include <memory>
 #include <vector>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace FCInterface;
 using namespace std;
 
+// decoders are reused across loads so their plane buffers are too
+static uJPEGPool& jpegDecoders()
+{
+	static uJPEGPool pool;
+	return pool;
+}
+
+// lodepng allocates from a per-thread arena while a PNG is decoded. The arena is emptied,
+// not freed, after each image, so once it has grown to fit the largest one a decode costs no heap calls
+class PNGArenaScope
+{
+public:
+	PNGArenaScope() : scope(&arena()) {}
+	~PNGArenaScope() { lodepng_arena_reset(&arena()); }
+
+private:
+	struct Arena
+	{
+		LodePNGArena arena;
+		Arena() { lodepng_arena_init(&arena, 1 << 20); }
+		~Arena() { lodepng_arena_cleanup(&arena); }
+	};
+
+	static LodePNGArena& arena()
+	{
+		static thread_local Arena a;
+		return a.arena;
+	}
+
+	lodepng::ArenaScope scope;
+};
+
+// off by default: a mapped file that is truncated, or on removable media that goes away, raises
+// SIGBUS while it is decoded, where a read would just fail
+static bool mapFiles = false;
+
+void MediaLoader::setMapFiles(bool enable)
+{
+	mapFiles = enable;
+}
+
+// the contents of filename, mapped when that is enabled and works and read otherwise. A file larger
+// than maxFileSize (if it isn't 0) isn't read and leaves contentsOut empty; fileSizeOut is its size
+static bool loadFile(const std::string& filename, ByteVector& contentsOut, unsigned long long& fileSizeOut, unsigned int maxFileSize)
+{
+	if (mapFiles && contentsOut.mapFile(filename)) {
+		fileSizeOut = contentsOut.size();
+		return true;
+	}
+
+	std::ifstream file(filename, ios_base::binary);
+	if (!file.is_open())
+		return false;
+
+	file.seekg(0, std::ios_base::end);
+	std::streampos fileSize = file.tellg();
+	if (fileSize < 0)
+		return false;
+	fileSizeOut = (unsigned long long)fileSize;
+	contentsOut.clear();
+	if ((maxFileSize > 0 && fileSizeOut > maxFileSize) || fileSizeOut > 0xffffffffu)
+		return true;
+
+	contentsOut.resize((unsigned int)fileSizeOut);
+	file.seekg(0, std::ios_base::beg);
+	file.read((char*)contentsOut.buffer(), fileSize);
+	contentsOut.resize((unsigned int)file.gcount());
+	return true;
+}
+
+// format a PNG is loaded as: RGB and palette images are expanded to RGBA, 8-bit RGBA and greyscale
+// ones are used as they are, and PixelFormatNone for the rest, which can't be loaded
+static PixelFormat pngLoadFormat(unsigned int colorType, unsigned int bitDepth)
+{
+	if (colorType == LCT_RGB || colorType == LCT_PALETTE)
+		return PixelFormat::PixelFormatRGBA;
+	if (bitDepth == 8 && colorType == LCT_RGBA)
+		return PixelFormat::PixelFormatRGBA;
+	if (bitDepth == 8 && colorType == LCT_GREY)
+		return PixelFormat::PixelFormatGreyscale;
+	return PixelFormat::PixelFormatNone;
+}
+
+// decode a PNG whose header state has inspected into dest, converted to its format
+static bool decodePNGInto(lodepng::State& state, ByteView png, const ImageView& dest)
+{
+	state.info_raw.colortype = dest.format == PixelFormat::PixelFormatGreyscale ? LCT_GREY
+		: dest.format == PixelFormat::PixelFormatRGB ? LCT_RGB : LCT_RGBA;
+	state.info_raw.bitdepth = 8;
+
+	unsigned int width, height;
+	unsigned error = lodepng_decode_rows(dest.pixels, dest.stride, &width, &height, &state, png.buffer(), png.size());
+	if (error) {
+		Log(LOG_ERROR, "Could not load PNG %s", lodepng_error_text(error));
+		return false;
+	}
+	return true;
+}
+
 bool MediaLoader::loadPNG(const std::string& filename, unsigned int& width, unsigned int& height, ByteVector& img, FCInterface::PixelFormat& imageTypeOut, unsigned int maxWidth, unsigned int maxHeight, unsigned int maxFileSize)
 {
 	unsigned int bppOut;
@@ -26,23 +129,16 @@ bool MediaLoader::loadPNG(const std::string& filename, unsigned int& widthOut, u
 	unsigned int& bppOut, ByteVector& buffer, bool makePOT, float& usageOutX, float& usageOutY, FCInterface::PixelFormat& imageTypeOut, unsigned int maxWidth, unsigned int maxHeight, unsigned int maxFileSize)
 {
 	ByteVector fileContents;
-	std::ifstream file(filename, ios_base::binary);
-	if (!file.is_open()) {
+	unsigned long long fileSize;
+	if (!loadFile(filename, fileContents, fileSize, maxFileSize)) {
 		Log(LOG_ERROR, "Media Loader: Could not open PNG file %s", filename.c_str());
 		return false;
 	}
 
-	file.seekg(0, std::ios_base::end);
-	std::streampos fileSize = file.tellg();
 	if (maxFileSize > 0 && fileSize > maxFileSize) {
-		Log(LOG_ERROR, "Media Loader: File %s (size %u bytes) exceeded maximum size of %u bytes", filename.c_str(), fileSize, maxFileSize);
+		Log(LOG_ERROR, "Media Loader: File %s (size %llu bytes) exceeded maximum size of %u bytes", filename.c_str(), fileSize, maxFileSize);
 		return false;
 	}
-	fileContents.resize((unsigned int)fileSize);
-	file.seekg(0, std::ios_base::beg);
-
-	file.read((char*)&fileContents[0], fileSize);
-	file.close();
 
 	if (fileContents.size() == 0) {
 		Log(LOG_ERROR, "MediaLoader - Could not load PNG file: %s", filename.c_str());
@@ -60,171 +156,137 @@ bool MediaLoader::loadPNG(const std::string& filename, unsigned int& widthOut, u
 
 }
 
-bool MediaLoader::loadPNGFromMemory(const ByteVector& fileContents, unsigned int& widthOut, unsigned int& heightOut, 
+bool MediaLoader::loadPNGFromMemory(ByteView fileContents, unsigned int& widthOut, unsigned int& heightOut, 
 	ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, 
-	unsigned int maxWidth, unsigned int maxHeight)
+	unsigned int maxWidth, unsigned int maxHeight, bool verifyChecksums)
 {
 	unsigned int bppOut;
 	float usageX, usageY;
-	return loadPNGFromMemory(fileContents, widthOut, heightOut, bppOut, imgOut, false, usageX, usageY, pixelFormatOut, maxWidth, maxHeight);
+	return loadPNGFromMemory(fileContents, widthOut, heightOut, bppOut, imgOut, false, usageX, usageY, pixelFormatOut, maxWidth, maxHeight, verifyChecksums);
 
 }
 
-bool MediaLoader::loadPNGFromMemory(const ByteVector& fileContents, unsigned int& widthOut, unsigned int& heightOut,
-	unsigned int& bppOut, ByteVector& buffer, bool makePOT, float& usageOutX, float& usageOutY, FCInterface::PixelFormat& imageTypeOut, unsigned int maxWidth, unsigned int maxHeight)
+bool MediaLoader::loadPNGFromMemory(ByteView fileContents, unsigned int& widthOut, unsigned int& heightOut,
+	unsigned int& bppOut, ByteVector& buffer, bool makePOT, float& usageOutX, float& usageOutY, FCInterface::PixelFormat& imageTypeOut, unsigned int maxWidth, unsigned int maxHeight, bool verifyChecksums)
 {
-	//unsigned int error = lodepng::load_file(fileContents, filename); //load the image file with given filename
-
+	// declared before the state, so the state is gone before the arena is reset
+	PNGArenaScope arenaScope;
 	lodepng::State state;
 	state.maxImageWidth = maxWidth;
 	state.maxImageHeight = maxHeight;
-	state.decoder.color_convert = false;
-
-	if (makePOT) {
-
-		ByteVector image;
-		unsigned int width, height;
-		unsigned error = lodepng::decode(image, width, height, state, fileContents);
+	if (!verifyChecksums) {
+		state.decoder.ignore_crc = 1;
+		state.decoder.zlibsettings.ignore_adler32 = 1;
+	}
 
-		if (error)
-		{
+	unsigned int width, height;
+	unsigned error = lodepng_inspect(&width, &height, &state, fileContents.buffer(), fileContents.size());
+	if (error) {
+		Log(LOG_ERROR, "Could not load PNG %s", lodepng_error_text(error));
+		return false;
+	}
 
-			return false;
-		}
+	imageTypeOut = pngLoadFormat(state.info_png.color.colortype, state.info_png.color.bitdepth);
+	if (imageTypeOut == PixelFormat::PixelFormatRGBA)
+		bppOut = 32;
+	else if (imageTypeOut == PixelFormat::PixelFormatGreyscale)
+		bppOut = 8;
+	else {
+		Log(LOG_ERROR, "Loaded PNG but format is unsupported");
+		return false;
+	}
 
-		if (state.info_raw.bitdepth != 8 || !(state.info_raw.colortype == LCT_RGBA || state.info_raw.colortype == LCT_GREY)) {
-			Log(LOG_ERROR, "Loaded PNG but format is unsupported");
-			return false;
-		}
+	if ((maxWidth > 0 && width > maxWidth) || (maxHeight > 0 && height > maxHeight)) {
+		Log(LOG_ERROR, "Could not load PNG %s", lodepng_error_text(95));
+		return false;
+	}
 
+	widthOut = width;
+	heightOut = height;
+	if (makePOT) {
 		widthOut = 1;
 		heightOut = 1;
 		while (widthOut < width)
 			widthOut <<= 1;
 		while (heightOut < height)
 			heightOut <<= 1;
+	}
+	usageOutX = (float)width / (float)widthOut;
+	usageOutY = (float)height / (float)heightOut;
 
-		usageOutX = (float)width / (float)widthOut;
-		usageOutY = (float)height / (float)heightOut;
-
-		if (state.info_raw.colortype == LCT_RGBA) {
-			bppOut = 32;
-			imageTypeOut = PixelFormat::PixelFormatRGBA;
-		} 
-		else {
-			bppOut = 8;
-			imageTypeOut = PixelFormat::PixelFormatGreyscale;
-		}
-		
-
-		if (bppOut == 32)
-		{
-			buffer.resize(4 * widthOut * heightOut);
-			unsigned int* pixIn = (unsigned int*)&image[0];
-			unsigned int* pixOut = (unsigned int*)&buffer[0];
-			
-			for (unsigned int y = 0; y < height; y++) {
-				for (unsigned int x = 0; x < width; x++) {
-					pixOut[y*widthOut + x] = pixIn[y*width + x];
-				}
-			}
-		}
-		else if (bppOut == 8)
-		{
-			buffer.resize(widthOut * heightOut);
-			unsigned char* pixIn = (unsigned char*)&image[0];
-			unsigned char* pixOut = (unsigned char*)&buffer[0];
-
-			for (unsigned int y = 0; y < height; y++) {
-				for (unsigned int x = 0; x < width; x++) {
-					pixOut[y*widthOut + x] = pixIn[y*width + x];
-				}
-			}
-		}
-	} else {
-		
-		unsigned error = lodepng::decode(buffer, widthOut, heightOut, state, fileContents);
-
-		if (error)
-		{
-			Log(LOG_ERROR, "Could not load PNG %s", lodepng_error_text(error));
-			return false;
-		}
-
-
-
-		if (state.info_raw.bitdepth != 8 || !(state.info_raw.colortype == LCT_RGBA || state.info_raw.colortype == LCT_GREY || state.info_raw.colortype == LCT_RGB || state.info_raw.colortype == LCT_PALETTE)) {
-			Log(LOG_ERROR, "Loaded PNG  but format is unsupported");
-			return false;
-		}
+	// the rows are decoded straight into place, so there is no second full-size copy of the image;
+	// the padding of a POT buffer is left as it is
+	unsigned int bytesPerPixel = bppOut / 8;
+	if ((unsigned long long)widthOut * heightOut * bytesPerPixel > 0xffffffffu) {
+		Log(LOG_ERROR, "Could not load PNG %s", lodepng_error_text(92));
+		return false;
+	}
+	buffer.resize(widthOut * heightOut * bytesPerPixel);
 
-		usageOutX = 1;
-		usageOutY = 1;
+	return decodePNGInto(state, fileContents, ImageView(buffer.buffer(), widthOut, heightOut, widthOut * bytesPerPixel, imageTypeOut));
+}
 
-		if (state.info_raw.colortype == LCT_RGBA) {
-			bppOut = 32;
-			imageTypeOut = PixelFormat::PixelFormatRGBA;
-		} 
-		else if (state.info_raw.colortype == LCT_RGB) {
-			bppOut = 24;
-			imageTypeOut = PixelFormat::PixelFormatRGB;
-		}
-		else if (state.info_raw.colortype == LCT_PALETTE) {
-			bppOut = 8;
-			imageTypeOut = PixelFormat::PixelFormatGreyscale;
-		}
-		else {
-			bppOut = 8;
-			imageTypeOut = PixelFormat::PixelFormatGreyscale;
-		}
+bool MediaLoader::loadPNGInto(ByteView fileContents, const ImageView& dest, unsigned int& widthOut, unsigned int& heightOut, bool verifyChecksums)
+{
+	PNGArenaScope arenaScope;
+	lodepng::State state;
+	if (!verifyChecksums) {
+		state.decoder.ignore_crc = 1;
+		state.decoder.zlibsettings.ignore_adler32 = 1;
+	}
 
+	unsigned error = lodepng_inspect(&widthOut, &heightOut, &state, fileContents.buffer(), fileContents.size());
+	if (error) {
+		Log(LOG_ERROR, "Could not load PNG %s", lodepng_error_text(error));
+		return false;
+	}
+	if (dest.bytesPerPixel() == 0 || widthOut > dest.width || heightOut > dest.height) {
+		Log(LOG_ERROR, "Could not load PNG: %ux%u pixels don't fit the destination", widthOut, heightOut);
+		return false;
 	}
 
-	return true;
+	return decodePNGInto(state, fileContents, dest);
 }
 
+static bool decodeJPEGRegion(ByteView fileContents, unsigned int regionX, unsigned int regionY, unsigned int regionWidth, unsigned int regionHeight, int orientation,
+	unsigned int& xOut, unsigned int& yOut, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth, unsigned int maxHeight);
 
-bool MediaLoader::loadJPEGThumbFromMemory(const ByteVector& fileContents, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth, unsigned int maxHeight)
+bool MediaLoader::loadJPEGThumbFromMemory(ByteView fileContents, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth, unsigned int maxHeight)
 {
-	uJPEG jpeg;
-	jpeg.setMaxDimensions(maxWidth, maxHeight);
-	jpeg.setThumbnailMode(true);
-
-	if (!jpeg.decode(&fileContents[0], (int)fileContents.size())) {
-		Log(LOG_ERROR, "Media Loader: Error decoding the input file %u", ujGetError());
-		return false;
-	}
+	// the thumbnail is decoded where it is inside the file
+	ByteView thumbData;
+	int orientation;
+	{
+		uJPEGPool::Handle jpeg(jpegDecoders());
+		jpeg->setMaxDimensions(maxWidth, maxHeight);
+		jpeg->setThumbnailMode(true);
 
-	ByteVector thumbData;
-	if (jpeg.getThumb(thumbData)) {
-		loadJPEGFromMemory(thumbData, widthOut, heightOut, imgOut, pixelFormatOut, maxWidth, maxHeight);
-		return true;
-	}
-	else {
-		return false;
+		if (!jpeg->decode(fileContents)) {
+			Log(LOG_ERROR, "Media Loader: Error decoding the input file %u", jpeg->getError());
+			return false;
+		}
+		if (!jpeg->getThumb(thumbData))
+			return false;
+		// the thumbnail has no Exif segment of its own, but is stored like the picture
+		orientation = jpeg->getOrientation();
 	}
 
+	// the decoder is back in the pool before the thumbnail itself is decoded
+	unsigned int xOut, yOut;
+	return decodeJPEGRegion(thumbData, 0, 0, 0, 0, orientation, xOut, yOut, widthOut, heightOut, imgOut, pixelFormatOut, maxWidth, maxHeight);
 }
 
 bool MediaLoader::loadJPEG(const std::string& filename, unsigned int& widthOut, unsigned int& heightOut, 
 	ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth, unsigned int maxHeight, unsigned int maxFileSize)
 {
-	std::ifstream file(filename, ios_base::binary);
-	if (!file.is_open()) {
+	ByteVector jpegData;
+	unsigned long long fileSize;
+	if (!loadFile(filename, jpegData, fileSize, maxFileSize)) {
 		Log(LOG_ERROR, "Media Loader: Could not open file %s", filename.c_str());
 		return false;
 	}
 
-	ByteVector jpegData;
-
-	file.seekg(0, std::ios_base::end);
-	std::streampos fileSize = file.tellg();
 	if (maxFileSize == 0 || maxFileSize >= fileSize) {
-		jpegData.resize((unsigned int)fileSize);
-		file.seekg(0, std::ios_base::beg);
-		file.read((char*)&jpegData[0], fileSize);
-		file.close();
-
 		return loadJPEGFromMemory(jpegData, widthOut, heightOut, imgOut, pixelFormatOut, maxWidth, maxHeight);
 	}
 	else {
@@ -237,56 +299,130 @@ bool MediaLoader::loadJPEG(const std::string& filename, unsigned int& widthOut,
 
 
 
-bool MediaLoader::loadJPEGFromMemory(const ByteVector& fileContents, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth, unsigned int maxHeight)
+bool MediaLoader::loadJPEGFromMemory(ByteView fileContents, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth, unsigned int maxHeight)
 {
-	uJPEG jpeg;
-	//	jpeg.setChromaMode(UJ_CHROMA_MODE_FAST);
+	unsigned int xOut, yOut;
+	return loadJPEGRegionFromMemory(fileContents, 0, 0, 0, 0, xOut, yOut, widthOut, heightOut, imgOut, pixelFormatOut, maxWidth, maxHeight);
+}
 
-	jpeg.setMaxDimensions(maxWidth, maxHeight);
+bool MediaLoader::loadJPEGRegionFromMemory(ByteView fileContents, unsigned int regionX, unsigned int regionY, unsigned int regionWidth, unsigned int regionHeight,
+	unsigned int& xOut, unsigned int& yOut, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth, unsigned int maxHeight)
+{
+	return decodeJPEGRegion(fileContents, regionX, regionY, regionWidth, regionHeight, 0, xOut, yOut, widthOut, heightOut, imgOut, pixelFormatOut, maxWidth, maxHeight);
+}
 
-	if (!jpeg.decode(&fileContents[0], (int)fileContents.size())) {
-		Log(LOG_ERROR, "Media Loader: Error decoding the input file %u", ujGetError());
+// orientation: EXIF orientation to use instead of the file's, 0 for the file's
+static bool decodeJPEGRegion(ByteView fileContents, unsigned int regionX, unsigned int regionY, unsigned int regionWidth, unsigned int regionHeight, int orientation,
+	unsigned int& xOut, unsigned int& yOut, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth, unsigned int maxHeight)
+{
+	uJPEGPool::Handle jpeg(jpegDecoders());
+	//	jpeg->setChromaMode(UJ_CHROMA_MODE_FAST);
+
+	jpeg->setMaxDimensions(maxWidth, maxHeight);
+	jpeg->setCrop((int)regionX, (int)regionY, (int)regionWidth, (int)regionHeight);
+	jpeg->setOrientation(orientation);
+	// rotating while converting saves the caller a pass over the whole picture; regions are
+	// given in stored pixels, so they are returned as stored
+	if (regionWidth == 0 || regionHeight == 0)
+		jpeg->setAutoOrient(true);
+	jpeg->setThreadCount((int)sysconf(_SC_NPROCESSORS_ONLN));
+
+	if (!jpeg->decode(fileContents)) {
+		Log(LOG_ERROR, "Media Loader: Error decoding the input file %u", jpeg->getError());
 		return false;
 	}
 
 
-	bool result = true;
-	unsigned int imageSize = jpeg.getImageSize();
-	unsigned int indexIn = 0, indexOut = 0;
-	ByteVector pixels;
-	jpeg.getImage(pixels);
-	unsigned char* pPixelsIn = &pixels[0];
+	unsigned int imageSize = jpeg->getImageSize();
 
-	if (jpeg.isColor() == 1 && imageSize == (jpeg.getWidth() * jpeg.getHeight() * 4)) {
+	if (jpeg->isColor() == 1 && imageSize == (jpeg->getWidth() * jpeg->getHeight() * 4)) {
 		pixelFormatOut = PixelFormat::PixelFormatRGBA;
 	}
-	else if (imageSize == (jpeg.getWidth() * jpeg.getHeight()) * 3) {
+	else if (imageSize == (jpeg->getWidth() * jpeg->getHeight()) * 3) {
 		pixelFormatOut = PixelFormat::PixelFormatRGB;
 	}
-	else if (imageSize == (jpeg.getWidth() * jpeg.getHeight())) {
+	else if (imageSize == (jpeg->getWidth() * jpeg->getHeight())) {
 		pixelFormatOut = PixelFormat::PixelFormatGreyscale;
 	}
 	else {
-		result = false;
+		return false;
 	}
 
-	if (result) {
-		imgOut.resize(pixels.size());
-		imgOut.swap(pixels);
+	// convert straight into the caller's buffer; it is only reallocated if
+	// its size doesn't match
+	if (!jpeg->getImage(imgOut))
+		return false;
+
+	int x, y;
+	jpeg->getCropOffset(x, y);
+	xOut = (unsigned int)x;
+	yOut = (unsigned int)y;
+	widthOut = (unsigned int)jpeg->getWidth();
+	heightOut = (unsigned int)jpeg->getHeight();
 
-		widthOut = (unsigned int)jpeg.getWidth();
-		heightOut = (unsigned int)jpeg.getHeight();
-	}
+	return true;
+}
 
+bool MediaLoader::loadJPEGInto(ByteView fileContents, const ImageView& dest, unsigned int& widthOut, unsigned int& heightOut, unsigned int maxWidth, unsigned int maxHeight)
+{
+	int format;
+	switch (dest.format) {
+	case PixelFormat::PixelFormatRGBA:
+		format = UJ_PIXEL_FORMAT_RGBA;
+		break;
+	case PixelFormat::PixelFormatRGB:
+		format = UJ_PIXEL_FORMAT_RGB;
+		break;
+	case PixelFormat::PixelFormatGreyscale:
+		format = UJ_PIXEL_FORMAT_GRAY;
+		break;
+	default:
+		Log(LOG_ERROR, "Media Loader: Unsupported destination format %u", (unsigned int)dest.format);
+		return false;
+	}
 
-	return result;
+	uJPEGPool::Handle jpeg(jpegDecoders());
+	jpeg->setMaxDimensions(maxWidth, maxHeight);
+	jpeg->setAutoOrient(true);
+	jpeg->setThreadCount((int)sysconf(_SC_NPROCESSORS_ONLN));
 
+	if (!jpeg->decode(fileContents)) {
+		Log(LOG_ERROR, "Media Loader: Error decoding the input file %u", jpeg->getError());
+		return false;
+	}
 
+	widthOut = (unsigned int)jpeg->getWidth();
+	heightOut = (unsigned int)jpeg->getHeight();
+	if (widthOut > dest.width || heightOut > dest.height) {
+		Log(LOG_ERROR, "Media Loader: %ux%u pixels don't fit the destination", widthOut, heightOut);
+		return false;
+	}
 
+	return jpeg->getImage(dest.pixels, (int)dest.stride, format);
+}
 
+// like lodepng_encode_file, but filtered and compressed on one thread per CPU; full-screen
+// captures are big enough for lodepng's banded encoder to pay off. fastEncode switches to
+// lodepng's fast preset, which gives somewhat bigger files in a fraction of the time
+static unsigned encodePNGFile(const std::string& filename, const unsigned char* pixels, unsigned int width, unsigned int height, LodePNGColorType colorType, bool fastEncode)
+{
+	lodepng::State state;
+	state.info_raw.colortype = colorType;
+	state.info_raw.bitdepth = 8;
+	state.info_png.color.colortype = colorType;
+	state.info_png.color.bitdepth = 8;
+	state.encoder.num_threads = 0;
+	if (fastEncode)
+		lodepng_encoder_settings_fast(&state.encoder);
+
+	ByteVector png;
+	unsigned error = lodepng::encode(png, pixels, width, height, state);
+	if (!error)
+		error = lodepng::save_file(png, filename);
+	return error;
 }
 
-bool MediaLoader::savePNG(const std::string& filename, ByteVector& pixels, unsigned int width, unsigned int height, PixelFormat pixelFormat, bool flipVertical)
+bool MediaLoader::savePNG(const std::string& filename, ByteVector& pixels, unsigned int width, unsigned int height, PixelFormat pixelFormat, bool flipVertical, bool fastEncode)
 {
 	unsigned int bytesPerPixel = PixelFormatToBytesPerPixel(pixelFormat);
 	if (pixels.size() != (width * height * bytesPerPixel)) {
@@ -325,13 +461,13 @@ bool MediaLoader::savePNG(const std::string& filename, ByteVector& pixels, unsig
 
 	if (pixelFormat == PixelFormat::PixelFormatRGBA) {
 
-		if (lodepng_encode32_file(filename.c_str(), &pixels[0], width, height) != 0) {
+		if (encodePNGFile(filename, &pixels[0], width, height, LCT_RGBA, fastEncode) != 0) {
 			Log(LOG_ERROR, "Could not save 32-bit PNG at %s", filename.c_str());
 			return false;
 		}
 	}
 	else if (pixelFormat == PixelFormat::PixelFormatRGB) {
-		if (lodepng_encode24_file(filename.c_str(), &pixels[0], width, height) != 0) {
+		if (encodePNGFile(filename, &pixels[0], width, height, LCT_RGB, fastEncode) != 0) {
 			Log(LOG_ERROR, "Could not save 24-bit PNG at %s", filename.c_str());
 			return false;
 		}
@@ -379,7 +515,209 @@ FileMediaType MediaLoader::guessMediaType(const std::string& filename)
 		return FileMediaType::FMT_UNKNOWN;
 	}
 }
-bool MediaLoader::loadImageFromMemory(const ByteVector& fileContents, FileMediaType mediaType, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth, unsigned int maxHeight)
+
+// probing reads the file through a small window that only moves when a segment the
+// parser cares about lies outside it, so skipped segments are never read at all
+#define PROBE_WINDOW_SIZE 4096
+#define PROBE_MAX_SEGMENT_SIZE 65536
+
+struct ProbeReader {
+	int fd;
+	off_t fileSize;
+	off_t windowPos;
+	size_t windowSize;
+	unsigned char window[PROBE_MAX_SEGMENT_SIZE + 4];
+
+	// pointer to bytes [pos, pos + size) of the file, or NULL if they don't exist
+	const unsigned char* get(off_t pos, size_t size)
+	{
+		if (size > sizeof(window) || pos < 0 || pos + (off_t)size > fileSize)
+			return NULL;
+		if (pos >= windowPos && pos + (off_t)size <= windowPos + (off_t)windowSize)
+			return &window[pos - windowPos];
+
+		size_t want = size < PROBE_WINDOW_SIZE ? PROBE_WINDOW_SIZE : size;
+		if (pos + (off_t)want > fileSize)
+			want = (size_t)(fileSize - pos);
+		ssize_t got = pread(fd, window, want, pos);
+		if (got < (ssize_t)size) {
+			windowSize = 0;
+			return NULL;
+		}
+		windowPos = pos;
+		windowSize = (size_t)got;
+		return window;
+	}
+};
+
+static unsigned int probeGet16(const unsigned char* p, bool motorola)
+{
+	return motorola ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+static unsigned int probeGet32(const unsigned char* p, bool motorola)
+{
+	return motorola ? ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]
+		: ((unsigned int)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+// pick orientation and thumbnail location out of an APP1 segment; tiffPos is the file
+// offset of the TIFF header, which the thumbnail offset is relative to
+static void probeExif(const unsigned char* tiff, unsigned int size, off_t tiffPos, MediaLoader::ProbeInfo& infoOut)
+{
+	if (size < 8)
+		return;
+	bool motorola;
+	if (tiff[0] == 'I' && tiff[1] == 'I')
+		motorola = false;
+	else if (tiff[0] == 'M' && tiff[1] == 'M')
+		motorola = true;
+	else
+		return;
+
+	unsigned int thumbOffset = 0, thumbLength = 0;
+	unsigned int ifd = probeGet32(tiff + 4, motorola);
+	// IFD0 holds the orientation, IFD1 describes the thumbnail
+	for (int i = 0; i < 2 && ifd && ifd <= size - 2; ++i) {
+		unsigned int count = probeGet16(tiff + ifd, motorola);
+		if (ifd + 2 + count * 12 + 4 > size)
+			return;
+		const unsigned char* entry = tiff + ifd + 2;
+		for (unsigned int e = 0; e < count; ++e, entry += 12) {
+			unsigned int tag = probeGet16(entry, motorola);
+			unsigned int type = probeGet16(entry + 2, motorola);
+			unsigned int value = (type == 3) ? probeGet16(entry + 8, motorola) : probeGet32(entry + 8, motorola);
+			if (tag == 0x0112 && i == 0 && value >= 1 && value <= 8)
+				infoOut.orientation = value;
+			else if (tag == 0x0201 && i == 1)
+				thumbOffset = value;
+			else if (tag == 0x0202 && i == 1)
+				thumbLength = value;
+		}
+		ifd = probeGet32(entry, motorola);
+	}
+
+	if (thumbOffset && thumbLength && thumbOffset < size && thumbLength <= size - thumbOffset) {
+		infoOut.thumbOffset = (unsigned int)(tiffPos + thumbOffset);
+		infoOut.thumbLength = thumbLength;
+	}
+}
+
+static bool probeJPEG(ProbeReader& reader, MediaLoader::ProbeInfo& infoOut)
+{
+	off_t pos = 2;
+	bool exifSeen = false;
+	for (;;) {
+		const unsigned char* p = reader.get(pos, 4);
+		if (!p || p[0] != 0xFF)
+			return false;
+		if (p[1] == 0xFF) {
+			// fill byte
+			++pos;
+			continue;
+		}
+		unsigned int marker = p[1];
+		if (marker == 0xD9 || marker == 0xDA)
+			return false; // EOI or SOS without a frame header
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+			pos += 2;
+			continue;
+		}
+		unsigned int length = (p[2] << 8) | p[3];
+		if (length < 2)
+			return false;
+
+		if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+			// SOFn
+			p = reader.get(pos + 4, 6);
+			if (!p || length < 8)
+				return false;
+			infoOut.height = (p[1] << 8) | p[2];
+			infoOut.width = (p[3] << 8) | p[4];
+			if (!infoOut.width || !infoOut.height)
+				return false;
+			// the decoder only handles baseline frames
+			if (marker != 0xC0)
+				infoOut.pixelFormat = PixelFormat::PixelFormatNone;
+			else if (p[5] == 3)
+				infoOut.pixelFormat = PixelFormat::PixelFormatRGBA;
+			else if (p[5] == 1)
+				infoOut.pixelFormat = PixelFormat::PixelFormatGreyscale;
+			else
+				infoOut.pixelFormat = PixelFormat::PixelFormatNone;
+			return true;
+		}
+
+		// only the first EXIF segment counts; later APP1s are usually XMP
+		if (marker == 0xE1 && !exifSeen && length >= 2 + 6 + 8) {
+			p = reader.get(pos + 4, length - 2);
+			if (p && memcmp(p, "Exif\0\0", 6) == 0) {
+				probeExif(p + 6, length - 2 - 6, pos + 4 + 6, infoOut);
+				exifSeen = true;
+			}
+		}
+
+		pos += 2 + length;
+	}
+}
+
+static bool probePNG(ProbeReader& reader, MediaLoader::ProbeInfo& infoOut)
+{
+	// signature, then the IHDR chunk, which must come first
+	const unsigned char* p = reader.get(0, 8 + 8 + 13);
+	if (!p || memcmp(p, "\x89PNG\r\n\x1a\n", 8) != 0 || memcmp(p + 12, "IHDR", 4) != 0)
+		return false;
+	p += 16;
+	infoOut.width = ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	infoOut.height = ((unsigned int)p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+	if (!infoOut.width || !infoOut.height)
+		return false;
+
+	// bit depth, then color type
+	infoOut.pixelFormat = pngLoadFormat(p[9], p[8]);
+	return true;
+}
+
+bool MediaLoader::probe(const std::string& filename, ProbeInfo& infoOut)
+{
+	infoOut.mediaType = FileMediaType::FMT_UNKNOWN;
+	infoOut.width = 0;
+	infoOut.height = 0;
+	infoOut.pixelFormat = PixelFormat::PixelFormatNone;
+	infoOut.orientation = 1;
+	infoOut.thumbOffset = 0;
+	infoOut.thumbLength = 0;
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		Log(LOG_ERROR, "Media Loader: Could not open file %s", filename.c_str());
+		return false;
+	}
+
+	unique_ptr<ProbeReader> reader(new ProbeReader);
+	reader->fd = fd;
+	reader->fileSize = lseek(fd, 0, SEEK_END);
+	reader->windowPos = 0;
+	reader->windowSize = 0;
+
+	// go by the signature rather than the extension
+	bool r = false;
+	const unsigned char* p = reader->get(0, 2);
+	if (p && p[0] == 0xFF && p[1] == 0xD8) {
+		infoOut.mediaType = FileMediaType::FMT_JPEG;
+		r = probeJPEG(*reader, infoOut);
+	}
+	else if (p && p[0] == 0x89 && p[1] == 'P') {
+		infoOut.mediaType = FileMediaType::FMT_PNG;
+		r = probePNG(*reader, infoOut);
+	}
+	close(fd);
+
+	if (!r)
+		Log(LOG_ERROR, "Media Loader: Could not probe %s", filename.c_str());
+	return r;
+}
+bool MediaLoader::loadImageFromMemory(ByteView fileContents, FileMediaType mediaType, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth, unsigned int maxHeight)
 {
 	if (mediaType == FileMediaType::FMT_JPEG) {
 		return loadJPEGFromMemory(fileContents, widthOut, heightOut, imgOut, pixelFormatOut, maxWidth, maxHeight);
@@ -8,6 +8,8 @@
 #include "gfx/PixelFormat.h"
 
 #include "gfx/ByteVector.h"
+#include "gfx/ByteView.h"
+#include "gfx/ImageView.h"
 #include "FileInfo.h"
 #include <string>
 
@@ -16,30 +18,67 @@ namespace FCInterface {
 	class MediaLoader {
 	public:
 
+		// what probe() can tell about an image from its headers alone
+		struct ProbeInfo {
+			FileMediaType mediaType;
+			unsigned int width;
+			unsigned int height;
+			FCInterface::PixelFormat pixelFormat;	// format loadImage() would return, PixelFormatNone if it can't load it
+			unsigned int orientation;				// EXIF orientation (1-8), 1 if there is none
+			unsigned int thumbOffset;				// file offset of the EXIF JPEG thumbnail, 0 if there is none
+			unsigned int thumbLength;
+		};
+
 		static FileMediaType guessMediaType(const std::string& filename);
 
-		static bool loadImageFromMemory(const ByteVector& fileContents, FileMediaType mediaType, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0);
+		// map image files instead of reading them, where that works; only for files that can't be
+		// truncated or go away while they are decoded (not removable media), which raises SIGBUS
+		static void setMapFiles(bool enable);
+
+		// read just enough of a JPEG or PNG file to fill in infoOut; nothing is decoded
+		static bool probe(const std::string& filename, ProbeInfo& infoOut);
+
+		static bool loadImageFromMemory(ByteView fileContents, FileMediaType mediaType, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0);
+
+		// decode the EXIF thumbnail of a JPEG; like the picture, it is returned the right way up
+		// according to the picture's EXIF orientation
+		static bool loadJPEGThumbFromMemory(ByteView fileContents, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0);
+
 
-		static bool loadJPEGThumbFromMemory(const ByteVector& fileContents, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0);
+		// the picture is returned the right way up according to its EXIF orientation
+		static bool loadJPEGFromMemory(ByteView fileContents, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0);
 
+		// decode only a region (in full-size pixels) of a JPEG; the region actually decoded starts at
+		// (xOut, yOut) in output pixels (the origin is rounded to a macroblock, and the image may have
+		// been downscaled to fit maxWidth x maxHeight) and is widthOut x heightOut pixels. Regions are
+		// in the stored orientation; without one (regionWidth or regionHeight 0), the whole picture is
+		// returned the right way up.
+		static bool loadJPEGRegionFromMemory(ByteView fileContents, unsigned int regionX, unsigned int regionY, unsigned int regionWidth, unsigned int regionHeight,
+			unsigned int& xOut, unsigned int& yOut, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0);
 
-		static bool loadJPEGFromMemory(const ByteVector& fileContents, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0);
+		// decode straight into pixels the caller owns (a mapped texture, a tile of an atlas, ...);
+		// the image is converted to dest.format and has to fit into dest, its top left
+		// widthOut x heightOut pixels are written
+		static bool loadJPEGInto(ByteView fileContents, const ImageView& dest, unsigned int& widthOut, unsigned int& heightOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0);
+		static bool loadPNGInto(ByteView fileContents, const ImageView& dest, unsigned int& widthOut, unsigned int& heightOut, bool verifyChecksums = true);
 
 		static bool loadImage(const std::string& filename, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0, unsigned int maxFileSize = 0);
-		static bool loadPNGFromMemory(const ByteVector& fileContents, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0);
+		// verifyChecksums = false skips the chunk CRCs and the zlib Adler-32 check; only for data whose
+		// integrity is already guaranteed, e.g. PNGs from a signed asset bundle
+		static bool loadPNGFromMemory(ByteView fileContents, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0, bool verifyChecksums = true);
 
 		static bool loadPNG(const std::string& filename, unsigned int& width, unsigned int& height, ByteVector& img, FCInterface::PixelFormat& imageTypeOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0, unsigned int maxFileSize = 0);
 		static bool loadPNG(const std::string& filename, unsigned int& widthOut, unsigned int& heightOut,
 			unsigned int& bppOut, ByteVector& buffer, bool makePOT, float& usageOutX, float& usageOutY, FCInterface::PixelFormat& imageTypeOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0, unsigned int maxFileSize = 0);
 
-		static bool loadPNGFromMemory(const ByteVector& fileContents, unsigned int& widthOut, unsigned int& heightOut,
-			unsigned int& bppOut, ByteVector& buffer, bool makePOT, float& usageOutX, float& usageOutY, FCInterface::PixelFormat& imageTypeOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0);
+		static bool loadPNGFromMemory(ByteView fileContents, unsigned int& widthOut, unsigned int& heightOut,
+			unsigned int& bppOut, ByteVector& buffer, bool makePOT, float& usageOutX, float& usageOutY, FCInterface::PixelFormat& imageTypeOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0, bool verifyChecksums = true);
 
 
 		static bool loadJPEG(const std::string& filename, unsigned int& widthOut, unsigned int& heightOut, ByteVector& imgOut, FCInterface::PixelFormat& pixelFormatOut, unsigned int maxWidth = 0, unsigned int maxHeight = 0, unsigned int maxFileSize = 0);
 
 
-		static bool savePNG(const std::string& filename, ByteVector& pixels, unsigned int width, unsigned int height, PixelFormat pixelFormat, bool flipVertical = false);
+		static bool savePNG(const std::string& filename, ByteVector& pixels, unsigned int width, unsigned int height, PixelFormat pixelFormat, bool flipVertical = false, bool fastEncode = false);
 
 		static void saveFImage(const std::string& filename, const ByteVector& pixels, unsigned int width, unsigned int height, PixelFormat pixelFormat);
 
@@ -274,8 +274,9 @@ const struct egl * init_cube_smooth(const struct gbm *gbm, int samples);
 const struct egl * init_cube_tex(const struct gbm *gbm, enum mode mode, int samples);
 /*const struct egl * init_cube_shadertoy(const struct gbm *gbm, const char *shadertoy, int samples);*/
 
-#ifdef HAVE_GST
+#if defined(HAVE_GST) || defined(HAVE_MJPEG)
 
+/* implemented by gst-decoder.c, or by mjpeg-decoder.cpp for builds without GStreamer */
 struct decoder;
 
 /**
@@ -314,7 +315,7 @@ static inline const struct egl *
 init_cube_video(const struct gbm *gbm, const char *video, int samples)
 {
 	(void)gbm; (void)video; (void)samples;
-	printf("no GStreamer support!\n");
+	printf("no video support (needs GStreamer or MJPEG)!\n");
 	return NULL;
 }
 #endif
@@ -31,10 +31,40 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include "lodepng.h"
 
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fstream>
 
+#ifdef LODEPNG_COMPILE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+/*LODEPNG_NO_SIMD: if defined, the NEON/SSE2 kernels (scanline unfiltering, CRC32 and Adler32)
+are not compiled in and the portable code is always used.*/
+#if !defined(LODEPNG_NO_SIMD)
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LODEPNG_USE_NEON
+#include <arm_neon.h>
+#if defined(__ARM_FEATURE_CRC32)
+#define LODEPNG_USE_ARM_CRC32
+#include <arm_acle.h>
+#endif
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#elif defined(__SSE2__)
+#define LODEPNG_USE_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define LODEPNG_USE_PCLMUL /*compiled for the pclmul target only, used if the CPU has it*/
+#include <wmmintrin.h>
+#endif
+#endif
+#endif /*!defined(LODEPNG_NO_SIMD)*/
+
 
 #include "Log.h" //TODO debug
 #include "sgPlatformUtils.h" //TODO debug
@@ -65,20 +95,215 @@ lodepng source code. Don't forget to remove "static" if you copypaste them
 from here.*/
 
 #ifdef LODEPNG_COMPILE_ALLOCATORS
+
+#if defined(__cplusplus) && (__cplusplus >= 201103L)
+#define LODEPNG_THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+#define LODEPNG_THREAD_LOCAL __declspec(thread)
+#else
+#define LODEPNG_THREAD_LOCAL __thread
+#endif
+
+/*arena allocations are aligned like those of malloc. The size asked for is stored in front of each of them*/
+#define LODEPNG_ARENA_ALIGN 16
+#define LODEPNG_ARENA_ROUND(size) (((size) + (LODEPNG_ARENA_ALIGN - 1)) & ~(size_t)(LODEPNG_ARENA_ALIGN - 1))
+
+struct LodePNGArenaBlock
+{
+  LodePNGArenaBlock* next;
+  size_t size; /*bytes of memory after the header*/
+  size_t used;
+};
+
+#define LODEPNG_ARENA_BLOCK_HEADER LODEPNG_ARENA_ROUND(sizeof(LodePNGArenaBlock))
+
+/*the arena of the calling thread, see lodepng_arena_use*/
+static LODEPNG_THREAD_LOCAL LodePNGArena* lodepng_current_arena = 0;
+
+static unsigned char* arenaBlockData(LodePNGArenaBlock* block)
+{
+  return (unsigned char*)block + LODEPNG_ARENA_BLOCK_HEADER;
+}
+
+static size_t* arenaSizeOf(void* ptr)
+{
+  return (size_t*)((unsigned char*)ptr - LODEPNG_ARENA_ALIGN);
+}
+
+/*the block that ptr was allocated from, NULL if it is not memory of the arena*/
+static LodePNGArenaBlock* arenaFind(LodePNGArena* arena, const void* ptr)
+{
+  LodePNGArenaBlock* block;
+  for(block = arena->blocks; block; block = block->next)
+  {
+    const unsigned char* data = arenaBlockData(block);
+    if((const unsigned char*)ptr >= data && (const unsigned char*)ptr < data + block->size) return block;
+  }
+  return 0;
+}
+
+/*whether ptr is the most recent allocation of its block, which can shrink and grow in place*/
+static unsigned arenaIsLast(LodePNGArenaBlock* block, void* ptr)
+{
+  return (unsigned char*)ptr + LODEPNG_ARENA_ROUND(*arenaSizeOf(ptr)) == arenaBlockData(block) + block->used;
+}
+
+static LodePNGArenaBlock* arenaAddBlock(LodePNGArena* arena, size_t size)
+{
+  LodePNGArenaBlock* block = (LodePNGArenaBlock*)malloc(LODEPNG_ARENA_BLOCK_HEADER + size);
+  if(!block) return 0;
+  block->next = arena->blocks;
+  block->size = size;
+  block->used = 0;
+  arena->blocks = block;
+  return block;
+}
+
+static void arenaAddUsed(LodePNGArena* arena, LodePNGArenaBlock* block, size_t oldsize, size_t newsize)
+{
+  block->used = block->used - oldsize + newsize;
+  arena->used = arena->used - oldsize + newsize;
+  if(arena->used > arena->peak) arena->peak = arena->used;
+}
+
+static void* arenaAlloc(LodePNGArena* arena, size_t size)
+{
+  size_t need = LODEPNG_ARENA_ALIGN + LODEPNG_ARENA_ROUND(size);
+  LodePNGArenaBlock* block = arena->blocks;
+  unsigned char* result;
+  if(need < size) return 0; /*overflow*/
+
+  if(!block || block->size - block->used < need)
+  {
+    /*the new block is at least as big as the others together, so that there are few of them*/
+    size_t blocksize = arena->blocksize;
+    for(; block; block = block->next) blocksize += block->size;
+    if(blocksize < need) blocksize = need;
+    block = arenaAddBlock(arena, blocksize);
+    if(!block) return 0;
+    ++arena->num_heap_calls;
+  }
+
+  result = arenaBlockData(block) + block->used + LODEPNG_ARENA_ALIGN;
+  *arenaSizeOf(result) = size;
+  arenaAddUsed(arena, block, 0, need);
+  return result;
+}
+
 static void* lodepng_malloc(size_t size)
 {
-  return malloc(size);
+  LodePNGArena* arena = lodepng_current_arena;
+  if(!arena) return malloc(size);
+  ++arena->num_allocs;
+  return arenaAlloc(arena, size);
 }
 
 static void* lodepng_realloc(void* ptr, size_t new_size)
 {
-  return realloc(ptr, new_size);
+  LodePNGArena* arena = lodepng_current_arena;
+  LodePNGArenaBlock* block;
+  size_t oldsize;
+  void* result;
+
+  if(!arena) return realloc(ptr, new_size);
+  if(!ptr) return lodepng_malloc(new_size);
+  block = arenaFind(arena, ptr);
+  if(!block) return realloc(ptr, new_size); /*from the heap, before the arena was used*/
+
+  ++arena->num_reallocs;
+  oldsize = *arenaSizeOf(ptr);
+  if(arenaIsLast(block, ptr)
+     && block->size - block->used + LODEPNG_ARENA_ROUND(oldsize) >= LODEPNG_ARENA_ROUND(new_size))
+  {
+    arenaAddUsed(arena, block, LODEPNG_ARENA_ROUND(oldsize), LODEPNG_ARENA_ROUND(new_size));
+    *arenaSizeOf(ptr) = new_size;
+    return ptr;
+  }
+  if(new_size <= oldsize)
+  {
+    *arenaSizeOf(ptr) = new_size;
+    return ptr;
+  }
+
+  result = arenaAlloc(arena, new_size);
+  if(result) memcpy(result, ptr, oldsize);
+  return result;
 }
 
 static void lodepng_free(void* ptr)
 {
-  free(ptr);
+  LodePNGArena* arena = lodepng_current_arena;
+  LodePNGArenaBlock* block;
+  if(!arena || !ptr)
+  {
+    free(ptr);
+    return;
+  }
+  block = arenaFind(arena, ptr);
+  if(!block)
+  {
+    free(ptr);
+    return;
+  }
+  ++arena->num_frees;
+  /*only the last allocation gives its memory back, the rest waits for lodepng_arena_reset*/
+  if(arenaIsLast(block, ptr)) arenaAddUsed(arena, block, LODEPNG_ARENA_ALIGN + LODEPNG_ARENA_ROUND(*arenaSizeOf(ptr)), 0);
 }
+
+static void arenaZeroCounters(LodePNGArena* arena)
+{
+  arena->used = 0;
+  arena->peak = 0;
+  arena->num_allocs = 0;
+  arena->num_reallocs = 0;
+  arena->num_frees = 0;
+  arena->num_heap_calls = 0;
+}
+
+void lodepng_arena_init(LodePNGArena* arena, size_t blocksize)
+{
+  arena->blocks = 0;
+  arena->blocksize = blocksize;
+  if(blocksize) arenaAddBlock(arena, blocksize);
+  arenaZeroCounters(arena);
+}
+
+void lodepng_arena_cleanup(LodePNGArena* arena)
+{
+  while(arena->blocks)
+  {
+    LodePNGArenaBlock* next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+  arenaZeroCounters(arena);
+}
+
+void lodepng_arena_reset(LodePNGArena* arena)
+{
+  if(arena->blocks && arena->blocks->next)
+  {
+    /*replace the blocks by one that holds as much as all of them*/
+    size_t total = 0;
+    LodePNGArenaBlock* block;
+    for(block = arena->blocks; block; block = block->next) total += block->size;
+    lodepng_arena_cleanup(arena);
+    arenaAddBlock(arena, total);
+  }
+  else if(arena->blocks)
+  {
+    arena->blocks->used = 0;
+  }
+  arenaZeroCounters(arena);
+}
+
+LodePNGArena* lodepng_arena_use(LodePNGArena* arena)
+{
+  LodePNGArena* previous = lodepng_current_arena;
+  lodepng_current_arena = arena;
+  return previous;
+}
+
 #else /*LODEPNG_COMPILE_ALLOCATORS*/
 void* lodepng_malloc(size_t size);
 void* lodepng_realloc(void* ptr, size_t new_size);
@@ -428,38 +653,98 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
   ++(*bitpointer);\
 }
 
+/*adds the bits a byte at a time: whatever fits in the last byte, then new bytes as needed*/
 static void addBitsToStream(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
 {
-  size_t i;
-  for(i = 0; i != nbits; ++i) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> i) & 1));
+  while(nbits != 0)
+  {
+    unsigned used = (unsigned)((*bitpointer) & 7);
+    unsigned n = 8 - used;
+    if(n > nbits) n = (unsigned)nbits;
+    if(used == 0) ucvector_push_back(bitstream, (unsigned char)0);
+    bitstream->data[bitstream->size - 1] |= (unsigned char)((value & ((1u << n) - 1u)) << used);
+    value >>= n;
+    nbits -= n;
+    (*bitpointer) += n;
+  }
 }
 
 static void addBitsToStreamReversed(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
 {
   size_t i;
-  for(i = 0; i != nbits; ++i) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> (nbits - 1 - i)) & 1));
+  unsigned reversed = 0;
+  for(i = 0; i != nbits; ++i) reversed = (reversed << 1u) | ((value >> i) & 1u);
+  addBitsToStream(bitpointer, bitstream, reversed, nbits);
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-#define READBIT(bitpointer, bitstream) ((bitstream[bitpointer >> 3] >> (bitpointer & 0x7)) & (unsigned char)1)
+/*
+Bit reader of the inflator. The buffer holds the next bits of the stream, the first one in its lsb. After
+LodePNGBitReader_refill it has at least 56 valid bits unless the input ends, which is enough for a length
+code, a distance code and all their extra bits. Bits past the end of the input read as 0 and make "bits"
+negative once they are consumed, which the callers check for after decoding.
+*/
+typedef struct LodePNGBitReader
+{
+  const unsigned char* data;
+  size_t size; /*size of data in bytes*/
+  size_t pos; /*next byte to load into the buffer*/
+  uint64_t buffer;
+  int bits; /*number of valid bits in the buffer*/
+} LodePNGBitReader;
 
-static unsigned char readBitFromStream(size_t* bitpointer, const unsigned char* bitstream)
+static void LodePNGBitReader_init(LodePNGBitReader* reader, const unsigned char* data, size_t size)
 {
-  unsigned char result = (unsigned char)(READBIT(*bitpointer, bitstream));
-  ++(*bitpointer);
-  return result;
+  reader->data = data;
+  reader->size = size;
+  reader->pos = 0;
+  reader->buffer = 0;
+  reader->bits = 0;
 }
 
-static unsigned readBitsFromStream(size_t* bitpointer, const unsigned char* bitstream, size_t nbits)
+static void LodePNGBitReader_refill(LodePNGBitReader* reader)
 {
-  unsigned result = 0, i;
-  for(i = 0; i != nbits; ++i)
+  if(reader->pos + 8 <= reader->size)
   {
-    result += ((unsigned)READBIT(*bitpointer, bitstream)) << i;
-    ++(*bitpointer);
+    /*load 8 bytes at once, but only count the whole bytes that fit: the bits above those are loaded
+    again at the same position next time, so or-ing them in twice does no harm*/
+    const unsigned char* p = &reader->data[reader->pos];
+    uint64_t word = (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24)
+                  | ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+    reader->buffer |= word << reader->bits;
+    reader->pos += (unsigned)(63 - reader->bits) >> 3;
+    reader->bits |= 56;
   }
+  else
+  {
+    while(reader->bits <= 56 && reader->pos < reader->size)
+    {
+      reader->buffer |= (uint64_t)reader->data[reader->pos++] << reader->bits;
+      reader->bits += 8;
+    }
+  }
+}
+
+/*the next nbits (up to 31) bits, without consuming them*/
+static unsigned LodePNGBitReader_peek(const LodePNGBitReader* reader, unsigned nbits)
+{
+  return (unsigned)reader->buffer & ((1u << nbits) - 1u);
+}
+
+static void LodePNGBitReader_skip(LodePNGBitReader* reader, unsigned nbits)
+{
+  reader->buffer >>= nbits;
+  reader->bits -= (int)nbits;
+}
+
+static unsigned LodePNGBitReader_read(LodePNGBitReader* reader, unsigned nbits)
+{
+  unsigned result;
+  if(reader->bits < (int)nbits) LodePNGBitReader_refill(reader);
+  result = LodePNGBitReader_peek(reader, nbits);
+  LodePNGBitReader_skip(reader, nbits);
   return result;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
@@ -509,11 +794,14 @@ Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-  unsigned* tree2d;
   unsigned* tree1d;
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
   unsigned numcodes; /*number of symbols in the alphabet = number of codes*/
+  /*the lookup table used by the decoder, indexed by the next FIRSTBITS bits of the stream. Codes of
+  up to FIRSTBITS bits are found there directly, longer ones in a second level table after it*/
+  unsigned char* table_len; /*length of the code, or of the longest code of the second level table*/
+  unsigned short* table_value; /*the symbol, or the position of the second level table*/
 } HuffmanTree;
 
 /*function used for debug purposes to draw the tree in ascii art with C++*/
@@ -531,78 +819,124 @@ static void HuffmanTree_draw(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-  tree->tree2d = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
+  tree->table_len = 0;
+  tree->table_value = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-  lodepng_free(tree->tree2d);
   lodepng_free(tree->tree1d);
   lodepng_free(tree->lengths);
+  lodepng_free(tree->table_len);
+  lodepng_free(tree->table_value);
 }
 
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
+#ifdef LODEPNG_COMPILE_DECODER
+/*number of bits resolved by the first level of the decoding table; the fixed literal/length codes all fit*/
+#define FIRSTBITS 9u
+/*returned by huffmanDecodeSymbol for bit sequences that are not a code of the tree*/
+#define INVALIDSYMBOL 65535u
+
+static unsigned reverseBits(unsigned bits, unsigned num)
 {
-  unsigned nodefilled = 0; /*up to which node it is filled*/
-  unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-  unsigned n, i;
+  unsigned i, result = 0;
+  for(i = 0; i < num; ++i) result |= ((bits >> (num - i - 1)) & 1u) << i;
+  return result;
+}
 
-  tree->tree2d = (unsigned*)lodepng_malloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
+/*the table representation used by the decoder, see HuffmanTree. return value is error*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
+{
+  static const unsigned headsize = 1u << FIRSTBITS;
+  static const unsigned mask = (1u << FIRSTBITS) - 1u;
+  unsigned maxlens[1u << FIRSTBITS];
+  size_t i, size, pointer;
 
-  /*
-  convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-  uninited, a value >= numcodes is an address to another bit, a value < numcodes
-  is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-  many columns as codes - 1.
-  A good huffman tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-  Here, the internal nodes are stored (what their 0 and 1 option point to).
-  There is only memory for such good tree currently, if there are more nodes
-  (due to too long length codes), error 55 will happen
-  */
-  for(n = 0; n < tree->numcodes * 2; ++n)
+  /*deflate reads codes starting at their msb, so the tables are indexed by the bit-reversed codes.
+  First find the longest code behind each first level entry, to size the second level tables*/
+  for(i = 0; i < headsize; ++i) maxlens[i] = 0;
+  for(i = 0; i < tree->numcodes; ++i)
   {
-    tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
+    unsigned l = tree->lengths[i];
+    if(l == 0) continue;
+    if(tree->tree1d[i] >> l) return 55; /*oversubscribed, the code doesn't fit in its length*/
+    if(l > FIRSTBITS)
+    {
+      unsigned index = reverseBits(tree->tree1d[i] >> (l - FIRSTBITS), FIRSTBITS);
+      if(maxlens[index] < l) maxlens[index] = l;
+    }
+  }
+  size = headsize;
+  for(i = 0; i < headsize; ++i)
+  {
+    if(maxlens[i] > FIRSTBITS) size += (size_t)1u << (maxlens[i] - FIRSTBITS);
   }
 
-  for(n = 0; n < tree->numcodes; ++n) /*the codes*/
+  tree->table_len = (unsigned char*)lodepng_malloc(size * sizeof(*tree->table_len));
+  tree->table_value = (unsigned short*)lodepng_malloc(size * sizeof(*tree->table_value));
+  if(!tree->table_len || !tree->table_value) return 83; /*alloc fail*/
+
+  /*16 marks entries not filled in yet, no code is that long*/
+  for(i = 0; i < size; ++i) tree->table_len[i] = 16;
+  pointer = headsize;
+  for(i = 0; i < headsize; ++i)
   {
-    for(i = 0; i != tree->lengths[n]; ++i) /*the bits for this code*/
+    if(maxlens[i] <= FIRSTBITS) continue;
+    tree->table_len[i] = (unsigned char)maxlens[i];
+    tree->table_value[i] = (unsigned short)pointer;
+    pointer += (size_t)1u << (maxlens[i] - FIRSTBITS);
+  }
+
+  /*a code of l bits fills every entry whose low l bits are the reversed code*/
+  for(i = 0; i < tree->numcodes; ++i)
+  {
+    unsigned l = tree->lengths[i];
+    unsigned reverse, j, num;
+    if(l == 0) continue;
+    reverse = reverseBits(tree->tree1d[i], l);
+    if(l <= FIRSTBITS)
     {
-      unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-      /*oversubscribed, see comment in lodepng_error_text*/
-      if(treepos > 2147483647 || treepos + 2 > tree->numcodes) return 55;
-      if(tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
+      num = 1u << (FIRSTBITS - l);
+      for(j = 0; j < num; ++j)
       {
-        if(i + 1 == tree->lengths[n]) /*last bit*/
-        {
-          tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-          treepos = 0;
-        }
-        else
-        {
-          /*put address of the next step in here, first that address has to be found of course
-          (it's just nodefilled + 1)...*/
-          ++nodefilled;
-          /*addresses encoded with numcodes added to it*/
-          tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-          treepos = nodefilled;
-        }
+        unsigned index = reverse | (j << l);
+        if(tree->table_len[index] != 16) return 55; /*oversubscribed, codes overlap*/
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
+      }
+    }
+    else
+    {
+      unsigned index = reverse & mask;
+      unsigned tablebits = tree->table_len[index] - FIRSTBITS;
+      unsigned start = tree->table_value[index];
+      num = 1u << (tablebits - (l - FIRSTBITS));
+      for(j = 0; j < num; ++j)
+      {
+        unsigned index2 = start + ((reverse >> FIRSTBITS) | (j << (l - FIRSTBITS)));
+        if(tree->table_len[index2] != 16) return 55; /*oversubscribed, codes overlap*/
+        tree->table_len[index2] = (unsigned char)l;
+        tree->table_value[index2] = (unsigned short)i;
       }
-      else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
     }
   }
 
-  for(n = 0; n < tree->numcodes * 2; ++n)
+  /*incomplete trees (e.g. a distance tree with a single code, or none) leave entries unused: they decode
+  to an invalid symbol, so the bit sequence is only an error if it actually appears*/
+  for(i = 0; i < size; ++i)
   {
-    if(tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
+    if(tree->table_len[i] == 16)
+    {
+      tree->table_len[i] = (unsigned char)((i < headsize) ? 1 : (FIRSTBITS + 1));
+      tree->table_value[i] = INVALIDSYMBOL;
+    }
   }
 
   return 0;
 }
+#endif /*LODEPNG_COMPILE_DECODER*/
 
 /*
 Second step for the ...makeFromLengths and ...makeFromFrequencies functions.
@@ -630,6 +964,7 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
   {
     /*step 1: count number of instances of each code length*/
     for(bits = 0; bits != tree->numcodes; ++bits) ++blcount.data[tree->lengths[bits]];
+    blcount.data[0] = 0; /*unused symbols don't take up codes, so the codes fit in their lengths*/
     /*step 2: generate the nextcode values*/
     for(bits = 1; bits <= tree->maxbitlen; ++bits)
     {
@@ -645,8 +980,7 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
   uivector_cleanup(&blcount);
   uivector_cleanup(&nextcode);
 
-  if(!error) return HuffmanTree_make2DTree(tree);
-  else return error;
+  return error;
 }
 
 /*
@@ -663,7 +997,15 @@ static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* b
   for(i = 0; i != numcodes; ++i) tree->lengths[i] = bitlen[i];
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
   tree->maxbitlen = maxbitlen;
+#ifdef LODEPNG_COMPILE_DECODER
+  {
+    unsigned error = HuffmanTree_makeFromLengths2(tree);
+    if(error) return error;
+    return HuffmanTree_makeTable(tree);
+  }
+#else /*LODEPNG_COMPILE_DECODER*/
   return HuffmanTree_makeFromLengths2(tree);
+#endif /*LODEPNG_COMPILE_DECODER*/
 }
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -942,27 +1284,23 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 #ifdef LODEPNG_COMPILE_DECODER
 
 /*
-returns the code, or (unsigned)(-1) if error happened
-inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
+returns the code, or INVALIDSYMBOL if the bits are not a code of the tree. The reader must hold at least
+15 bits (the longest code); codes in bits past the end of the input leave reader->bits negative
 */
-static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
-                                    const HuffmanTree* codetree, size_t inbitlength)
+static unsigned huffmanDecodeSymbol(LodePNGBitReader* reader, const HuffmanTree* codetree)
 {
-  unsigned treepos = 0, ct;
-  for(;;)
+  unsigned index = LodePNGBitReader_peek(reader, FIRSTBITS);
+  unsigned l = codetree->table_len[index];
+  unsigned value = codetree->table_value[index];
+  if(l <= FIRSTBITS)
   {
-    if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-    /*
-    decode the symbol from the tree. The "readBitFromStream" code is inlined in
-    the expression below because this is the biggest bottleneck while decoding
-    */
-    ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-    ++(*bp);
-    if(ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-    else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
-
-    if(treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
+    LodePNGBitReader_skip(reader, l);
+    return value;
   }
+  /*a long code: the bits after the first FIRSTBITS index the second level table*/
+  index = value + ((unsigned)(reader->buffer >> FIRSTBITS) & ((1u << (l - FIRSTBITS)) - 1u));
+  LodePNGBitReader_skip(reader, codetree->table_len[index]);
+  return codetree->table_value[index];
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -972,22 +1310,41 @@ static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
 /* / Inflator (Decompressor)                                                / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
-/*get the tree of a deflated block with fixed tree, as specified in the deflate specification*/
-static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
+static unsigned makeFixedTrees(HuffmanTree* tree_ll, HuffmanTree* tree_d)
 {
-  /*TODO: check for out of memory errors*/
-  generateFixedLitLenTree(tree_ll);
-  generateFixedDistanceTree(tree_d);
+  unsigned error;
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+  /*the trees outlive the decode that builds them, so they must not come from its arena*/
+  LodePNGArena* arena = lodepng_arena_use(0);
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+  HuffmanTree_init(tree_ll);
+  HuffmanTree_init(tree_d);
+  error = generateFixedLitLenTree(tree_ll);
+  if(!error) error = generateFixedDistanceTree(tree_d);
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+  lodepng_arena_use(arena);
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+  return error;
+}
+
+/*get the tree of a deflated block with fixed tree, as specified in the deflate specification. The trees
+never change, so they are built once and shared by all decoders (the initialization of function-local
+statics is thread-safe)*/
+static unsigned getTreeInflateFixed(const HuffmanTree** tree_ll, const HuffmanTree** tree_d)
+{
+  static HuffmanTree fixed_ll, fixed_d;
+  static const unsigned error = makeFixedTrees(&fixed_ll, &fixed_d);
+  *tree_ll = &fixed_ll;
+  *tree_d = &fixed_d;
+  return error;
 }
 
 /*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
-                                      const unsigned char* in, size_t* bp, size_t inlength)
+static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d, LodePNGBitReader* reader)
 {
   /*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated*/
   unsigned error = 0;
   unsigned n, HLIT, HDIST, HCLEN, i;
-  size_t inbitlength = inlength * 8;
 
   /*see comments in deflateDynamic for explanation of the context and these variables, it is analogous*/
   unsigned* bitlen_ll = 0; /*lit,len code lengths*/
@@ -996,16 +1353,14 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   unsigned* bitlen_cl = 0;
   HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
 
-  if((*bp) + 14 > (inlength << 3)) return 49; /*error: the bit pointer is or will go past the memory*/
-
   /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already*/
-  HLIT =  readBitsFromStream(bp, in, 5) + 257;
+  HLIT =  LodePNGBitReader_read(reader, 5) + 257;
   /*number of distance codes. Unlike the spec, the value 1 is added to it here already*/
-  HDIST = readBitsFromStream(bp, in, 5) + 1;
+  HDIST = LodePNGBitReader_read(reader, 5) + 1;
   /*number of code length codes. Unlike the spec, the value 4 is added to it here already*/
-  HCLEN = readBitsFromStream(bp, in, 4) + 4;
+  HCLEN = LodePNGBitReader_read(reader, 4) + 4;
 
-  if((*bp) + HCLEN * 3 > (inlength << 3)) return 50; /*error: the bit pointer is or will go past the memory*/
+  if(reader->bits < 0) return 49; /*error: the bit pointer is or will go past the memory*/
 
   HuffmanTree_init(&tree_cl);
 
@@ -1018,9 +1373,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
     for(i = 0; i != NUM_CODE_LENGTH_CODES; ++i)
     {
-      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBitsFromStream(bp, in, 3);
+      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = LodePNGBitReader_read(reader, 3);
       else bitlen_cl[CLCL_ORDER[i]] = 0; /*if not, it must stay 0*/
     }
+    if(reader->bits < 0) ERROR_BREAK(50); /*error: the bit pointer is or will go past the memory*/
 
     error = HuffmanTree_makeFromLengths(&tree_cl, bitlen_cl, NUM_CODE_LENGTH_CODES, 7);
     if(error) break;
@@ -1036,7 +1392,11 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     i = 0;
     while(i < HLIT + HDIST)
     {
-      unsigned code = huffmanDecodeSymbol(in, bp, &tree_cl, inbitlength);
+      unsigned code;
+      /*enough bits for the code (at most 7 bits) and its repeat length (at most 7 bits)*/
+      LodePNGBitReader_refill(reader);
+      code = huffmanDecodeSymbol(reader, &tree_cl);
+      if(reader->bits < 0) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
       if(code <= 15) /*a length code*/
       {
         if(i < HLIT) bitlen_ll[i] = code;
@@ -1050,8 +1410,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
         if(i == 0) ERROR_BREAK(54); /*can't repeat previous if i is 0*/
 
-        if((*bp + 2) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 2);
+        replength += LodePNGBitReader_read(reader, 2);
+        if(reader->bits < 0) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
         if(i < HLIT + 1) value = bitlen_ll[i - 1];
         else value = bitlen_d[i - HLIT - 1];
@@ -1067,8 +1427,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 17) /*repeat "0" 3-10 times*/
       {
         unsigned replength = 3; /*read in the bits that indicate repeat length*/
-        if((*bp + 3) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 3);
+        replength += LodePNGBitReader_read(reader, 3);
+        if(reader->bits < 0) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; ++n)
@@ -1083,8 +1443,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 18) /*repeat "0" 11-138 times*/
       {
         unsigned replength = 11; /*read in the bits that indicate repeat length*/
-        if((*bp + 7) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 7);
+        replength += LodePNGBitReader_read(reader, 7);
+        if(reader->bits < 0) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; ++n)
@@ -1096,16 +1456,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
           ++i;
         }
       }
-      else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+      else /*if(code == INVALIDSYMBOL)*/
       {
-        if(code == (unsigned)(-1))
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inbitlength ? 10 : 11;
-        }
-        else error = 16; /*unexisting code, this can never happen*/
-        break;
+        ERROR_BREAK(11); /*error: the bits are not a code of the tree*/
       }
     }
     if(error) break;
@@ -1128,56 +1481,117 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   return error;
 }
 
-/*inflate a block with dynamic of fixed Huffman tree*/
-static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
-                                    size_t* pos, size_t inlength, unsigned btype)
+/*copy a match of length bytes from distance bytes back; source and destination may overlap*/
+static void copyMatch(unsigned char* dest, size_t distance, size_t length)
+{
+  size_t done;
+  if(distance >= length)
+  {
+    memcpy(dest, dest - distance, length);
+    return;
+  }
+  if(distance == 1)
+  {
+    memset(dest, dest[-1], length); /*a run of one byte value, common in PNG scanlines*/
+    return;
+  }
+  /*the output repeats with a period of distance bytes. Copy one period, then keep doubling the copied
+  part, which never overlaps its source, instead of going byte by byte*/
+  memcpy(dest, dest - distance, distance);
+  done = distance;
+  while(done < length)
+  {
+    size_t n = (length - done < done) ? (length - done) : done;
+    memcpy(dest + done, dest, n);
+    done += n;
+  }
+}
+
+/*the largest distance a deflate match can reach back*/
+#define INFLATE_WINDOW_SIZE 32768
+
+/*
+Receives the inflated data piece by piece while inflating, so that all of it never has to be in memory at
+once: whenever more than chunksize new bytes were inflated, they are passed to write, and the out buffer is
+cut back to the last INFLATE_WINDOW_SIZE bytes, which later matches can still refer to. flushed is the
+part of the out buffer that was already written, it is kept up to date by the inflater.
+*/
+typedef struct InflateSink
+{
+  unsigned (*write)(void* context, const unsigned char* data, size_t size);
+  void* context;
+  size_t chunksize;
+  size_t flushed;
+} InflateSink;
+
+static unsigned inflateFlush(ucvector* out, size_t* pos, InflateSink* sink)
 {
   unsigned error = 0;
-  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
-  HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  size_t inbitlength = inlength * 8;
+  if(*pos > sink->flushed) error = sink->write(sink->context, out->data + sink->flushed, *pos - sink->flushed);
+  if(*pos > INFLATE_WINDOW_SIZE)
+  {
+    memmove(out->data, out->data + *pos - INFLATE_WINDOW_SIZE, INFLATE_WINDOW_SIZE);
+    *pos = INFLATE_WINDOW_SIZE;
+  }
+  sink->flushed = *pos;
+  return error;
+}
 
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
+/*inflate a block with dynamic of fixed Huffman tree. sink may be NULL*/
+static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader, size_t* pos, unsigned btype,
+                                    InflateSink* sink)
+{
+  unsigned error = 0;
+  HuffmanTree dynamic_ll; /*the huffman tree for literal and length codes*/
+  HuffmanTree dynamic_d; /*the huffman tree for distance codes*/
+  const HuffmanTree* tree_ll = &dynamic_ll;
+  const HuffmanTree* tree_d = &dynamic_d;
+  size_t outpos = *pos;
+  /*without a sink, outpos never gets there*/
+  size_t flushpos = sink ? INFLATE_WINDOW_SIZE + sink->chunksize : (size_t)(-1);
+
+  HuffmanTree_init(&dynamic_ll);
+  HuffmanTree_init(&dynamic_d);
 
-  if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
-  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
+  if(btype == 1) error = getTreeInflateFixed(&tree_ll, &tree_d);
+  else if(btype == 2) error = getTreeInflateDynamic(&dynamic_ll, &dynamic_d, reader);
 
   while(!error) /*decode all symbols until end reached, breaks at end code*/
   {
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    unsigned code_ll;
+    if(outpos >= flushpos)
+    {
+      error = inflateFlush(out, &outpos, sink);
+      if(error) break;
+    }
+    /*one refill covers the longest length/distance pair: 15 + 5 + 15 + 13 bits*/
+    LodePNGBitReader_refill(reader);
+    code_ll = huffmanDecodeSymbol(reader, tree_ll);
+    if(reader->bits < 0) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
     if(code_ll <= 255) /*literal symbol*/
     {
-      /*ucvector_push_back would do the same, but for some reason the two lines below run 10% faster*/
-      if(!ucvector_resize(out, (*pos) + 1)) ERROR_BREAK(83 /*alloc fail*/);
-      out->data[*pos] = (unsigned char)code_ll;
-      ++(*pos);
+      if(outpos >= out->allocsize && !ucvector_reserve(out, outpos + 1)) ERROR_BREAK(83 /*alloc fail*/);
+      out->data[outpos++] = (unsigned char)code_ll;
     }
     else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/
     {
-      unsigned code_d, distance;
+      unsigned code_d, distance, length;
       unsigned numextrabits_l, numextrabits_d; /*extra bits for length and distance*/
-      size_t start, forward, backward, length;
 
       /*part 1: get length base*/
       length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
 
       /*part 2: get extra bits and add the value of that to length*/
       numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-      if((*bp + numextrabits_l) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      length += readBitsFromStream(bp, in, numextrabits_l);
+      length += LodePNGBitReader_peek(reader, numextrabits_l);
+      LodePNGBitReader_skip(reader, numextrabits_l);
 
       /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
+      code_d = huffmanDecodeSymbol(reader, tree_d);
       if(code_d > 29)
       {
-        if(code_ll == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inlength * 8 ? 10 : 11;
-        }
+        if(code_d == INVALIDSYMBOL) error = 11; /*error: the bits are not a code of the tree*/
         else error = 18; /*error: invalid distance code (30-31 are never used)*/
         break;
       }
@@ -1185,99 +1599,98 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 4: get extra bits from distance*/
       numextrabits_d = DISTANCEEXTRA[code_d];
-      if((*bp + numextrabits_d) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      distance += readBitsFromStream(bp, in, numextrabits_d);
+      distance += LodePNGBitReader_peek(reader, numextrabits_d);
+      LodePNGBitReader_skip(reader, numextrabits_d);
+      if(reader->bits < 0) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
 
       /*part 5: fill in all the out[n] values based on the length and dist*/
-      start = (*pos);
-      if(distance > start) ERROR_BREAK(52); /*too long backward distance*/
-      backward = start - distance;
-
-      if(!ucvector_resize(out, (*pos) + length)) ERROR_BREAK(83 /*alloc fail*/);
-      if (distance < length) {
-        for(forward = 0; forward < length; ++forward)
-        {
-          out->data[(*pos)++] = out->data[backward++];
-        }
-      } else {
-        memcpy(out->data + *pos, out->data + backward, length);
-        *pos += length;
-      }
+      if(distance > outpos) ERROR_BREAK(52); /*too long backward distance*/
+      if(out->allocsize - outpos < length && !ucvector_reserve(out, outpos + length)) ERROR_BREAK(83 /*alloc fail*/);
+      copyMatch(out->data + outpos, distance, length);
+      outpos += length;
     }
     else if(code_ll == 256)
     {
       break; /*end code, break the loop*/
     }
-    else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+    else /*if(code_ll == INVALIDSYMBOL)*/
     {
-      /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-      (10=no endcode, 11=wrong jump outside of tree)*/
-      error = ((*bp) > inlength * 8) ? 10 : 11;
-      break;
+      ERROR_BREAK(11); /*error: the bits are not a code of the tree (or one of the unused codes 286-287)*/
     }
   }
 
-  HuffmanTree_cleanup(&tree_ll);
-  HuffmanTree_cleanup(&tree_d);
+  *pos = outpos;
+  HuffmanTree_cleanup(&dynamic_ll);
+  HuffmanTree_cleanup(&dynamic_d);
 
   return error;
 }
 
-static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength)
+static unsigned inflateNoCompression(ucvector* out, LodePNGBitReader* reader, size_t* pos)
 {
   size_t p;
-  unsigned LEN, NLEN, n, error = 0;
+  unsigned LEN, NLEN;
 
-  /*go to first boundary of byte*/
-  while(((*bp) & 0x7) != 0) ++(*bp);
-  p = (*bp) / 8; /*byte position*/
+  /*go to first boundary of byte; whole bytes still in the bit buffer are read again from the input*/
+  p = reader->pos - (size_t)(reader->bits >> 3);
+  reader->buffer = 0;
+  reader->bits = 0;
 
   /*read LEN (2 bytes) and NLEN (2 bytes)*/
-  if(p + 4 >= inlength) return 52; /*error, bit pointer will jump past memory*/
-  LEN = in[p] + 256u * in[p + 1]; p += 2;
-  NLEN = in[p] + 256u * in[p + 1]; p += 2;
+  if(p + 4 >= reader->size) return 52; /*error, bit pointer will jump past memory*/
+  LEN = reader->data[p] + 256u * reader->data[p + 1]; p += 2;
+  NLEN = reader->data[p] + 256u * reader->data[p + 1]; p += 2;
 
   /*check if 16-bit NLEN is really the one's complement of LEN*/
   if(LEN + NLEN != 65535) return 21; /*error: NLEN is not one's complement of LEN*/
 
-  if(!ucvector_resize(out, (*pos) + LEN)) return 83; /*alloc fail*/
+  if(!ucvector_reserve(out, (*pos) + LEN)) return 83; /*alloc fail*/
 
   /*read the literal data: LEN bytes are now stored in the out buffer*/
-  if(p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
-  for(n = 0; n < LEN; ++n) out->data[(*pos)++] = in[p++];
-
-  (*bp) = p * 8;
+  if(p + LEN > reader->size) return 23; /*error: reading outside of in buffer*/
+  if(LEN) memcpy(out->data + *pos, reader->data + p, LEN);
+  *pos += LEN;
+  reader->pos = p + LEN;
 
-  return error;
+  return 0;
 }
 
+/*inflate into out, which is overwritten from its start; its capacity is used before growing it. With a
+sink, the data goes there and out only keeps the last part of it, see InflateSink*/
 static unsigned lodepng_inflatev(ucvector* out,
                                  const unsigned char* in, size_t insize,
-                                 const LodePNGDecompressSettings* settings)
+                                 const LodePNGDecompressSettings* settings, InflateSink* sink)
 {
-  /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
-  size_t bp = 0;
+  LodePNGBitReader reader;
   unsigned BFINAL = 0;
   size_t pos = 0; /*byte position in the out buffer*/
   unsigned error = 0;
 
   (void)settings;
 
+  LodePNGBitReader_init(&reader, in, insize);
+
   while(!BFINAL)
   {
     unsigned BTYPE;
-    if(bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
-    BFINAL = readBitFromStream(&bp, in);
-    BTYPE = 1u * readBitFromStream(&bp, in);
-    BTYPE += 2u * readBitFromStream(&bp, in);
+    BFINAL = LodePNGBitReader_read(&reader, 1);
+    BTYPE = LodePNGBitReader_read(&reader, 2);
+    if(reader.bits < 0) ERROR_BREAK(52); /*error, bit pointer will jump past memory*/
 
-    if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+    if(BTYPE == 3) error = 20; /*error: invalid BTYPE*/
+    else if(BTYPE == 0) error = inflateNoCompression(out, &reader, &pos); /*no compression*/
+    else error = inflateHuffmanBlock(out, &reader, &pos, BTYPE, sink); /*compression, BTYPE 01 or 10*/
 
-    if(error) return error;
+    /*a stored block adds at most 65535 bytes, it is flushed after it rather than while copying it*/
+    if(!error && sink && (BFINAL || pos >= INFLATE_WINDOW_SIZE + sink->chunksize))
+    {
+      error = inflateFlush(out, &pos, sink);
+    }
+
+    if(error) break;
   }
 
+  out->size = pos;
   return error;
 }
 
@@ -1288,23 +1701,24 @@ unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
   unsigned error;
   ucvector v;
   ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_inflatev(&v, in, insize, settings);
+  error = lodepng_inflatev(&v, in, insize, settings, 0);
   *out = v.data;
   *outsize = v.size;
   return error;
 }
 
-static unsigned inflate(unsigned char** out, size_t* outsize,
-                        const unsigned char* in, size_t insize,
-                        const LodePNGDecompressSettings* settings)
+static unsigned inflatev(ucvector* out, const unsigned char* in, size_t insize,
+                         const LodePNGDecompressSettings* settings)
 {
   if(settings->custom_inflate)
   {
-    return settings->custom_inflate(out, outsize, in, insize, settings);
+    unsigned error = settings->custom_inflate(&out->data, &out->size, in, insize, settings);
+    out->allocsize = out->size;
+    return error;
   }
   else
   {
-    return lodepng_inflate(out, outsize, in, insize, settings);
+    return lodepng_inflatev(out, in, insize, settings, 0);
   }
 }
 
@@ -1474,15 +1888,16 @@ this hash technique is one out of several ways to speed this up.
 */
 static unsigned encodeLZ77(uivector* out, Hash* hash,
                            const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
-                           unsigned minmatch, unsigned nicematch, unsigned lazymatching)
+                           unsigned minmatch, unsigned nicematch, unsigned lazymatching,
+                           unsigned maxchainlength, unsigned rle)
 {
   size_t pos;
   unsigned i, error = 0;
-  /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
-  unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
   unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
 
-  unsigned usezeros = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
+  /*not sure if setting it to false for windowsize < 8192 is better or worse. With rle, runs of
+  zeros are found by the run check instead*/
+  unsigned usezeros = !rle;
   unsigned numzeros = 0;
 
   unsigned offset; /*the offset represents the distance in LZ77 terminology*/
@@ -1499,6 +1914,8 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
 
   if(nicematch > MAX_SUPPORTED_DEFLATE_LENGTH) nicematch = MAX_SUPPORTED_DEFLATE_LENGTH;
+  /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
+  if(maxchainlength == 0) maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
 
   for(pos = inpos; pos < insize; ++pos)
   {
@@ -1527,11 +1944,20 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
 
     lastptr = &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
 
+    /*a run of the previous byte is a match at distance 1, the hash chain only has to beat it*/
+    if(rle && pos > 0 && in[pos] == in[pos - 1])
+    {
+      foreptr = &in[pos];
+      while(foreptr != lastptr && *foreptr == in[pos - 1]) ++foreptr;
+      length = (unsigned)(foreptr - &in[pos]);
+      offset = 1;
+    }
+
     /*search for the longest string*/
     prev_offset = 0;
     for(;;)
     {
-      if(chainlength++ >= maxchainlength) break;
+      if(chainlength++ >= maxchainlength || length >= nicematch) break;
       current_offset = hashpos <= wpos ? wpos - hashpos : wpos - hashpos + windowsize;
 
       if(current_offset < prev_offset) break; /*stop when went completely around the circular buffer*/
@@ -1627,6 +2053,12 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
     else
     {
       addLengthDistance(out, length, offset);
+      if(rle && length >= nicematch)
+      {
+        /*a long run or repeat: leave it out of the hash chains rather than hash every byte of it*/
+        pos += length - 1;
+        continue;
+      }
       for(i = 1; i < length; ++i)
       {
         ++pos;
@@ -1651,7 +2083,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
 
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize, unsigned final)
 {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
@@ -1663,7 +2095,7 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
     unsigned BFINAL, BTYPE, LEN, NLEN;
     unsigned char firstbyte;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = final && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1) << 1) + ((BTYPE & 2) << 1));
@@ -1784,7 +2216,8 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
     if(settings->use_lz77)
     {
       error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+                         settings->minmatch, settings->nicematch, settings->lazymatching,
+                         settings->maxchainlength, settings->rle);
       if(error) break;
     }
     else
@@ -1994,7 +2427,8 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
     uivector lz77_encoded;
     uivector_init(&lz77_encoded);
     error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
+                       settings->minmatch, settings->nicematch, settings->lazymatching,
+                       settings->maxchainlength, settings->rle);
     if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
     uivector_cleanup(&lz77_encoded);
   }
@@ -2015,8 +2449,13 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings)
+/*
+Deflate the data as one or more blocks. If final is 0, the last block doesn't get the BFINAL bit
+and is followed by an empty stored block (a zlib sync flush): the output then ends on a byte
+boundary, and the deflate data of what follows can simply be appended to it.
+*/
+static unsigned deflateBlocks(ucvector* out, const unsigned char* in, size_t insize,
+                              const LodePNGCompressSettings* settings, unsigned final)
 {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
@@ -2024,7 +2463,7 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   Hash hash;
 
   if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+  else if(settings->btype == 0) return deflateNoCompression(out, in, insize, final);
   else if(settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/
   {
@@ -2042,20 +2481,36 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
 
   for(i = 0; i != numdeflateblocks && !error; ++i)
   {
-    unsigned final = (i == numdeflateblocks - 1);
+    unsigned last = final && (i == numdeflateblocks - 1);
     size_t start = i * blocksize;
     size_t end = start + blocksize;
     if(end > insize) end = insize;
 
-    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, final);
-    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
+    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, last);
+    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, last);
   }
 
   hash_cleanup(&hash);
 
+  if(!error && !final)
+  {
+    /*BFINAL 0 and BTYPE 00, the rest of the byte is padding, then LEN 0 and NLEN 65535*/
+    addBitsToStream(&bp, out, 0, 3);
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 255);
+    ucvector_push_back(out, 255);
+  }
+
   return error;
 }
 
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings)
+{
+  return deflateBlocks(out, in, insize, settings, 1);
+}
+
 unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings)
@@ -2112,10 +2567,143 @@ static unsigned update_adler32(unsigned adler, const unsigned char* data, unsign
   return (s2 << 16) | s1;
 }
 
+/*
+The SIMD versions work on blocks of 32 bytes: s1 is the plain sum of the bytes, and s2 grows by
+32 times s1 from before the block plus the bytes weighted 32, 31, ..., 1. At most 173 blocks
+(5536 bytes) are summed before the modulo, so the 32-bit sums cannot overflow. The remaining
+bytes are done by update_adler32.
+*/
+typedef unsigned (*Adler32Func)(unsigned adler, const unsigned char* data, unsigned len);
+
+#ifdef LODEPNG_USE_SSE2
+static unsigned sumLanesSSE2(__m128i v)
+{
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (unsigned)_mm_cvtsi128_si32(v);
+}
+
+static unsigned update_adler32SSE2(unsigned adler, const unsigned char* data, unsigned len)
+{
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  unsigned blocks = len / 32;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i tap1 = _mm_setr_epi16(32, 31, 30, 29, 28, 27, 26, 25);
+  const __m128i tap2 = _mm_setr_epi16(24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap3 = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+  const __m128i tap4 = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+
+  len -= blocks * 32;
+  while(blocks > 0)
+  {
+    unsigned n = blocks > 173 ? 173 : blocks;
+    __m128i v_ps = _mm_cvtsi32_si128((int)(s1 * n)); /*sum of s1 before each block*/
+    __m128i v_s1 = zero;
+    __m128i v_s2 = zero;
+    blocks -= n;
+    do
+    {
+      __m128i x1 = _mm_loadu_si128((const __m128i*)data);
+      __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_add_epi32(_mm_sad_epu8(x1, zero), _mm_sad_epu8(x2, zero)));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(x1, zero), tap1));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(x1, zero), tap2));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(x2, zero), tap3));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(x2, zero), tap4));
+      data += 32;
+    }
+    while(--n);
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+    s1 = (s1 + sumLanesSSE2(v_s1)) % 65521;
+    s2 = (s2 + sumLanesSSE2(v_s2)) % 65521;
+  }
+
+  return update_adler32((s2 << 16) | s1, data, len);
+}
+#endif /*LODEPNG_USE_SSE2*/
+
+#ifdef LODEPNG_USE_NEON
+static unsigned sumLanesNEON(uint32x4_t v)
+{
+  uint64x2_t sum = vpaddlq_u32(v);
+  return (unsigned)(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1));
+}
+
+static unsigned update_adler32NEON(unsigned adler, const unsigned char* data, unsigned len)
+{
+  static const uint16_t taps[32] = {
+    32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+    16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1
+  };
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  unsigned blocks = len / 32;
+
+  len -= blocks * 32;
+  while(blocks > 0)
+  {
+    unsigned n = blocks > 173 ? 173 : blocks;
+    uint32x4_t v_ps = vsetq_lane_u32(s1 * n, vdupq_n_u32(0), 0); /*sum of s1 before each block*/
+    uint32x4_t v_s1 = vdupq_n_u32(0);
+    uint32x4_t v_s2;
+    /*per byte position sums, at most 173 * 255 so 16 bits are enough*/
+    uint16x8_t c1 = vdupq_n_u16(0), c2 = c1, c3 = c1, c4 = c1;
+    blocks -= n;
+    do
+    {
+      uint8x16_t x1 = vld1q_u8(data);
+      uint8x16_t x2 = vld1q_u8(data + 16);
+      v_ps = vaddq_u32(v_ps, v_s1);
+      v_s1 = vpadalq_u16(v_s1, vpadalq_u8(vpaddlq_u8(x1), x2));
+      c1 = vaddw_u8(c1, vget_low_u8(x1));
+      c2 = vaddw_u8(c2, vget_high_u8(x1));
+      c3 = vaddw_u8(c3, vget_low_u8(x2));
+      c4 = vaddw_u8(c4, vget_high_u8(x2));
+      data += 32;
+    }
+    while(--n);
+    v_s2 = vshlq_n_u32(v_ps, 5);
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(c1), vld1_u16(taps + 0));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(c1), vld1_u16(taps + 4));
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(c2), vld1_u16(taps + 8));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(c2), vld1_u16(taps + 12));
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(c3), vld1_u16(taps + 16));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(c3), vld1_u16(taps + 20));
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(c4), vld1_u16(taps + 24));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(c4), vld1_u16(taps + 28));
+    s1 = (s1 + sumLanesNEON(v_s1)) % 65521;
+    s2 = (s2 + sumLanesNEON(v_s2)) % 65521;
+  }
+
+  return update_adler32((s2 << 16) | s1, data, len);
+}
+#endif /*LODEPNG_USE_NEON*/
+
+static Adler32Func selectAdler32(void)
+{
+#if defined(LODEPNG_USE_NEON)
+#if defined(__linux__) && !defined(__aarch64__)
+  if(getauxval(AT_HWCAP) & HWCAP_NEON)
+#endif
+    return update_adler32NEON;
+#elif defined(LODEPNG_USE_SSE2)
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+  if(__builtin_cpu_supports("sse2"))
+#endif
+    return update_adler32SSE2;
+#endif
+  return update_adler32;
+}
+
+/*selected once at load time*/
+static const Adler32Func update_adler32_fast = selectAdler32();
+
 /*Return the adler32 of the bytes data[0..len-1]*/
 static unsigned adler32(const unsigned char* data, unsigned len)
 {
-  return update_adler32(1L, data, len);
+  return update_adler32_fast(1L, data, len);
 }
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -2124,10 +2712,8 @@ static unsigned adler32(const unsigned char* data, unsigned len)
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                 size_t insize, const LodePNGDecompressSettings* settings)
+static unsigned zlib_check_header(const unsigned char* in, size_t insize)
 {
-  unsigned error = 0;
   unsigned CM, CINFO, FDICT;
 
   if(insize < 2) return 53; /*error, size of zlib data too small*/
@@ -2156,21 +2742,91 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
     return 26;
   }
 
-  error = inflate(out, outsize, in + 2, insize - 2, settings);
+  return 0;
+}
+
+static unsigned lodepng_zlib_decompressv(ucvector* out, const unsigned char* in,
+                                         size_t insize, const LodePNGDecompressSettings* settings)
+{
+  unsigned error = zlib_check_header(in, insize);
+  if(error) return error;
+
+  error = inflatev(out, in + 2, insize - 2, settings);
   if(error) return error;
 
   if(!settings->ignore_adler32)
   {
     unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
-    unsigned checksum = adler32(*out, (unsigned)(*outsize));
+    unsigned checksum = adler32(out->data, (unsigned)(out->size));
     if(checksum != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
   }
 
   return 0; /*no error*/
 }
 
-static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                size_t insize, const LodePNGDecompressSettings* settings)
+unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings)
+{
+  unsigned error;
+  ucvector v;
+  ucvector_init_buffer(&v, *out, *outsize);
+  error = lodepng_zlib_decompressv(&v, in, insize, settings);
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
+/*passes the data on to the sink of the zlib stream, summing it up for the checksum on the way*/
+typedef struct ZlibSinkContext
+{
+  InflateSink* sink;
+  unsigned adler;
+} ZlibSinkContext;
+
+static unsigned zlibSinkWrite(void* context, const unsigned char* data, size_t size)
+{
+  ZlibSinkContext* zlib = (ZlibSinkContext*)context;
+  zlib->adler = update_adler32_fast(zlib->adler, data, (unsigned)size);
+  return zlib->sink->write(zlib->sink->context, data, size);
+}
+
+/*decompresses zlib data into sink, see InflateSink, rather than into one buffer. custom_zlib and
+custom_inflate are not used: they return all data at once*/
+static unsigned zlib_decompress_sink(const unsigned char* in, size_t insize,
+                                     const LodePNGDecompressSettings* settings, InflateSink* sink)
+{
+  ZlibSinkContext context;
+  InflateSink adlersink;
+  ucvector window;
+  unsigned error = zlib_check_header(in, insize);
+  if(error) return error;
+
+  context.sink = sink;
+  context.adler = 1;
+  adlersink.write = zlibSinkWrite;
+  adlersink.context = &context;
+  adlersink.chunksize = sink->chunksize;
+  adlersink.flushed = 0;
+  sink->flushed = 0;
+
+  ucvector_init(&window);
+  error = lodepng_inflatev(&window, in + 2, insize - 2, settings, settings->ignore_adler32 ? sink : &adlersink);
+  ucvector_cleanup(&window);
+  if(error) return error;
+
+  if(!settings->ignore_adler32)
+  {
+    unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
+    if(context.adler != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
+  }
+
+  return 0; /*no error*/
+}
+
+/*expected_size is the size of the decompressed data if it is known beforehand (0 if not): the output
+buffer then gets that size right away instead of growing while inflating*/
+static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t expected_size,
+                                const unsigned char* in, size_t insize, const LodePNGDecompressSettings* settings)
 {
   if(settings->custom_zlib)
   {
@@ -2178,7 +2834,14 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
   }
   else
   {
-    return lodepng_zlib_decompress(out, outsize, in, insize, settings);
+    unsigned error;
+    ucvector v;
+    ucvector_init_buffer(&v, *out, *outsize);
+    if(expected_size && !ucvector_reserve(&v, expected_size)) return 83; /*alloc fail*/
+    error = lodepng_zlib_decompressv(&v, in, insize, settings);
+    *out = v.data;
+    *outsize = v.size;
+    return error;
   }
 }
 
@@ -2246,9 +2909,10 @@ static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsign
 #else /*no LODEPNG_COMPILE_ZLIB*/
 
 #ifdef LODEPNG_COMPILE_DECODER
-static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                size_t insize, const LodePNGDecompressSettings* settings)
+static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t expected_size,
+                                const unsigned char* in, size_t insize, const LodePNGDecompressSettings* settings)
 {
+  (void)expected_size;
   if(!settings->custom_zlib) return 87; /*no custom zlib function provided */
   return settings->custom_zlib(out, outsize, in, insize, settings);
 }
@@ -2280,13 +2944,15 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->maxchainlength = 0;
+  settings->rle = 0;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2356,16 +3022,155 @@ static unsigned lodepng_crc32_table[256] = {
   3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
 };
 
-/*Return the CRC of the bytes buf[0..len-1].*/
-unsigned lodepng_crc32(const unsigned char* data, size_t length)
+/*
+Slicing-by-8: lodepng_crc32_table8[k][n] is the CRC contribution of byte n followed by k zero
+bytes, so 8 bytes are folded in with 8 independent table lookups. Filled in by selectCRC32.
+*/
+static unsigned lodepng_crc32_table8[8][256];
+
+typedef unsigned (*CRC32Func)(unsigned r, const unsigned char* data, size_t length);
+
+/*r is the running (inverted) CRC register*/
+static unsigned update_crc32(unsigned r, const unsigned char* data, size_t length)
 {
-  unsigned r = 0xffffffffu;
-  size_t i;
-  for(i = 0; i < length; ++i)
+  const unsigned (*t)[256] = lodepng_crc32_table8;
+  for(; length >= 8; length -= 8, data += 8)
+  {
+    unsigned a = r ^ (data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned)data[3] << 24));
+    unsigned b = data[4] | (data[5] << 8) | (data[6] << 16) | ((unsigned)data[7] << 24);
+    r = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^ t[4][a >> 24]
+      ^ t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^ t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+  }
+  for(; length > 0; --length, ++data)
+  {
+    r = lodepng_crc32_table[(r ^ *data) & 0xff] ^ (r >> 8);
+  }
+  return r;
+}
+
+#ifdef LODEPNG_USE_PCLMUL
+/*
+Carry-less multiplication folding, after Intel's "Fast CRC Computation for Generic Polynomials
+Using PCLMULQDQ Instruction". 64 bytes are folded per iteration, then reduced to 128 bits and
+finally to 32 bits with a Barrett reduction. The constants are the bit-reflected ones for the
+CRC-32 polynomial from that paper.
+*/
+__attribute__((target("sse2,pclmul")))
+static unsigned update_crc32PCLMUL(unsigned r, const unsigned char* data, size_t length)
+{
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, mask;
+  size_t blocks = length & ~(size_t)15;
+
+  if(length < 64) return update_crc32(r, data, length);
+
+  x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)data), _mm_cvtsi32_si128((int)r));
+  x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+  x3 = _mm_loadu_si128((const __m128i*)(data + 32));
+  x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+  data += 64;
+  length -= 64;
+  blocks -= 64;
+
+  x0 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL); /*k2, k1*/
+  for(; blocks >= 64; blocks -= 64, length -= 64, data += 64)
+  {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)data));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 16)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 32)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 48)));
+  }
+
+  /*fold the 4 registers into one, then fold in the remaining 16 byte blocks*/
+  x0 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL); /*k4, k3*/
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x11), x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x11), x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x11), x4), x5);
+  for(; blocks >= 16; blocks -= 16, length -= 16, data += 16)
+  {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+  }
+
+  /*128 to 64 bits*/
+  mask = _mm_setr_epi32(-1, 0, -1, 0);
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x0 = _mm_set_epi64x(0, 0x0163cd6124LL); /*k5*/
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), x0, 0x00), x2);
+
+  /*Barrett reduction to 32 bits*/
+  x0 = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL); /*u', P(x)'*/
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), x0, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  r = (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+
+  return update_crc32(r, data, length);
+}
+#endif /*LODEPNG_USE_PCLMUL*/
+
+#ifdef LODEPNG_USE_ARM_CRC32
+/*the ARMv8 CRC32 instructions use the same (reflected) polynomial as PNG*/
+static unsigned update_crc32ARM(unsigned r, const unsigned char* data, size_t length)
+{
+  for(; length > 0 && ((size_t)data & 7); --length, ++data) r = __crc32b(r, *data);
+  for(; length >= 8; length -= 8, data += 8)
   {
-    r = lodepng_crc32_table[(r ^ data[i]) & 0xff] ^ (r >> 8);
+    uint64_t v;
+    memcpy(&v, data, 8);
+    r = __crc32d(r, v);
   }
-  return r ^ 0xffffffffu;
+  for(; length > 0; --length, ++data) r = __crc32b(r, *data);
+  return r;
+}
+#endif /*LODEPNG_USE_ARM_CRC32*/
+
+static CRC32Func selectCRC32(void)
+{
+  unsigned n, k;
+  for(n = 0; n != 256; ++n) lodepng_crc32_table8[0][n] = lodepng_crc32_table[n];
+  for(k = 1; k != 8; ++k)
+  {
+    for(n = 0; n != 256; ++n)
+    {
+      unsigned c = lodepng_crc32_table8[k - 1][n];
+      lodepng_crc32_table8[k][n] = (c >> 8) ^ lodepng_crc32_table[c & 0xff];
+    }
+  }
+
+#if defined(LODEPNG_USE_ARM_CRC32)
+#if defined(__linux__) && defined(__aarch64__)
+  if(getauxval(AT_HWCAP) & HWCAP_CRC32)
+#elif defined(__linux__)
+  if(getauxval(AT_HWCAP2) & HWCAP2_CRC32)
+#endif
+    return update_crc32ARM;
+#elif defined(LODEPNG_USE_PCLMUL)
+  if(__builtin_cpu_supports("pclmul")) return update_crc32PCLMUL;
+#endif
+  return update_crc32;
+}
+
+/*selected once at load time*/
+static const CRC32Func update_crc32_fast = selectCRC32();
+
+/*Return the CRC of the bytes buf[0..len-1].*/
+unsigned lodepng_crc32(const unsigned char* data, size_t length)
+{
+  return update_crc32_fast(0xffffffffu, data, length) ^ 0xffffffffu;
 }
 #else /* !LODEPNG_NO_COMPILE_CRC */
 unsigned lodepng_crc32(const unsigned char* data, size_t length);
@@ -3904,69 +4709,291 @@ static void Adam7_getpassvalues(unsigned passw[7], unsigned passh[7], size_t fil
 unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
                          const unsigned char* in, size_t insize)
 {
-  LodePNGInfo* info = &state->info_png;
-  if(insize == 0 || in == 0)
-  {
-    CERROR_RETURN_ERROR(state->error, 48); /*error: the given data is empty*/
-  }
-  if(insize < 33)
+  LodePNGInfo* info = &state->info_png;
+  if(insize == 0 || in == 0)
+  {
+    CERROR_RETURN_ERROR(state->error, 48); /*error: the given data is empty*/
+  }
+  if(insize < 33)
+  {
+    CERROR_RETURN_ERROR(state->error, 27); /*error: the data length is smaller than the length of a PNG header*/
+  }
+
+  /*when decoding a new PNG image, make sure all parameters created after previous decoding are reset*/
+  lodepng_info_cleanup(info);
+  lodepng_info_init(info);
+
+  if(in[0] != 137 || in[1] != 80 || in[2] != 78 || in[3] != 71
+     || in[4] != 13 || in[5] != 10 || in[6] != 26 || in[7] != 10)
+  {
+    CERROR_RETURN_ERROR(state->error, 28); /*error: the first 8 bytes are not the correct PNG signature*/
+  }
+  if(lodepng_chunk_length(in + 8) != 13)
+  {
+    CERROR_RETURN_ERROR(state->error, 94); /*error: header size must be 13 bytes*/
+  }
+  if(!lodepng_chunk_type_equals(in + 8, "IHDR"))
+  {
+    CERROR_RETURN_ERROR(state->error, 29); /*error: it doesn't start with a IHDR chunk!*/
+  }
+
+  /*read the values given in the header*/
+  *w = lodepng_read32bitInt(&in[16]);
+  *h = lodepng_read32bitInt(&in[20]);
+  info->color.bitdepth = in[24];
+  info->color.colortype = (LodePNGColorType)in[25];
+  info->compression_method = in[26];
+  info->filter_method = in[27];
+  info->interlace_method = in[28];
+
+  if(*w == 0 || *h == 0)
+  {
+    CERROR_RETURN_ERROR(state->error, 93);
+  }
+
+  if(!state->decoder.ignore_crc)
+  {
+    unsigned CRC = lodepng_read32bitInt(&in[29]);
+    unsigned checksum = lodepng_crc32(&in[12], 17);
+    if(CRC != checksum)
+    {
+      CERROR_RETURN_ERROR(state->error, 57); /*invalid CRC*/
+    }
+  }
+
+  /*error: only compression method 0 is allowed in the specification*/
+  if(info->compression_method != 0) CERROR_RETURN_ERROR(state->error, 32);
+  /*error: only filter method 0 is allowed in the specification*/
+  if(info->filter_method != 0) CERROR_RETURN_ERROR(state->error, 33);
+  /*error: only interlace methods 0 and 1 exist in the specification*/
+  if(info->interlace_method > 1) CERROR_RETURN_ERROR(state->error, 34);
+
+  state->error = checkColorValidity(info->color.colortype, info->color.bitdepth);
+  return state->error;
+}
+
+/*
+SIMD versions of the Up filter (any bytewidth) and of the Sub, Average and Paeth filters for
+3 and 4 bytes per pixel (8-bit RGB and RGBA), the most common PNG formats. Sub, Average and
+Paeth depend on the previous pixel, so they run one pixel per iteration with all its channels
+in one register; Paeth is computed without branches. The results are bit-exact with the scalar
+code. They return 0 for the cases they don't handle, unfilterScanline then uses the scalar code.
+recon and scanline MAY be the same memory address, every pixel is read before it is written.
+*/
+typedef unsigned (*UnfilterSIMDFunc)(unsigned char* recon, const unsigned char* scanline,
+                                     const unsigned char* precon, size_t bytewidth,
+                                     unsigned char filterType, size_t length);
+
+#if defined(LODEPNG_USE_SSE2) || defined(LODEPNG_USE_NEON)
+/*load/store the n (3 or 4) bytes of one pixel in the low bytes of a 32-bit value*/
+static uint32_t loadPixel(const unsigned char* p, size_t n)
+{
+  uint32_t v = 0;
+  memcpy(&v, p, n);
+  return v;
+}
+
+static void storePixel(unsigned char* p, uint32_t v, size_t n)
+{
+  memcpy(p, &v, n);
+}
+#endif /*defined(LODEPNG_USE_SSE2) || defined(LODEPNG_USE_NEON)*/
+
+#ifdef LODEPNG_USE_SSE2
+static unsigned unfilterScanlineSSE2(unsigned char* recon, const unsigned char* scanline,
+                                     const unsigned char* precon, size_t bytewidth,
+                                     unsigned char filterType, size_t length)
+{
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+
+  if(filterType == 2)
+  {
+    if(!precon) return 0;
+    for(; i + 16 <= length; i += 16)
+    {
+      __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+      __m128i b = _mm_loadu_si128((const __m128i*)(precon + i));
+      _mm_storeu_si128((__m128i*)(recon + i), _mm_add_epi8(x, b));
+    }
+    for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+    return 1;
+  }
+
+  if(bytewidth != 3 && bytewidth != 4) return 0;
+
+  if(filterType == 1)
+  {
+    __m128i a = zero; /*previous reconstructed pixel*/
+    if(bytewidth == 4)
+    {
+      /*4 pixels at once: a prefix sum over the pixels of the register*/
+      for(; i + 16 <= length; i += 16)
+      {
+        __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi8(x, a);
+        _mm_storeu_si128((__m128i*)(recon + i), x);
+        a = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+      }
+    }
+    for(; i != length; i += bytewidth)
+    {
+      a = _mm_add_epi8(_mm_cvtsi32_si128((int)loadPixel(scanline + i, bytewidth)), a);
+      storePixel(recon + i, (uint32_t)_mm_cvtsi128_si32(a), bytewidth);
+    }
+    return 1;
+  }
+
+  if(!precon) return 0;
+
+  if(filterType == 3)
+  {
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a = zero;
+    for(; i != length; i += bytewidth)
+    {
+      __m128i b = _mm_cvtsi32_si128((int)loadPixel(precon + i, bytewidth));
+      /*_mm_avg_epu8 rounds up, (a + b) >> 1 rounds down*/
+      __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+      a = _mm_add_epi8(_mm_cvtsi32_si128((int)loadPixel(scanline + i, bytewidth)), avg);
+      storePixel(recon + i, (uint32_t)_mm_cvtsi128_si32(a), bytewidth);
+    }
+    return 1;
+  }
+
+  if(filterType == 4)
+  {
+    /*a, b and c are the left, up and upper left pixels, as 16-bit values*/
+    __m128i a = zero, c = zero;
+    for(; i != length; i += bytewidth)
+    {
+      __m128i b = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)loadPixel(precon + i, bytewidth)), zero);
+      __m128i pa = _mm_sub_epi16(b, c); /*p - a, with p = a + b - c*/
+      __m128i pb = _mm_sub_epi16(a, c); /*p - b*/
+      __m128i pc = _mm_add_epi16(pa, pb); /*p - c*/
+      __m128i smallest, nearest, mask;
+      pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+      pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+      pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+      smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+      /*ties favor a over b over c, as in paethPredictor*/
+      mask = _mm_cmpeq_epi16(smallest, pb);
+      nearest = _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, c));
+      mask = _mm_cmpeq_epi16(smallest, pa);
+      nearest = _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, nearest));
+      nearest = _mm_add_epi8(_mm_cvtsi32_si128((int)loadPixel(scanline + i, bytewidth)),
+                             _mm_packus_epi16(nearest, nearest));
+      storePixel(recon + i, (uint32_t)_mm_cvtsi128_si32(nearest), bytewidth);
+      a = _mm_unpacklo_epi8(nearest, zero);
+      c = b;
+    }
+    return 1;
+  }
+
+  return 0;
+}
+#endif /*LODEPNG_USE_SSE2*/
+
+#ifdef LODEPNG_USE_NEON
+static uint8x8_t loadPixelNEON(const unsigned char* p, size_t n)
+{
+  return vreinterpret_u8_u32(vdup_n_u32(loadPixel(p, n)));
+}
+
+static void storePixelNEON(unsigned char* p, uint8x8_t v, size_t n)
+{
+  storePixel(p, vget_lane_u32(vreinterpret_u32_u8(v), 0), n);
+}
+
+static unsigned unfilterScanlineNEON(unsigned char* recon, const unsigned char* scanline,
+                                     const unsigned char* precon, size_t bytewidth,
+                                     unsigned char filterType, size_t length)
+{
+  size_t i = 0;
+
+  if(filterType == 2)
   {
-    CERROR_RETURN_ERROR(state->error, 27); /*error: the data length is smaller than the length of a PNG header*/
+    if(!precon) return 0;
+    for(; i + 16 <= length; i += 16)
+    {
+      vst1q_u8(recon + i, vaddq_u8(vld1q_u8(scanline + i), vld1q_u8(precon + i)));
+    }
+    for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+    return 1;
   }
 
-  /*when decoding a new PNG image, make sure all parameters created after previous decoding are reset*/
-  lodepng_info_cleanup(info);
-  lodepng_info_init(info);
+  if(bytewidth != 3 && bytewidth != 4) return 0;
 
-  if(in[0] != 137 || in[1] != 80 || in[2] != 78 || in[3] != 71
-     || in[4] != 13 || in[5] != 10 || in[6] != 26 || in[7] != 10)
+  if(filterType == 1)
   {
-    CERROR_RETURN_ERROR(state->error, 28); /*error: the first 8 bytes are not the correct PNG signature*/
-  }
-  if(lodepng_chunk_length(in + 8) != 13)
-  {
-    CERROR_RETURN_ERROR(state->error, 94); /*error: header size must be 13 bytes*/
-  }
-  if(!lodepng_chunk_type_equals(in + 8, "IHDR"))
-  {
-    CERROR_RETURN_ERROR(state->error, 29); /*error: it doesn't start with a IHDR chunk!*/
+    uint8x8_t a = vdup_n_u8(0); /*previous reconstructed pixel*/
+    for(; i != length; i += bytewidth)
+    {
+      a = vadd_u8(loadPixelNEON(scanline + i, bytewidth), a);
+      storePixelNEON(recon + i, a, bytewidth);
+    }
+    return 1;
   }
 
-  /*read the values given in the header*/
-  *w = lodepng_read32bitInt(&in[16]);
-  *h = lodepng_read32bitInt(&in[20]);
-  info->color.bitdepth = in[24];
-  info->color.colortype = (LodePNGColorType)in[25];
-  info->compression_method = in[26];
-  info->filter_method = in[27];
-  info->interlace_method = in[28];
+  if(!precon) return 0;
 
-  if(*w == 0 || *h == 0)
+  if(filterType == 3)
   {
-    CERROR_RETURN_ERROR(state->error, 93);
+    uint8x8_t a = vdup_n_u8(0);
+    for(; i != length; i += bytewidth)
+    {
+      a = vadd_u8(loadPixelNEON(scanline + i, bytewidth), vhadd_u8(a, loadPixelNEON(precon + i, bytewidth)));
+      storePixelNEON(recon + i, a, bytewidth);
+    }
+    return 1;
   }
 
-  if(!state->decoder.ignore_crc)
+  if(filterType == 4)
   {
-    unsigned CRC = lodepng_read32bitInt(&in[29]);
-    unsigned checksum = lodepng_crc32(&in[12], 17);
-    if(CRC != checksum)
+    /*a, b and c are the left, up and upper left pixels*/
+    uint8x8_t a = vdup_n_u8(0), c = vdup_n_u8(0);
+    for(; i != length; i += bytewidth)
     {
-      CERROR_RETURN_ERROR(state->error, 57); /*invalid CRC*/
+      uint8x8_t b = loadPixelNEON(precon + i, bytewidth);
+      uint16x8_t pa = vmovl_u8(vabd_u8(b, c)); /*|p - a|, with p = a + b - c*/
+      uint16x8_t pb = vmovl_u8(vabd_u8(a, c)); /*|p - b|*/
+      uint16x8_t pc = vabdq_u16(vaddl_u8(a, b), vshll_n_u8(c, 1)); /*|p - c|*/
+      uint16x8_t smallest = vminq_u16(pc, vminq_u16(pa, pb));
+      /*ties favor a over b over c, as in paethPredictor*/
+      uint8x8_t nearest = vbsl_u8(vmovn_u16(vceqq_u16(smallest, pb)), b, c);
+      nearest = vbsl_u8(vmovn_u16(vceqq_u16(smallest, pa)), a, nearest);
+      a = vadd_u8(loadPixelNEON(scanline + i, bytewidth), nearest);
+      storePixelNEON(recon + i, a, bytewidth);
+      c = b;
     }
+    return 1;
   }
 
-  /*error: only compression method 0 is allowed in the specification*/
-  if(info->compression_method != 0) CERROR_RETURN_ERROR(state->error, 32);
-  /*error: only filter method 0 is allowed in the specification*/
-  if(info->filter_method != 0) CERROR_RETURN_ERROR(state->error, 33);
-  /*error: only interlace methods 0 and 1 exist in the specification*/
-  if(info->interlace_method > 1) CERROR_RETURN_ERROR(state->error, 34);
-
-  state->error = checkColorValidity(info->color.colortype, info->color.bitdepth);
-  return state->error;
+  return 0;
+}
+#endif /*LODEPNG_USE_NEON*/
+
+static UnfilterSIMDFunc selectUnfilterSIMD(void)
+{
+#if defined(LODEPNG_USE_NEON)
+#if defined(__linux__) && !defined(__aarch64__)
+  if(getauxval(AT_HWCAP) & HWCAP_NEON)
+#endif
+    return unfilterScanlineNEON;
+#elif defined(LODEPNG_USE_SSE2)
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+  if(__builtin_cpu_supports("sse2"))
+#endif
+    return unfilterScanlineSSE2;
+#endif
+  return 0;
 }
 
+/*selected once at load time, 0 if there is no SIMD implementation for this CPU*/
+static const UnfilterSIMDFunc unfilterSIMD = selectUnfilterSIMD();
+
 static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
                                  size_t bytewidth, unsigned char filterType, size_t length)
 {
@@ -3980,6 +5007,7 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   */
 
   size_t i;
+  if(unfilterSIMD && filterType != 0 && unfilterSIMD(recon, scanline, precon, bytewidth, filterType, length)) return 0;
   switch(filterType)
   {
     case 0:
@@ -4380,7 +5408,7 @@ static unsigned readChunk_zTXt(LodePNGInfo* info, const LodePNGDecompressSetting
 
     length = chunkLength - string2_begin;
     /*will fail if zlib error, e.g. if length is too small*/
-    error = zlib_decompress(&decoded.data, &decoded.size,
+    error = zlib_decompress(&decoded.data, &decoded.size, 0,
                             (unsigned char*)(&data[string2_begin]),
                             length, zlibsettings);
     if(error) break;
@@ -4463,7 +5491,7 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const LodePNGDecompressSetting
     if(compressed)
     {
       /*will fail if zlib error, e.g. if length is too small*/
-      error = zlib_decompress(&decoded.data, &decoded.size,
+      error = zlib_decompress(&decoded.data, &decoded.size, 0,
                               (unsigned char*)(&data[begin]),
                               length, zlibsettings);
       if(error) break;
@@ -4520,18 +5548,15 @@ static unsigned readChunk_pHYs(LodePNGInfo* info, const unsigned char* data, siz
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
 /*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
-static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
-                          LodePNGState* state,
-                          const unsigned char* in, size_t insize)
+/*reads the header and all chunks into state, and appends the contents of the IDAT chunks to idat*/
+static void decodeChunks(ucvector* idat, unsigned* w, unsigned* h,
+                         LodePNGState* state,
+                         const unsigned char* in, size_t insize)
 {
   unsigned char IEND = 0;
   const unsigned char* chunk;
   size_t i;
-  ucvector idat; /*the data from idat chunks*/
-  ucvector scanlines;
-  size_t predict;
   size_t numpixels;
-  size_t outsize = 0;
 
   /*for unknown chunk order*/
   unsigned unknown = 0;
@@ -4539,9 +5564,6 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   unsigned critical_pos = 1; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-  /*provide some proper output values if error will happen*/
-  *out = 0;
-
   state->error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
   if(state->error) return;
 
@@ -4558,7 +5580,6 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
 	  CERROR_RETURN(state->error, 95);
   }
 
-  ucvector_init(&idat);
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
   /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
@@ -4586,9 +5607,9 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     /*IDAT chunk, containing compressed image data*/
     if(lodepng_chunk_type_equals(chunk, "IDAT"))
     {
-      size_t oldsize = idat.size;
-      if(!ucvector_resize(&idat, oldsize + chunkLength)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
-      for(i = 0; i != chunkLength; ++i) idat.data[oldsize + i] = data[i];
+      size_t oldsize = idat->size;
+      if(!ucvector_resize(idat, oldsize + chunkLength)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
+      for(i = 0; i != chunkLength; ++i) idat->data[oldsize + i] = data[i];
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
       critical_pos = 3;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
@@ -4681,6 +5702,28 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
 
     if(!IEND) chunk = lodepng_chunk_next_const(chunk);
   }
+}
+
+static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
+                          LodePNGState* state,
+                          const unsigned char* in, size_t insize)
+{
+  size_t i;
+  ucvector idat; /*the data from idat chunks*/
+  ucvector scanlines;
+  size_t predict;
+  size_t outsize = 0;
+
+  /*provide some proper output values if error will happen*/
+  *out = 0;
+
+  ucvector_init(&idat);
+  decodeChunks(&idat, w, h, state, in, insize);
+  if(state->error)
+  {
+    ucvector_cleanup(&idat);
+    return;
+  }
 
   ucvector_init(&scanlines);
   /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
@@ -4706,7 +5749,7 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   if(!state->error && !ucvector_reserve(&scanlines, predict)) state->error = 83; /*alloc fail*/
   if(!state->error)
   {
-    state->error = zlib_decompress(&scanlines.data, &scanlines.size, idat.data,
+    state->error = zlib_decompress(&scanlines.data, &scanlines.size, predict, idat.data,
                                    idat.size, &state->decoder.zlibsettings);
     if(!state->error && scanlines.size != predict) state->error = 91; /*decompressed size doesn't match prediction*/
   }
@@ -4771,6 +5814,215 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
   return state->error;
 }
 
+#ifdef LODEPNG_COMPILE_ZLIB
+
+/*how much inflated data lodepng_decode_rows collects before unfiltering it*/
+#define LODEPNG_ROWS_CHUNK_SIZE 262144
+
+/*receives the scanlines of a non interlaced image from the zlib stream and unfilters them into the
+rows of the output, see lodepng_decode_rows*/
+typedef struct LodePNGRowSink
+{
+  unsigned char* out;
+  size_t stride;
+  const LodePNGColorMode* mode_out; /*NULL if the rows go to out without conversion*/
+  const LodePNGColorMode* mode_in;
+  unsigned w, h;
+  unsigned y; /*the next row of out*/
+  size_t linebytes; /*size of a scanline, without its filter type byte*/
+  size_t bytewidth;
+  unsigned char* scanline; /*the part of a scanline that arrived so far, if it came in pieces*/
+  size_t filled;
+  unsigned char* recon; /*when converting: the unfiltered scanline and the one above it*/
+  unsigned char* precon;
+} LodePNGRowSink;
+
+/*scanline is the filter type byte followed by the filtered bytes*/
+static unsigned rowSinkScanline(LodePNGRowSink* rows, const unsigned char* scanline)
+{
+  unsigned error;
+  unsigned char* dest;
+  if(rows->y >= rows->h) return 91; /*decompressed size doesn't match prediction*/
+  dest = &rows->out[rows->y * rows->stride];
+
+  if(rows->mode_out)
+  {
+    unsigned char* temp = rows->precon;
+    error = unfilterScanline(rows->recon, scanline + 1, rows->y ? rows->precon : 0, rows->bytewidth,
+                             scanline[0], rows->linebytes);
+    if(!error) error = lodepng_convert(dest, rows->recon, rows->mode_out, rows->mode_in, rows->w, 1);
+    rows->precon = rows->recon;
+    rows->recon = temp;
+  }
+  else
+  {
+    /*the row above is already unfiltered in out*/
+    error = unfilterScanline(dest, scanline + 1, rows->y ? dest - rows->stride : 0, rows->bytewidth,
+                             scanline[0], rows->linebytes);
+  }
+
+  ++rows->y;
+  return error;
+}
+
+static unsigned rowSinkWrite(void* context, const unsigned char* data, size_t size)
+{
+  LodePNGRowSink* rows = (LodePNGRowSink*)context;
+  size_t rowsize = rows->linebytes + 1;
+  unsigned error = 0;
+
+  while(size != 0 && !error)
+  {
+    if(rows->filled == 0 && size >= rowsize)
+    {
+      /*whole scanlines are unfiltered from where they are*/
+      error = rowSinkScanline(rows, data);
+      data += rowsize;
+      size -= rowsize;
+    }
+    else
+    {
+      size_t n = rowsize - rows->filled;
+      if(n > size) n = size;
+      memcpy(rows->scanline + rows->filled, data, n);
+      rows->filled += n;
+      data += n;
+      size -= n;
+      if(rows->filled == rowsize)
+      {
+        rows->filled = 0;
+        error = rowSinkScanline(rows, rows->scanline);
+      }
+    }
+  }
+
+  return error;
+}
+
+/*inflates the image data of a non interlaced image a part at a time, unfiltering the rows as they complete*/
+static unsigned decodeRowsStreaming(unsigned char* out, size_t stride, unsigned w, unsigned h, unsigned convert,
+                                    LodePNGState* state, const ucvector* idat)
+{
+  unsigned error = 0;
+  unsigned bpp = lodepng_get_bpp(&state->info_png.color);
+  LodePNGRowSink rows;
+  InflateSink sink;
+
+  rows.out = out;
+  rows.stride = stride;
+  rows.mode_out = convert ? &state->info_raw : 0;
+  rows.mode_in = &state->info_png.color;
+  rows.w = w;
+  rows.h = h;
+  rows.y = 0;
+  rows.linebytes = ((size_t)w * bpp + 7) / 8;
+  rows.bytewidth = (bpp + 7) / 8;
+  rows.filled = 0;
+  rows.scanline = (unsigned char*)lodepng_malloc(rows.linebytes + 1);
+  rows.recon = convert ? (unsigned char*)lodepng_malloc(rows.linebytes) : 0;
+  rows.precon = convert ? (unsigned char*)lodepng_malloc(rows.linebytes) : 0;
+  if(!rows.scanline || (convert && (!rows.recon || !rows.precon))) error = 83; /*alloc fail*/
+
+  if(!error)
+  {
+    sink.write = rowSinkWrite;
+    sink.context = &rows;
+    sink.chunksize = LODEPNG_ROWS_CHUNK_SIZE;
+    sink.flushed = 0;
+    error = zlib_decompress_sink(idat->data, idat->size, &state->decoder.zlibsettings, &sink);
+    /*decompressed size doesn't match prediction*/
+    if(!error && (rows.y != h || rows.filled != 0)) error = 91;
+  }
+
+  lodepng_free(rows.scanline);
+  lodepng_free(rows.recon);
+  lodepng_free(rows.precon);
+  return error;
+}
+
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+/*decodes the whole image with lodepng_decode and copies its rows to out*/
+static unsigned decodeRowsWhole(unsigned char* out, size_t stride, unsigned* w, unsigned* h,
+                                LodePNGState* state, const unsigned char* in, size_t insize)
+{
+  unsigned char* image = 0;
+  unsigned y;
+  unsigned error = lodepng_decode(&image, w, h, state, in, insize);
+  if(!error)
+  {
+    size_t linebits = (size_t)(*w) * lodepng_get_bpp(&state->info_raw);
+    for(y = 0; y != *h; ++y)
+    {
+      if(linebits % 8 == 0)
+      {
+        memcpy(&out[y * stride], &image[y * (linebits / 8)], linebits / 8);
+      }
+      else /*rows of less than 8 bits per pixel are not byte aligned in image*/
+      {
+        size_t ibp = y * linebits, obp = y * stride * 8, x;
+        for(x = 0; x != linebits; ++x) setBitOfReversedStream(&obp, out, readBitFromReversedStream(&ibp, image));
+      }
+    }
+  }
+  lodepng_free(image);
+  return error;
+}
+
+unsigned lodepng_decode_rows(unsigned char* out, size_t stride, unsigned* w, unsigned* h,
+                             LodePNGState* state, const unsigned char* in, size_t insize)
+{
+  ucvector idat;
+  unsigned convert = 0;
+  unsigned streaming = 0;
+
+  ucvector_init(&idat);
+  decodeChunks(&idat, w, h, state, in, insize);
+
+  if(!state->error)
+  {
+    /*the same color handling as lodepng_decode*/
+    unsigned equal = lodepng_color_mode_equal(&state->info_raw, &state->info_png.color);
+    if((!state->decoder.color_convert || equal)
+       && state->info_png.color.colortype != LCT_PALETTE && state->info_png.color.colortype != LCT_RGB)
+    {
+      if(!state->decoder.color_convert)
+      {
+        state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+      }
+    }
+    else if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+            && !(state->info_raw.bitdepth == 8))
+    {
+      state->error = 56; /*unsupported color mode conversion*/
+    }
+    else convert = !equal;
+  }
+  if(!state->error && stride < ((size_t)(*w) * lodepng_get_bpp(&state->info_raw) + 7) / 8)
+  {
+    state->error = 96; /*stride smaller than a row of the image*/
+  }
+
+#ifdef LODEPNG_COMPILE_ZLIB
+  /*custom decompressors only give the data all at once*/
+  streaming = state->info_png.interlace_method == 0
+              && !state->decoder.zlibsettings.custom_zlib && !state->decoder.zlibsettings.custom_inflate;
+  if(!state->error && streaming)
+  {
+    state->error = decodeRowsStreaming(out, stride, *w, *h, convert, state, &idat);
+  }
+#else /*no LODEPNG_COMPILE_ZLIB*/
+  (void)convert;
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  ucvector_cleanup(&idat);
+
+  if(!state->error && !streaming)
+  {
+    state->error = decodeRowsWhole(out, stride, w, h, state, in, insize);
+  }
+  return state->error;
+}
+
 unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
                                size_t insize, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -5212,12 +6464,16 @@ static float flog2(float f)
   return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+/*step between the bytes of a scanline that LFS_FAST looks at*/
+#define LODEPNG_FAST_FILTER_SAMPLE 7
+
+static unsigned filterRows(unsigned char* out, const unsigned char* in, unsigned w, unsigned y0, unsigned y1,
+                           const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
 {
   /*
   For PNG filter method 0
-  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
+  filters the scanlines y0..y1-1 of the image in into out, which receives the filtered scanline y0
+  first. out must be a buffer with as size: (y1 - y0) * (1 + (w * bpp + 7) / 8), because there are
   the scanlines with 1 extra byte per scanline
   */
 
@@ -5226,7 +6482,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   size_t linebytes = (w * bpp + 7) / 8;
   /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
   size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
+  const unsigned char* prevline = y0 ? &in[(y0 - 1) * linebytes] : 0;
   unsigned x, y;
   unsigned error = 0;
   LodePNGFilterStrategy strategy = settings->filter_strategy;
@@ -5251,9 +6507,9 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
 
   if(strategy == LFS_ZERO)
   {
-    for(y = 0; y != h; ++y)
+    for(y = y0; y != y1; ++y)
     {
-      size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
+      size_t outindex = (1 + linebytes) * (y - y0); /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
       out[outindex] = 0; /*filter type byte*/
       filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, 0);
@@ -5276,7 +6532,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
 
     if(!error)
     {
-      for(y = 0; y != h; ++y)
+      for(y = y0; y != y1; ++y)
       {
         /*try the 5 filter types*/
         for(type = 0; type != 5; ++type)
@@ -5312,8 +6568,8 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
         prevline = &in[y * linebytes];
 
         /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
+        out[(y - y0) * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+        for(x = 0; x != linebytes; ++x) out[(y - y0) * (linebytes + 1) + 1 + x] = attempt[bestType][x];
       }
     }
 
@@ -5333,7 +6589,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       if(!attempt[type]) return 83; /*alloc fail*/
     }
 
-    for(y = 0; y != h; ++y)
+    for(y = y0; y != y1; ++y)
     {
       /*try the 5 filter types*/
       for(type = 0; type != 5; ++type)
@@ -5359,17 +6615,58 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       prevline = &in[y * linebytes];
 
       /*now fill the out values*/
-      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-      for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
+      out[(y - y0) * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+      for(x = 0; x != linebytes; ++x) out[(y - y0) * (linebytes + 1) + 1 + x] = attempt[bestType][x];
     }
 
     for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
   }
+  else if(strategy == LFS_FAST)
+  {
+    unsigned char type, bestType;
+    size_t sum[5];
+
+    for(y = y0; y != y1; ++y)
+    {
+      size_t outindex = (1 + linebytes) * (y - y0); /*the extra filterbyte added to each row*/
+      size_t inindex = linebytes * y;
+      const unsigned char* scanline = &in[inindex];
+
+      /*the minimum sum heuristic on every LODEPNG_FAST_FILTER_SAMPLE'th byte. That step is
+      coprime with every bytewidth, so all channels get sampled.*/
+      for(type = 0; type != 5; ++type) sum[type] = 0;
+      for(x = 0; x < linebytes; x += LODEPNG_FAST_FILTER_SAMPLE)
+      {
+        short s = scanline[x];
+        short a = x >= bytewidth ? scanline[x - bytewidth] : 0;
+        short b = prevline ? prevline[x] : 0;
+        short c = prevline && x >= bytewidth ? prevline[x - bytewidth] : 0;
+        unsigned char d[5];
+        d[0] = (unsigned char)s;
+        d[1] = (unsigned char)(s - a);
+        d[2] = (unsigned char)(s - b);
+        d[3] = (unsigned char)(s - ((a + b) >> 1));
+        d[4] = (unsigned char)(s - paethPredictor(a, b, c));
+        sum[0] += d[0];
+        for(type = 1; type != 5; ++type) sum[type] += d[type] < 128 ? d[type] : (255U - d[type]);
+      }
+
+      bestType = 0;
+      for(type = 1; type != 5; ++type)
+      {
+        if(sum[type] < sum[bestType]) bestType = type;
+      }
+
+      out[outindex] = bestType; /*filter type byte*/
+      filterScanline(&out[outindex + 1], scanline, prevline, linebytes, bytewidth, bestType);
+      prevline = scanline;
+    }
+  }
   else if(strategy == LFS_PREDEFINED)
   {
-    for(y = 0; y != h; ++y)
+    for(y = y0; y != y1; ++y)
     {
-      size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
+      size_t outindex = (1 + linebytes) * (y - y0); /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
       unsigned char type = settings->predefined_filters[y];
       out[outindex] = type; /*filter type byte*/
@@ -5402,7 +6699,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
       if(!attempt[type]) return 83; /*alloc fail*/
     }
-    for(y = 0; y != h; ++y) /*try the 5 filter types*/
+    for(y = y0; y != y1; ++y) /*try the 5 filter types*/
     {
       for(type = 0; type != 5; ++type)
       {
@@ -5422,8 +6719,8 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
         }
       }
       prevline = &in[y * linebytes];
-      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-      for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
+      out[(y - y0) * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+      for(x = 0; x != linebytes; ++x) out[(y - y0) * (linebytes + 1) + 1 + x] = attempt[bestType][x];
     }
     for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
   }
@@ -5432,6 +6729,12 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   return error;
 }
 
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+{
+  return filterRows(out, in, w, 0, h, info, settings);
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h)
 {
@@ -5603,6 +6906,180 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
   return error;
 }
 
+#if defined(LODEPNG_COMPILE_ZLIB) && defined(LODEPNG_COMPILE_THREADS)
+/*upper bound for the number of threads used by encodeBands*/
+#define LODEPNG_MAX_THREADS 8
+/*amount of filtered image data per band, about the size of the deflate blocks of the serial encoder*/
+#define LODEPNG_BAND_SIZE 262144
+
+/*the Adler32 of the concatenation of two buffers, given their Adler32s and the length of the second*/
+static unsigned adler32_combine(unsigned adler1, unsigned adler2, size_t len2)
+{
+  unsigned rem = (unsigned)(len2 % 65521);
+  unsigned s1 = adler1 & 0xffff;
+  unsigned s2 = (rem * s1) % 65521;
+  s1 += (adler2 & 0xffff) + 65521 - 1;
+  s2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + 65521 - rem;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s2 >= 65521 * 2) s2 -= 65521 * 2;
+  if(s2 >= 65521) s2 -= 65521;
+  return (s2 << 16) | s1;
+}
+
+typedef struct LodePNGBandJob
+{
+  const unsigned char* in; /*the (padded) image*/
+  unsigned char* filtered; /*the filtered scanlines of the whole image*/
+  unsigned w, h;
+  unsigned rows; /*scanlines per band*/
+  unsigned numbands;
+  volatile unsigned next; /*next band to be encoded*/
+  const LodePNGColorMode* color;
+  const LodePNGEncoderSettings* settings;
+  ucvector* deflated; /*per band*/
+  unsigned* adler; /*per band*/
+  unsigned* errors; /*per band*/
+} LodePNGBandJob;
+
+static void* encodeBandWorker(void* arg)
+{
+  LodePNGBandJob* job = (LodePNGBandJob*)arg;
+  size_t linebytes = (job->w * lodepng_get_bpp(job->color) + 7) / 8;
+  unsigned band;
+  while((band = __sync_fetch_and_add(&job->next, 1)) < job->numbands)
+  {
+    unsigned y0 = band * job->rows;
+    unsigned y1 = y0 + job->rows > job->h ? job->h : y0 + job->rows;
+    unsigned char* data = &job->filtered[y0 * (linebytes + 1)];
+    size_t datasize = (y1 - y0) * (linebytes + 1);
+    unsigned error = filterRows(data, job->in, job->w, y0, y1, job->color, job->settings);
+    if(!error)
+    {
+      error = deflateBlocks(&job->deflated[band], data, datasize, &job->settings->zlibsettings,
+                            band == job->numbands - 1);
+    }
+    if(!error) job->adler[band] = adler32(data, (unsigned)datasize);
+    job->errors[band] = error;
+  }
+  return 0;
+}
+
+/*the number of bands encodeBands would split the image data in, 0 if it can't be used*/
+static unsigned getNumBands(unsigned w, unsigned h, const LodePNGInfo* info_png,
+                            const LodePNGEncoderSettings* settings)
+{
+  size_t linebytes = (w * lodepng_get_bpp(&info_png->color) + 7) / 8;
+  size_t rows = LODEPNG_BAND_SIZE / (linebytes + 1) + 1;
+  if(settings->num_threads == 1 || info_png->interlace_method != 0) return 0;
+  if(settings->zlibsettings.custom_zlib || settings->zlibsettings.custom_deflate) return 0;
+  return (unsigned)((h + rows - 1) / rows);
+}
+
+/*
+Multithreaded replacement for preProcessScanlines and zlib_compress, for non-interlaced images:
+the image is split into horizontal bands of about LODEPNG_BAND_SIZE bytes of filtered data, and
+every band is filtered and deflated on its own by a pool of threads. The deflate data of all bands
+but the last ends with a sync flush, so the bands can be concatenated into one zlib stream, and the
+Adler32 of the whole is combined from those of the bands. in must be padded (see addPaddingBits).
+*/
+static unsigned encodeBands(ucvector* out, const unsigned char* in, unsigned w, unsigned h, unsigned numbands,
+                            const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings)
+{
+  size_t linebytes = (w * lodepng_get_bpp(&info_png->color) + 7) / 8;
+  size_t rows = LODEPNG_BAND_SIZE / (linebytes + 1) + 1;
+  LodePNGBandJob job;
+  pthread_t threads[LODEPNG_MAX_THREADS];
+  unsigned i, numthreads, started = 0;
+  unsigned error = 0;
+  unsigned ADLER32 = 1;
+
+  job.in = in;
+  job.filtered = (unsigned char*)lodepng_malloc(h * (linebytes + 1));
+  job.w = w;
+  job.h = h;
+  job.rows = (unsigned)rows;
+  job.numbands = numbands;
+  job.next = 0;
+  job.color = &info_png->color;
+  job.settings = settings;
+  job.deflated = (ucvector*)lodepng_malloc(numbands * sizeof(ucvector));
+  job.adler = (unsigned*)lodepng_malloc(numbands * sizeof(unsigned));
+  job.errors = (unsigned*)lodepng_malloc(numbands * sizeof(unsigned));
+  if(!job.filtered || !job.deflated || !job.adler || !job.errors)
+  {
+    lodepng_free(job.filtered);
+    lodepng_free(job.deflated);
+    lodepng_free(job.adler);
+    lodepng_free(job.errors);
+    return 83; /*alloc fail*/
+  }
+  for(i = 0; i != numbands; ++i) ucvector_init(&job.deflated[i]);
+
+  numthreads = settings->num_threads ? settings->num_threads : (unsigned)sysconf(_SC_NPROCESSORS_ONLN);
+  if(numthreads > numbands) numthreads = numbands;
+  if(numthreads > LODEPNG_MAX_THREADS) numthreads = LODEPNG_MAX_THREADS;
+  for(i = 1; i < numthreads; ++i)
+  {
+    if(!pthread_create(&threads[started], 0, encodeBandWorker, &job)) ++started;
+  }
+  encodeBandWorker(&job);
+  for(i = 0; i != started; ++i) pthread_join(threads[i], 0);
+
+  /*the same zlib header as lodepng_zlib_compress writes*/
+  ucvector_push_back(out, 120);
+  ucvector_push_back(out, 1);
+  for(i = 0; i != numbands && !error; ++i)
+  {
+    size_t bandsize = (i == numbands - 1 ? h - i * rows : rows) * (linebytes + 1);
+    error = job.errors[i];
+    if(error) break;
+    if(!ucvector_resize(out, out->size + job.deflated[i].size)) ERROR_BREAK(83); /*alloc fail*/
+    memcpy(out->data + out->size - job.deflated[i].size, job.deflated[i].data, job.deflated[i].size);
+    ADLER32 = adler32_combine(ADLER32, job.adler[i], bandsize);
+  }
+  if(!error) lodepng_add32bitInt(out, ADLER32);
+
+  for(i = 0; i != numbands; ++i) ucvector_cleanup(&job.deflated[i]);
+  lodepng_free(job.filtered);
+  lodepng_free(job.deflated);
+  lodepng_free(job.adler);
+  lodepng_free(job.errors);
+  return error;
+}
+#endif /*defined(LODEPNG_COMPILE_ZLIB) && defined(LODEPNG_COMPILE_THREADS)*/
+
+/*
+Either filters the image data into out, to be compressed by addChunk_IDAT, or filters and
+compresses it at once into zlibdata with encodeBands.
+*/
+static unsigned preProcessImage(unsigned char** out, size_t* outsize, ucvector* zlibdata,
+                                const unsigned char* in, unsigned w, unsigned h,
+                                const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings)
+{
+#if defined(LODEPNG_COMPILE_ZLIB) && defined(LODEPNG_COMPILE_THREADS)
+  unsigned numbands = getNumBands(w, h, info_png, settings);
+  if(numbands > 1)
+  {
+    unsigned bpp = lodepng_get_bpp(&info_png->color);
+    unsigned error;
+    if(bpp < 8 && w * bpp != ((w * bpp + 7) / 8) * 8)
+    {
+      unsigned char* padded = (unsigned char*)lodepng_malloc(h * ((w * bpp + 7) / 8));
+      if(!padded) return 83; /*alloc fail*/
+      addPaddingBits(padded, in, ((w * bpp + 7) / 8) * 8, w * bpp, h);
+      error = encodeBands(zlibdata, padded, w, h, numbands, info_png, settings);
+      lodepng_free(padded);
+    }
+    else error = encodeBands(zlibdata, in, w, h, numbands, info_png, settings);
+    return error;
+  }
+#else /*defined(LODEPNG_COMPILE_ZLIB) && defined(LODEPNG_COMPILE_THREADS)*/
+  (void)zlibdata;
+#endif /*defined(LODEPNG_COMPILE_ZLIB) && defined(LODEPNG_COMPILE_THREADS)*/
+  return preProcessScanlines(out, outsize, in, w, h, info_png, settings);
+}
+
 /*
 palette must have 4 * palettesize bytes allocated, and given in format RGBARGBARGBARGBA...
 returns 0 if the palette is opaque,
@@ -5651,11 +7128,13 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   ucvector outv;
   unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
   size_t datasize = 0;
+  ucvector zlibdata; /*the compressed IDAT chunk data instead, if encodeBands made it*/
 
   /*provide some proper output values if error will happen*/
   *out = 0;
   *outsize = 0;
   state->error = 0;
+  ucvector_init(&zlibdata);
 
   lodepng_info_init(&info);
   lodepng_info_copy(&info, &state->info_png);
@@ -5698,10 +7177,13 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     {
       state->error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h);
     }
-    if(!state->error) preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
+    if(!state->error)
+    {
+      state->error = preProcessImage(&data, &datasize, &zlibdata, converted, w, h, &info, &state->encoder);
+    }
     lodepng_free(converted);
   }
-  else preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
+  else state->error = preProcessImage(&data, &datasize, &zlibdata, image, w, h, &info, &state->encoder);
 
   ucvector_init(&outv);
   while(!state->error) /*while only executed once, to break on error*/
@@ -5753,7 +7235,8 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+    if(zlibdata.size) state->error = addChunk(&outv, "IDAT", zlibdata.data, zlibdata.size);
+    else state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
     if(state->error) break;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*tIME*/
@@ -5829,6 +7312,7 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
 
   lodepng_info_cleanup(&info);
   lodepng_free(data);
+  ucvector_cleanup(&zlibdata);
   /*instead of cleaning the vector up, give it to the output*/
   *out = outv.data;
   *outsize = outv.size;
@@ -5893,12 +7377,23 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
   settings->auto_convert = 1;
   settings->force_palette = 0;
   settings->predefined_filters = 0;
+  settings->num_threads = 1;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->add_id = 0;
   settings->text_compression = 1;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 }
 
+void lodepng_encoder_settings_fast(LodePNGEncoderSettings* settings)
+{
+  /*the window is left at its default: with a single probe it only limits how far back a match may
+  be, not how long the search takes*/
+  settings->zlibsettings.maxchainlength = 1;
+  settings->zlibsettings.lazymatching = 0;
+  settings->zlibsettings.rle = 1;
+  settings->filter_strategy = LFS_FAST;
+}
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_PNG*/
 
@@ -6005,6 +7500,7 @@ const char* lodepng_error_text(unsigned code)
     case 93: return "zero width or height is invalid";
     case 94: return "header chunk must have a size of 13 bytes";
 	case 95: return "image dimensions exceed specified limits";
+    case 96: return "output stride is smaller than a row of the image";
   }
   return "unknown error code";
 }
@@ -6020,6 +7516,22 @@ const char* lodepng_error_text(unsigned code)
 namespace lodepng
 {
 
+/*hands a buffer from lodepng_malloc over to out. ByteVector releases what it owns with free(), so arena
+memory, or memory from custom allocators, is copied instead*/
+static void setOutput(FCInterface::ByteVector& out, unsigned char* buffer, size_t buffersize)
+{
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+  if(!lodepng_current_arena)
+  {
+    out.setArray(buffer, (unsigned)buffersize);
+    return;
+  }
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+  out.resize((unsigned)buffersize);
+  if(buffersize) memcpy(out.buffer(), buffer, buffersize);
+  lodepng_free(buffer);
+}
+
 #ifdef LODEPNG_COMPILE_DISK
 unsigned load_file(FCInterface::ByteVector& buffer, const std::string& filename)
 {
@@ -6045,7 +7557,7 @@ unsigned load_file(FCInterface::ByteVector& buffer, const std::string& filename)
 }
 
 /*write given buffer to the file, overwriting the file, it doesn't append to it.*/
-unsigned save_file(const FCInterface::ByteVector& buffer, const std::string& filename)
+unsigned save_file(FCInterface::ByteView buffer, const std::string& filename)
 {
   return lodepng_save_file(buffer.empty() ? 0 : &buffer[0], buffer.size(), filename.c_str());
 }
@@ -6058,17 +7570,17 @@ unsigned decompress(FCInterface::ByteVector& out, const unsigned char* in, size_
 {
   unsigned char* buffer = 0;
   size_t buffersize = 0;
-  unsigned error = zlib_decompress(&buffer, &buffersize, in, insize, &settings);
+  unsigned error = zlib_decompress(&buffer, &buffersize, 0, in, insize, &settings);
   if(buffer)
   {
   //  out.insert(out.end(), &buffer[0], &buffer[buffersize]);
-	out.setArray(buffer, buffersize);
+	setOutput(out, buffer, buffersize);
    // lodepng_free(buffer);
   }
   return error;
 }
 
-unsigned decompress(FCInterface::ByteVector& out, const FCInterface::ByteVector& in,
+unsigned decompress(FCInterface::ByteVector& out, FCInterface::ByteView in,
                     const LodePNGDecompressSettings& settings)
 {
   return decompress(out, in.empty() ? 0 : &in[0], in.size(), settings);
@@ -6085,13 +7597,13 @@ unsigned compress(FCInterface::ByteVector& out, const unsigned char* in, size_t
   if(buffer)
   {
   //  out.insert(out.end(), &buffer[0], &buffer[buffersize]);
-	out.setArray(buffer, buffersize);
+	setOutput(out, buffer, buffersize);
   //  lodepng_free(buffer);
   }
   return error;
 }
 
-unsigned compress(FCInterface::ByteVector& out, const FCInterface::ByteVector& in,
+unsigned compress(FCInterface::ByteVector& out, FCInterface::ByteView in,
                   const LodePNGCompressSettings& settings)
 {
   return compress(out, in.empty() ? 0 : &in[0], in.size(), settings);
@@ -6124,6 +7636,17 @@ State& State::operator=(const State& other)
   return *this;
 }
 
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+ArenaScope::ArenaScope(LodePNGArena* arena) : previous(lodepng_arena_use(arena))
+{
+}
+
+ArenaScope::~ArenaScope()
+{
+  lodepng_arena_use(previous);
+}
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+
 #ifdef LODEPNG_COMPILE_DECODER
 
 unsigned decode(FCInterface::ByteVector& out, unsigned& w, unsigned& h, const unsigned char* in,
@@ -6137,7 +7660,7 @@ unsigned decode(FCInterface::ByteVector& out, unsigned& w, unsigned& h, const un
     state.info_raw.colortype = colortype;
     state.info_raw.bitdepth = bitdepth;
     size_t buffersize = lodepng_get_raw_size(w, h, &state.info_raw);
-	out.setArray(buffer, buffersize);
+	setOutput(out, buffer, buffersize);
   //  out.insert(out.end(), &buffer[0], &buffer[buffersize]);
  //   lodepng_free(buffer);
   }
@@ -6145,7 +7668,7 @@ unsigned decode(FCInterface::ByteVector& out, unsigned& w, unsigned& h, const un
 }
 
 unsigned decode(FCInterface::ByteVector& out, unsigned& w, unsigned& h,
-                const FCInterface::ByteVector& in, LodePNGColorType colortype, unsigned bitdepth)
+                FCInterface::ByteView in, LodePNGColorType colortype, unsigned bitdepth)
 {
   return decode(out, w, h, in.empty() ? 0 : &in[0], (unsigned)in.size(), colortype, bitdepth);
 }
@@ -6160,7 +7683,7 @@ unsigned decode(FCInterface::ByteVector& out, unsigned& w, unsigned& h,
   {
     size_t buffersize = lodepng_get_raw_size(w, h, &state.info_raw);
  //   out.insert(out.end(), &buffer[0], &buffer[buffersize]);
-	out.setArray(buffer, buffersize);
+	setOutput(out, buffer, buffersize);
   }
   else {
 	  lodepng_free(buffer);
@@ -6170,7 +7693,7 @@ unsigned decode(FCInterface::ByteVector& out, unsigned& w, unsigned& h,
 
 unsigned decode(FCInterface::ByteVector& out, unsigned& w, unsigned& h,
                 State& state,
-				const FCInterface::ByteVector& in)
+				FCInterface::ByteView in)
 {
   return decode(out, w, h, state, in.empty() ? 0 : in.buffer(), in.size());
 }
@@ -6196,7 +7719,7 @@ unsigned encode(FCInterface::ByteVector& out, const unsigned char* in, unsigned
   unsigned error = lodepng_encode_memory(&buffer, &buffersize, in, w, h, colortype, bitdepth);
   if(buffer)
   {
-	  out.setArray(buffer, buffersize);
+	  setOutput(out, buffer, buffersize);
   //  out.insert(out.end(), &buffer[0], &buffer[buffersize]);
  //   lodepng_free(buffer);
   }
@@ -6204,7 +7727,7 @@ unsigned encode(FCInterface::ByteVector& out, const unsigned char* in, unsigned
 }
 
 unsigned encode(FCInterface::ByteVector& out,
-                const FCInterface::ByteVector& in, unsigned w, unsigned h,
+                FCInterface::ByteView in, unsigned w, unsigned h,
                 LodePNGColorType colortype, unsigned bitdepth)
 {
   if(lodepng_get_raw_size_lct(w, h, colortype, bitdepth) > in.size()) return 84;
@@ -6220,7 +7743,7 @@ unsigned encode(FCInterface::ByteVector& out,
   unsigned error = lodepng_encode(&buffer, &buffersize, in, w, h, &state);
   if(buffer)
   {
-	  out.setArray(buffer, buffersize);
+	  setOutput(out, buffer, buffersize);
   //  out.insert(out.end(), &buffer[0], &buffer[buffersize]);
  //   lodepng_free(buffer);
   }
@@ -6228,7 +7751,7 @@ unsigned encode(FCInterface::ByteVector& out,
 }
 
 unsigned encode(FCInterface::ByteVector& out,
-                const FCInterface::ByteVector& in, unsigned w, unsigned h,
+                FCInterface::ByteView in, unsigned w, unsigned h,
                 State& state)
 {
   if(lodepng_get_raw_size(w, h, &state.info_raw) > in.size()) return 84;
@@ -6247,7 +7770,7 @@ unsigned encode(const std::string& filename,
 }
 
 unsigned encode(const std::string& filename,
-                const FCInterface::ByteVector& in, unsigned w, unsigned h,
+                FCInterface::ByteView in, unsigned w, unsigned h,
                 LodePNGColorType colortype, unsigned bitdepth)
 {
   if(lodepng_get_raw_size_lct(w, h, colortype, bitdepth) > in.size()) return 84;
@@ -78,6 +78,10 @@ source files with custom allocators.*/
 #ifndef LODEPNG_NO_COMPILE_ALLOCATORS
 #define LODEPNG_COMPILE_ALLOCATORS
 #endif
+/*multithreaded encoding of the image data with pthreads, see num_threads in LodePNGEncoderSettings*/
+#ifndef LODEPNG_NO_COMPILE_THREADS
+#define LODEPNG_COMPILE_THREADS
+#endif
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
 #ifdef __cplusplus
 #ifndef LODEPNG_NO_COMPILE_CPP
@@ -87,6 +91,7 @@ source files with custom allocators.*/
 
 #ifdef LODEPNG_COMPILE_CPP
 #include "ByteVector.h"
+#include "ByteView.h"
 #include <string>
 #include <vector>
 #endif /*LODEPNG_COMPILE_CPP*/
@@ -210,7 +215,7 @@ unsigned decode(FCInterface::ByteVector& out, unsigned& w, unsigned& h,
                 const unsigned char* in, size_t insize,
                 LodePNGColorType colortype = LCT_RGBA, unsigned bitdepth = 8);
 unsigned decode(FCInterface::ByteVector& out, unsigned& w, unsigned& h,
-                const FCInterface::ByteVector& in,
+                FCInterface::ByteView in,
                 LodePNGColorType colortype = LCT_RGBA, unsigned bitdepth = 8);
 #ifdef LODEPNG_COMPILE_DISK
 /*
@@ -230,7 +235,7 @@ unsigned encode(FCInterface::ByteVector& out,
                 const unsigned char* in, unsigned w, unsigned h,
                 LodePNGColorType colortype = LCT_RGBA, unsigned bitdepth = 8);
 unsigned encode(FCInterface::ByteVector& out,
-                const FCInterface::ByteVector& in, unsigned w, unsigned h,
+                FCInterface::ByteView in, unsigned w, unsigned h,
                 LodePNGColorType colortype = LCT_RGBA, unsigned bitdepth = 8);
 #ifdef LODEPNG_COMPILE_DISK
 /*
@@ -242,7 +247,7 @@ unsigned encode(const std::string& filename,
                 const unsigned char* in, unsigned w, unsigned h,
                 LodePNGColorType colortype = LCT_RGBA, unsigned bitdepth = 8);
 unsigned encode(const std::string& filename,
-                const FCInterface::ByteVector& in, unsigned w, unsigned h,
+                FCInterface::ByteView in, unsigned w, unsigned h,
                 LodePNGColorType colortype = LCT_RGBA, unsigned bitdepth = 8);
 #endif /* LODEPNG_COMPILE_DISK */
 #endif /* LODEPNG_COMPILE_ENCODER */
@@ -255,6 +260,47 @@ unsigned encode(const std::string& filename,
 const char* lodepng_error_text(unsigned code);
 #endif /*LODEPNG_COMPILE_ERROR_TEXT*/
 
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+/*
+Arena for the memory lodepng allocates. While an arena is in use by a thread, all allocations of lodepng
+on that thread are bumped from its blocks, and freeing them only gives memory back if it was the last
+allocation. lodepng_arena_reset releases all of it in one go and keeps the memory for the next image, so
+after the first image of a size, decoding another one takes no heap calls at all.
+
+Everything lodepng gives out while an arena is in use is arena memory too: decoded images, encoded PNGs and
+the contents of a LodePNGState filled in while decoding. Such memory must not be passed to free(), is
+only freed by lodepng while the same arena is in use, and is valid until the arena is reset, so clean up
+such a state before that. lodepng_decode_rows writes into a
+buffer of your own, which makes it a good fit.
+
+An arena must only be used by one thread at a time. The worker threads of the encoder use the heap.
+*/
+typedef struct LodePNGArenaBlock LodePNGArenaBlock;
+typedef struct LodePNGArena
+{
+  LodePNGArenaBlock* blocks; /*the block allocations are made from, followed by the full ones*/
+  size_t blocksize; /*minimum size of a new block*/
+
+  /*counters since the last lodepng_arena_reset*/
+  size_t used; /*bytes currently allocated, with their headers and padding*/
+  size_t peak; /*highest value of used*/
+  size_t num_allocs; /*lodepng_malloc calls, and lodepng_realloc calls without a pointer*/
+  size_t num_reallocs; /*lodepng_realloc calls, moving or resizing in place*/
+  size_t num_frees; /*lodepng_free calls*/
+  size_t num_heap_calls; /*blocks the arena had to get from malloc*/
+} LodePNGArena;
+
+/*blocksize: the size of the first block, more are added as needed. 0 allocates nothing until used*/
+void lodepng_arena_init(LodePNGArena* arena, size_t blocksize);
+/*frees all memory of the arena*/
+void lodepng_arena_cleanup(LodePNGArena* arena);
+/*releases all allocations and zeroes the counters. The memory is kept, in one block*/
+void lodepng_arena_reset(LodePNGArena* arena);
+/*makes lodepng allocate from arena on the calling thread, or from the heap if it is NULL. Returns the
+previous arena of the thread*/
+LodePNGArena* lodepng_arena_use(LodePNGArena* arena);
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*Settings for zlib decompression*/
 typedef struct LodePNGDecompressSettings LodePNGDecompressSettings;
@@ -295,6 +341,12 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*how many earlier positions with the same hash are tried per match. 0 derives it from windowsize
+  (windowsize / 8, all of them from 8192 on), 1 is fastest. Default: 0*/
+  unsigned maxchainlength;
+  /*take runs of a repeated byte as distance 1 matches right away, without searching the hash chains
+  for them: fast on flat image areas. Default: false*/
+  unsigned rle;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -557,7 +609,10 @@ typedef enum LodePNGFilterStrategy
   */
   LFS_BRUTE_FORCE,
   /*use predefined_filters buffer: you specify the filter type for each scanline*/
-  LFS_PREDEFINED
+  LFS_PREDEFINED,
+  /*like LFS_MINSUM, but the sums are estimated from a sample of each scanline and only the
+  chosen filter is applied to it. Much cheaper, and usually picks the same filter.*/
+  LFS_FAST
 } LodePNGFilterStrategy;
 
 /*Gives characteristics about the colors of the image, which helps decide which color model to use for encoding.
@@ -611,6 +666,13 @@ typedef struct LodePNGEncoderSettings
   /*force creating a PLTE chunk if colortype is 2 or 6 (= a suggested palette).
   If colortype is 3, PLTE is _always_ created.*/
   unsigned force_palette;
+
+  /*Number of threads that filter and compress the image data. If not 1, non-interlaced images are
+  split into horizontal bands that are filtered and deflated independently (the zlib stream stays
+  valid, at a slightly lower compression ratio). The bands only depend on the image size, so the
+  result is the same for any value other than 1. 0 uses one thread per CPU. Ignored when a
+  custom_zlib or custom_deflate function is set. Default: 1*/
+  unsigned num_threads;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   /*add LodePNG identifier and version as a text chunk, for debugging*/
   unsigned add_id;
@@ -620,6 +682,10 @@ typedef struct LodePNGEncoderSettings
 } LodePNGEncoderSettings;
 
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings);
+/*changes the compression and filter settings to ones that trade some size for encoding speed:
+a single hash probe without lazy matching, run detection and the LFS_FAST filter heuristic.
+Other settings, such as num_threads, are left as they are.*/
+void lodepng_encoder_settings_fast(LodePNGEncoderSettings* settings);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 
@@ -664,6 +730,18 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
                         LodePNGState* state,
                         const unsigned char* in, size_t insize);
 
+/*
+Same as lodepng_decode, but decodes into a buffer you provide, with stride bytes from the start of one row
+to the next, and without holding all of the decompressed image data in memory: it is inflated and
+unfiltered a part at a time. Use lodepng_inspect first to get the size of the image. Each row is in the
+first (w * bpp + 7) / 8 bytes of its stride, with bpp that of info_raw (after decoding, so that of
+info_png.color if color_convert is false). Interlaced images, or ones decoded with custom_zlib or
+custom_inflate, are decoded whole and then copied to out. On an error, the rows before it may have been
+written already.
+*/
+unsigned lodepng_decode_rows(unsigned char* out, size_t stride, unsigned* w, unsigned* h,
+                             LodePNGState* state, const unsigned char* in, size_t insize);
+
 /*
 Read the PNG header, but not the actual data. This returns only the information
 that is in the header chunk of the PNG, such as width, height and color type. The
@@ -839,6 +917,21 @@ class State : public LodePNGState
     State& operator=(const State& other);
 };
 
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+/*uses arena on the calling thread for as long as it exists, see lodepng_arena_use. Declare it before a
+State that is filled in with arena memory, so that the State is cleaned up first*/
+class ArenaScope
+{
+  public:
+    explicit ArenaScope(LodePNGArena* arena);
+    ~ArenaScope();
+  private:
+    LodePNGArena* previous;
+    ArenaScope(const ArenaScope&);
+    ArenaScope& operator=(const ArenaScope&);
+};
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+
 #ifdef LODEPNG_COMPILE_DECODER
 /* Same as other lodepng::decode, but using a State for more settings and information. */
 unsigned decode(FCInterface::ByteVector& out, unsigned& w, unsigned& h,
@@ -846,7 +939,7 @@ unsigned decode(FCInterface::ByteVector& out, unsigned& w, unsigned& h,
                 const unsigned char* in, size_t insize);
 unsigned decode(FCInterface::ByteVector& out, unsigned& w, unsigned& h,
                 State& state,
-				const FCInterface::ByteVector& in);
+				FCInterface::ByteView in);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -855,7 +948,7 @@ unsigned encode(FCInterface::ByteVector& out,
                 const unsigned char* in, unsigned w, unsigned h,
                 State& state);
 unsigned encode(FCInterface::ByteVector& out,
-                const FCInterface::ByteVector& in, unsigned w, unsigned h,
+                FCInterface::ByteView in, unsigned w, unsigned h,
                 State& state);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
@@ -870,7 +963,7 @@ unsigned load_file(FCInterface::ByteVector& buffer, const std::string& filename)
 Save the binary data in an std::vector to a file on disk. The file is overwritten
 without warning.
 */
-unsigned save_file(const FCInterface::ByteVector& buffer, const std::string& filename);
+unsigned save_file(FCInterface::ByteView buffer, const std::string& filename);
 #endif /* LODEPNG_COMPILE_DISK */
 #endif /* LODEPNG_COMPILE_PNG */
 
@@ -881,7 +974,7 @@ unsigned decompress(FCInterface::ByteVector& out, const unsigned char* in, size_
                     const LodePNGDecompressSettings& settings = lodepng_default_decompress_settings);
 
 /* Zlib-decompress an std::vector */
-unsigned decompress(FCInterface::ByteVector& out, const FCInterface::ByteVector& in,
+unsigned decompress(FCInterface::ByteVector& out, FCInterface::ByteView in,
                     const LodePNGDecompressSettings& settings = lodepng_default_decompress_settings);
 #endif /* LODEPNG_COMPILE_DECODER */
 
@@ -891,7 +984,7 @@ unsigned compress(FCInterface::ByteVector& out, const unsigned char* in, size_t
                   const LodePNGCompressSettings& settings = lodepng_default_compress_settings);
 
 /* Zlib-compress an std::vector */
-unsigned compress(FCInterface::ByteVector& out, const FCInterface::ByteVector& in,
+unsigned compress(FCInterface::ByteVector& out, FCInterface::ByteView in,
                   const LodePNGCompressSettings& settings = lodepng_default_compress_settings);
 #endif /* LODEPNG_COMPILE_ENCODER */
 #endif /* LODEPNG_COMPILE_ZLIB */
@@ -1596,11 +1689,15 @@ state.encoder.zlibsettings.windowsize: tweak LZ77 windowsize
 state.encoder.zlibsettings.minmatch: tweak min LZ77 length to match
 state.encoder.zlibsettings.nicematch: tweak LZ77 match where to stop searching
 state.encoder.zlibsettings.lazymatching: try one more LZ77 matching
+state.encoder.zlibsettings.maxchainlength: limit the LZ77 hash chain search (1: single probe)
+state.encoder.zlibsettings.rle: take runs of a repeated byte as matches without searching
 state.encoder.zlibsettings.custom_...: use custom deflate function
 state.encoder.auto_convert: choose optimal PNG color type, if 0 uses info_png
 state.encoder.filter_palette_zero: PNG filter strategy for palette
 state.encoder.filter_strategy: PNG filter strategy to encode with
 state.encoder.force_palette: add palette even if not encoding to one
+state.encoder.num_threads: filter and compress in bands on this many threads (0: one per CPU)
+lodepng_encoder_settings_fast: set the above to values that encode fast, at some cost in size
 state.encoder.add_id: add LodePNG identifier and version as a text chunk
 state.encoder.text_compression: use compressed text chunks for metadata
 state.info_raw.colortype: color type of raw input image you provide
@@ -0,0 +1,532 @@
+/*
+ * Motion-JPEG video source for the video cube, decoded with uJPEG, for
+ * systems without GStreamer or a hardware decoder.
+ *
+ * Plays concatenated JPEG frames (.mjpeg, the output of most webcams) and
+ * AVI files with MJPEG video. The file is mapped, a worker thread decodes
+ * a few frames ahead into NV12, and video_frame() copies the next frame
+ * into a pair of GBM buffer objects imported as an NV12 EGLImage, the same
+ * way cube-tex imports its textures.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include "common.h"
+}
+
+#include "ByteVector.h"
+#include "ujpeg.h"
+
+/* frames decoded ahead of the one on screen */
+#define NUM_QUEUED 3
+/* frames are uploaded alternately into these, so a buffer object is never
+ * written while the previous draw may still sample it */
+#define NUM_TEXTURES 2
+/* raw MJPEG streams carry no timing */
+#define DEFAULT_FPS 30
+
+struct frame {
+	FCInterface::ByteVector yuv;	/* NV12, planes back to back */
+	int width, height;
+};
+
+struct texture {
+	struct gbm_bo *bo_y, *bo_uv;
+	EGLImage image;
+	int width, height;
+};
+
+struct decoder {
+	const struct gbm   *gbm;
+	const struct egl   *egl;
+
+	/* the mapped file: */
+	const uint8_t      *data;
+	size_t              size;
+	size_t              pos;		/* next frame (raw) or chunk (AVI) */
+	size_t              end;		/* end of the frame data */
+	bool                avi;
+	int64_t             frame_ns;
+
+	/* decode-ahead worker and the ring of frames it fills: */
+	uJPEG               jpeg;
+	pthread_t           thread;
+	pthread_mutex_t     lock;
+	pthread_cond_t      cond;
+	struct frame        queue[NUM_QUEUED];
+	unsigned            head, count;
+	bool                eos, quit;
+
+	struct texture      tex[NUM_TEXTURES];
+	unsigned            cur_tex;
+	unsigned            frame;
+	int64_t             start_ns;
+	EGLImage            last_frame;
+};
+
+static inline uint32_t
+get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Find the end of the JPEG frame starting at start (just past its EOI
+ * marker). Segments are skipped by their length and entropy-coded data is
+ * scanned for the next marker, so EOI markers inside an EXIF thumbnail or
+ * a fill byte pattern don't end the frame early. Returns 0 if the frame is
+ * truncated. */
+static size_t
+jpeg_frame_end(const uint8_t *data, size_t start, size_t end)
+{
+	size_t p = start + 2;
+
+	while (p + 2 <= end) {
+		if (data[p] != 0xFF)
+			return 0;
+		uint8_t marker = data[p + 1];
+		if (marker == 0xFF) {
+			p++;
+			continue;
+		}
+		if (marker == 0xD9)
+			return p + 2;
+		if ((marker >= 0xD0 && marker <= 0xD7) || marker == 0x01) {
+			p += 2;
+			continue;
+		}
+		if (p + 4 > end)
+			return 0;
+
+		p += 2 + ((data[p + 2] << 8) | data[p + 3]);
+
+		if (marker == 0xDA) {
+			/* entropy-coded data up to the next marker other than RSTn */
+			while (p + 1 < end) {
+				if (data[p] == 0xFF && data[p + 1] != 0x00 &&
+				    !(data[p + 1] >= 0xD0 && data[p + 1] <= 0xD7) && data[p + 1] != 0xFF)
+					break;
+				p++;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* next frame of a raw stream: anything between frames is ignored */
+static bool
+next_frame_raw(struct decoder *dec, const uint8_t **jpeg, size_t *len)
+{
+	while (dec->pos + 1 < dec->end) {
+		const uint8_t *soi = (const uint8_t *)memchr(&dec->data[dec->pos], 0xFF, dec->end - dec->pos - 1);
+		if (!soi)
+			break;
+		size_t start = soi - dec->data;
+		if (soi[1] != 0xD8) {
+			dec->pos = start + 1;
+			continue;
+		}
+
+		size_t frame_end = jpeg_frame_end(dec->data, start, dec->end);
+		if (!frame_end)
+			break;
+		*jpeg = &dec->data[start];
+		*len = frame_end - start;
+		dec->pos = frame_end;
+		return true;
+	}
+
+	dec->pos = dec->end;
+	return false;
+}
+
+/* next video chunk ("##dc" or "##db") of an AVI 'movi' list */
+static bool
+next_frame_avi(struct decoder *dec, const uint8_t **jpeg, size_t *len)
+{
+	while (dec->pos + 8 <= dec->end) {
+		const uint8_t *chunk = &dec->data[dec->pos];
+		uint32_t size = get_le32(chunk + 4);
+
+		if (!memcmp(chunk, "LIST", 4)) {
+			/* 'rec ' lists group the chunks of one frame; walk into them */
+			dec->pos += 12;
+			continue;
+		}
+
+		dec->pos += 8;
+		if (size > dec->end - dec->pos) {
+			dec->pos = dec->end;
+			break;
+		}
+		dec->pos += size + (size & 1);
+
+		/* empty chunks are dropped frames; the previous one stays up */
+		if ((!memcmp(chunk + 2, "dc", 2) || !memcmp(chunk + 2, "db", 2)) &&
+		    size >= 4 && chunk[8] == 0xFF && chunk[9] == 0xD8) {
+			*jpeg = chunk + 8;
+			*len = size;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* locate the 'movi' list and the frame rate of an AVI file */
+static bool
+parse_avi(struct decoder *dec)
+{
+	size_t p = 12, end = dec->size;
+	uint32_t usec_per_frame = 0;
+
+	while (p + 12 <= end) {
+		const uint8_t *chunk = &dec->data[p];
+		uint32_t size = get_le32(chunk + 4);
+		if (size > end - p - 8)
+			size = end - p - 8;
+
+		if (!memcmp(chunk, "LIST", 4) && !memcmp(chunk + 8, "hdrl", 4)) {
+			/* 'avih' is the first chunk of the header list */
+			if (size >= 4 + 8 + 4 && !memcmp(chunk + 12, "avih", 4))
+				usec_per_frame = get_le32(chunk + 20);
+		} else if (!memcmp(chunk, "LIST", 4) && !memcmp(chunk + 8, "movi", 4)) {
+			dec->pos = p + 12;
+			dec->end = p + 8 + size;
+			if (usec_per_frame)
+				dec->frame_ns = usec_per_frame * INT64_C(1000);
+			return true;
+		}
+
+		p += 8 + size + (size & 1);
+	}
+
+	return false;
+}
+
+static void *
+decode_thread_func(void *args)
+{
+	struct decoder *dec = (struct decoder *)args;
+	const uint8_t *jpeg;
+	size_t len;
+
+	for (;;) {
+		pthread_mutex_lock(&dec->lock);
+		while (dec->count == NUM_QUEUED && !dec->quit)
+			pthread_cond_wait(&dec->cond, &dec->lock);
+		if (dec->quit) {
+			pthread_mutex_unlock(&dec->lock);
+			break;
+		}
+		/* the slot past the queued frames belongs to this thread until
+		 * it is queued */
+		struct frame *f = &dec->queue[(dec->head + dec->count) % NUM_QUEUED];
+		pthread_mutex_unlock(&dec->lock);
+
+		bool more = dec->avi ? next_frame_avi(dec, &jpeg, &len) : next_frame_raw(dec, &jpeg, &len);
+		if (!more) {
+			pthread_mutex_lock(&dec->lock);
+			dec->eos = true;
+			pthread_cond_broadcast(&dec->cond);
+			pthread_mutex_unlock(&dec->lock);
+			break;
+		}
+
+		/* skip frames that don't decode rather than ending the stream */
+		if (!dec->jpeg.decode(jpeg, (int)len) || !dec->jpeg.getImageYUV(f->yuv, UJ_YUV_FORMAT_NV12)) {
+			printf("MJPEG: skipping bad frame (error %d)\n", dec->jpeg.getError());
+			continue;
+		}
+		f->width = dec->jpeg.getWidth();
+		f->height = dec->jpeg.getHeight();
+
+		pthread_mutex_lock(&dec->lock);
+		dec->count++;
+		pthread_cond_broadcast(&dec->cond);
+		pthread_mutex_unlock(&dec->lock);
+	}
+
+	return NULL;
+}
+
+static void
+destroy_texture(struct decoder *dec, struct texture *t)
+{
+	if (t->image)
+		dec->egl->eglDestroyImageKHR(dec->egl->display, t->image);
+	if (t->bo_y)
+		gbm_bo_destroy(t->bo_y);
+	if (t->bo_uv)
+		gbm_bo_destroy(t->bo_uv);
+	memset(t, 0, sizeof(*t));
+}
+
+extern "C" WEAK uint64_t
+gbm_bo_get_modifier(struct gbm_bo *bo);
+
+/* allocate the Y and CbCr buffer objects for a frame size and import them
+ * as one NV12 image, as init_tex_nv12_1img() does */
+static bool
+create_texture(struct decoder *dec, struct texture *t, int width, int height)
+{
+	int cwidth = (width + 1) / 2, cheight = (height + 1) / 2;
+	int fd_y, fd_uv;
+	uint64_t modifier_y = DRM_FORMAT_MOD_LINEAR, modifier_uv = DRM_FORMAT_MOD_LINEAR;
+
+	/* NOTE: do not actually use GBM_BO_USE_WRITE since that gets us a dumb buffer: */
+	t->bo_y = gbm_bo_create(dec->gbm->dev, width, height, GBM_FORMAT_R8, GBM_BO_USE_LINEAR);
+	t->bo_uv = gbm_bo_create(dec->gbm->dev, cwidth, cheight, GBM_FORMAT_GR88, GBM_BO_USE_LINEAR);
+	if (!t->bo_y || !t->bo_uv) {
+		printf("MJPEG: failed to allocate %dx%d buffer objects\n", width, height);
+		destroy_texture(dec, t);
+		return false;
+	}
+
+	if (gbm_bo_get_modifier) {
+		modifier_y = gbm_bo_get_modifier(t->bo_y);
+		modifier_uv = gbm_bo_get_modifier(t->bo_uv);
+	}
+
+	fd_y = gbm_bo_get_fd(t->bo_y);
+	fd_uv = gbm_bo_get_fd(t->bo_uv);
+
+	/* NV12 needs even dimensions; an odd last line or column is dropped */
+	EGLint attr[] = {
+		EGL_WIDTH, width & ~1,
+		EGL_HEIGHT, height & ~1,
+		EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_NV12,
+		EGL_DMA_BUF_PLANE0_FD_EXT, fd_y,
+		EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
+		EGL_DMA_BUF_PLANE0_PITCH_EXT, (EGLint)gbm_bo_get_stride(t->bo_y),
+		EGL_DMA_BUF_PLANE1_FD_EXT, fd_uv,
+		EGL_DMA_BUF_PLANE1_OFFSET_EXT, 0,
+		EGL_DMA_BUF_PLANE1_PITCH_EXT, (EGLint)gbm_bo_get_stride(t->bo_uv),
+		EGL_NONE, EGL_NONE,	/* modifier lo */
+		EGL_NONE, EGL_NONE,	/* modifier hi */
+		EGL_NONE, EGL_NONE,	/* modifier lo */
+		EGL_NONE, EGL_NONE,	/* modifier hi */
+		EGL_NONE
+	};
+
+	if (dec->egl->modifiers_supported &&
+	    modifier_y != DRM_FORMAT_MOD_INVALID &&
+	    modifier_uv != DRM_FORMAT_MOD_INVALID) {
+		unsigned size = ARRAY_SIZE(attr);
+		attr[size - 9] = EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT;
+		attr[size - 8] = modifier_y & 0xFFFFFFFF;
+		attr[size - 7] = EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT;
+		attr[size - 6] = modifier_y >> 32;
+		attr[size - 5] = EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT;
+		attr[size - 4] = modifier_uv & 0xFFFFFFFF;
+		attr[size - 3] = EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT;
+		attr[size - 2] = modifier_uv >> 32;
+	}
+
+	t->image = dec->egl->eglCreateImageKHR(dec->egl->display, EGL_NO_CONTEXT,
+			EGL_LINUX_DMA_BUF_EXT, NULL, attr);
+	close(fd_y);
+	close(fd_uv);
+
+	if (!t->image) {
+		printf("MJPEG: failed to import %dx%d NV12 image\n", width, height);
+		destroy_texture(dec, t);
+		return false;
+	}
+
+	t->width = width;
+	t->height = height;
+	return true;
+}
+
+static void
+copy_plane(struct gbm_bo *bo, const uint8_t *src, uint32_t width, uint32_t height, uint32_t bpp)
+{
+	void *map_data = NULL;
+	uint32_t stride;
+	uint8_t *map = (uint8_t *)gbm_bo_map(bo, 0, 0, width, height, GBM_BO_TRANSFER_WRITE, &stride, &map_data);
+
+	if (!map)
+		return;
+	if (stride == width * bpp) {
+		memcpy(map, src, width * height * bpp);
+	} else {
+		for (uint32_t i = 0; i < height; i++)
+			memcpy(&map[stride * i], &src[width * bpp * i], width * bpp);
+	}
+	gbm_bo_unmap(bo, map_data);
+}
+
+static EGLImage
+upload_frame(struct decoder *dec, const struct frame *f)
+{
+	struct texture *t;
+	int cwidth = (f->width + 1) / 2, cheight = (f->height + 1) / 2;
+
+	dec->cur_tex = (dec->cur_tex + 1) % NUM_TEXTURES;
+	t = &dec->tex[dec->cur_tex];
+	if (t->width != f->width || t->height != f->height) {
+		destroy_texture(dec, t);
+		if (!create_texture(dec, t, f->width, f->height))
+			return EGL_NO_IMAGE_KHR;
+	}
+
+	copy_plane(t->bo_y, f->yuv.buffer(), f->width, f->height, 1);
+	copy_plane(t->bo_uv, f->yuv.buffer() + f->width * f->height, cwidth, cheight, 2);
+
+	return t->image;
+}
+
+struct decoder *
+video_init(const struct egl *egl, const struct gbm *gbm, const char *filename)
+{
+	struct decoder *dec;
+	struct stat st;
+	void *map;
+	int fd;
+
+	/* egl_check() takes a void *, which C++ won't convert a function pointer to */
+	if (!egl->eglCreateImageKHR || !egl->eglDestroyImageKHR) {
+		printf("no eglCreateImageKHR/eglDestroyImageKHR\n");
+		return NULL;
+	}
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("MJPEG: cannot open %s\n", filename);
+		return NULL;
+	}
+	if (fstat(fd, &st) || st.st_size < 12) {
+		printf("MJPEG: %s is not a video file\n", filename);
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("MJPEG: cannot map %s\n", filename);
+		return NULL;
+	}
+
+	dec = new decoder();
+	dec->gbm = gbm;
+	dec->egl = egl;
+	dec->data = (const uint8_t *)map;
+	dec->size = st.st_size;
+	dec->end = dec->size;
+	dec->frame_ns = NSEC_PER_SEC / DEFAULT_FPS;
+
+	if (!memcmp(dec->data, "RIFF", 4) && !memcmp(dec->data + 8, "AVI ", 4)) {
+		dec->avi = true;
+		if (!parse_avi(dec)) {
+			printf("MJPEG: %s has no 'movi' list\n", filename);
+			munmap((void *)dec->data, dec->size);
+			delete dec;
+			return NULL;
+		}
+	}
+
+	/* frames usually share their tables, and AVI MJPEG frames may leave
+	 * the Huffman tables out altogether */
+	dec->jpeg.setStreamMode(true);
+
+	pthread_mutex_init(&dec->lock, NULL);
+	pthread_cond_init(&dec->cond, NULL);
+	pthread_create(&dec->thread, NULL, decode_thread_func, dec);
+
+	return dec;
+}
+
+EGLImage
+video_frame(struct decoder *dec)
+{
+	EGLImage frame;
+	int64_t now = get_time_ns();
+
+	pthread_mutex_lock(&dec->lock);
+	/* keep showing the current frame until the next one is due */
+	if (dec->last_frame && now < dec->start_ns + dec->frame * dec->frame_ns) {
+		pthread_mutex_unlock(&dec->lock);
+		return dec->last_frame;
+	}
+	while (dec->count == 0 && !dec->eos)
+		pthread_cond_wait(&dec->cond, &dec->lock);
+	if (dec->count == 0) {
+		pthread_mutex_unlock(&dec->lock);
+		return NULL;
+	}
+	struct frame *f = &dec->queue[dec->head];
+	pthread_mutex_unlock(&dec->lock);
+
+	frame = upload_frame(dec, f);
+
+	if (dec->frame == 0) {
+		dec->start_ns = now;
+		printf("===================================\n");
+		printf("MJPEG video stream information:\n");
+		printf("  size: %d x %d pixel\n", f->width, f->height);
+		printf("  container: %s  frame rate: %.2f\n", dec->avi ? "AVI" : "raw",
+				(double)NSEC_PER_SEC / dec->frame_ns);
+		printf("===================================\n");
+	}
+
+	pthread_mutex_lock(&dec->lock);
+	dec->head = (dec->head + 1) % NUM_QUEUED;
+	dec->count--;
+	pthread_cond_broadcast(&dec->cond);
+	pthread_mutex_unlock(&dec->lock);
+
+	/* if decoding fell behind, play on from here rather than rushing */
+	if (now > dec->start_ns + (dec->frame + 1) * dec->frame_ns)
+		dec->start_ns = now - dec->frame * dec->frame_ns;
+
+	dec->frame++;
+	if (frame)
+		dec->last_frame = frame;
+
+	return frame ? frame : dec->last_frame;
+}
+
+void video_deinit(struct decoder *dec)
+{
+	pthread_mutex_lock(&dec->lock);
+	dec->quit = true;
+	pthread_cond_broadcast(&dec->cond);
+	pthread_mutex_unlock(&dec->lock);
+	pthread_join(dec->thread, NULL);
+
+	for (unsigned i = 0; i < NUM_TEXTURES; i++)
+		destroy_texture(dec, &dec->tex[i]);
+
+	pthread_mutex_destroy(&dec->lock);
+	pthread_cond_destroy(&dec->cond);
+	munmap((void *)dec->data, dec->size);
+	delete dec;
+}
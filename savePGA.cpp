@@ -25,7 +25,16 @@ unsigned lodepng_encode_file(
 {
   unsigned char* buffer;
   size_t buffersize;
-  unsigned error = lodepng_encode_memory(&buffer, &buffersize, image, w, h, colortype, bitdepth);
+  unsigned error;
+  LodePNGState state;
+  lodepng_state_init(&state);
+  state.info_raw.colortype = colortype;
+  state.info_raw.bitdepth = bitdepth;
+  state.info_png.color.colortype = colortype;
+  state.info_png.color.bitdepth = bitdepth;
+  state.encoder.num_threads = 0; /*filter and compress on one thread per CPU*/
+  error = lodepng_encode(&buffer, &buffersize, image, w, h, &state);
+  lodepng_state_cleanup(&state);
   if(!error) error = lodepng_save_file(buffer, buffersize, filename);
   lodepng_free(buffer);
   return error;
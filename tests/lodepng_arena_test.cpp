@@ -0,0 +1,65 @@
+// lodepng's C++ API used inside a lodepng::ArenaScope: the ByteVectors it fills must stay valid, and be
+// released correctly, after the arena has been reset. Returns non-zero on failure; run it under ASan.
+
+#include "lodepng.h"
+
+#include <cstdio>
+#include <cstring>
+
+using namespace FCInterface;
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while (0)
+
+int main()
+{
+	const unsigned width = 61, height = 37;
+	ByteVector pixels(width * height * 4);
+	for (unsigned i = 0; i < pixels.size(); ++i)
+		pixels[i] = (unsigned char)(i * 7 + i / 13);
+
+	ByteVector png;
+	CHECK(lodepng::encode(png, pixels, width, height) == 0);
+
+	LodePNGArena arena;
+	lodepng_arena_init(&arena, 0);
+
+	ByteVector decoded, decodedState, encoded, compressed, decompressed;
+	{
+		lodepng::ArenaScope scope(&arena);
+		unsigned w, h;
+		CHECK(lodepng::decode(decoded, w, h, png) == 0);
+		CHECK(w == width && h == height);
+		{
+			lodepng::State state;
+			CHECK(lodepng::decode(decodedState, w, h, state, png) == 0);
+		}
+		CHECK(lodepng::encode(encoded, pixels, width, height) == 0);
+		CHECK(lodepng::compress(compressed, pixels, lodepng_default_compress_settings) == 0);
+		CHECK(lodepng::decompress(decompressed, compressed, lodepng_default_decompress_settings) == 0);
+	}
+	CHECK(arena.num_allocs > 0);
+
+	// the arena's memory is reused from here on; the outputs must not live in it
+	lodepng_arena_reset(&arena);
+	{
+		lodepng::ArenaScope scope(&arena);
+		ByteVector scratch;
+		unsigned w, h;
+		CHECK(lodepng::decode(scratch, w, h, png) == 0);
+	}
+	lodepng_arena_reset(&arena);
+
+	CHECK(decoded.size() == pixels.size() && memcmp(decoded.buffer(), pixels.buffer(), pixels.size()) == 0);
+	CHECK(decodedState.size() == pixels.size() && memcmp(decodedState.buffer(), pixels.buffer(), pixels.size()) == 0);
+	CHECK(encoded.size() == png.size() && memcmp(encoded.buffer(), png.buffer(), png.size()) == 0);
+	CHECK(decompressed.size() == pixels.size() && memcmp(decompressed.buffer(), pixels.buffer(), pixels.size()) == 0);
+
+	// the vectors free their storage here, after the arena is gone
+	lodepng_arena_cleanup(&arena);
+
+	if (failures == 0)
+		printf("lodepng_arena_test: OK\n");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,89 @@
+// MediaLoader::probe() must report the pixel format loadImage() returns for a PNG, for every color type
+// and bit depth, and PixelFormatNone for the ones loadImage() can't load. Returns non-zero on failure.
+
+#include "MediaLoader.h"
+#include "gfx/lodepng.h"
+
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+
+using namespace FCInterface;
+
+static bool writePNG(const std::string& filename, LodePNGColorType colorType, unsigned int bitDepth)
+{
+	const unsigned int width = 5, height = 3;
+	lodepng::State state;
+	state.encoder.auto_convert = 0;
+	lodepng_color_mode_init(&state.info_raw);
+	state.info_raw.colortype = colorType;
+	state.info_raw.bitdepth = bitDepth;
+	if (colorType == LCT_PALETTE) {
+		lodepng_palette_add(&state.info_raw, 0, 0, 0, 255);
+		lodepng_palette_add(&state.info_raw, 255, 128, 0, 255);
+	}
+	if (lodepng_color_mode_copy(&state.info_png.color, &state.info_raw))
+		return false;
+
+	// all zeros, which is index 0 for palette images
+	ByteVector raw((unsigned int)lodepng_get_raw_size(width, height, &state.info_raw));
+	for (unsigned int i = 0; i < raw.size(); ++i)
+		raw[i] = 0;
+
+	ByteVector png;
+	return lodepng::encode(png, raw, width, height, state) == 0 && lodepng::save_file(png, filename) == 0;
+}
+
+int main()
+{
+	struct Case { LodePNGColorType colorType; unsigned int bitDepth; };
+	static const Case cases[] = {
+		{ LCT_GREY, 1 }, { LCT_GREY, 2 }, { LCT_GREY, 4 }, { LCT_GREY, 8 }, { LCT_GREY, 16 },
+		{ LCT_RGB, 8 }, { LCT_RGB, 16 },
+		{ LCT_PALETTE, 1 }, { LCT_PALETTE, 2 }, { LCT_PALETTE, 4 }, { LCT_PALETTE, 8 },
+		{ LCT_GREY_ALPHA, 8 }, { LCT_GREY_ALPHA, 16 },
+		{ LCT_RGBA, 8 }, { LCT_RGBA, 16 },
+	};
+
+	char dir[] = "/tmp/media_probe_testXXXXXX";
+	if (!mkdtemp(dir)) {
+		printf("FAILED: could not create a temporary directory\n");
+		return 1;
+	}
+
+	int failures = 0;
+	for (const Case& c : cases) {
+		std::string filename = std::string(dir) + "/image.png";
+		if (!writePNG(filename, c.colorType, c.bitDepth)) {
+			printf("FAILED: could not encode color type %d, bit depth %u\n", (int)c.colorType, c.bitDepth);
+			++failures;
+			continue;
+		}
+
+		MediaLoader::ProbeInfo info;
+		bool probed = MediaLoader::probe(filename, info);
+
+		unsigned int width = 0, height = 0;
+		ByteVector pixels;
+		PixelFormat loadedFormat = PixelFormat::PixelFormatNone;
+		if (!MediaLoader::loadImage(filename, width, height, pixels, loadedFormat))
+			loadedFormat = PixelFormat::PixelFormatNone;
+
+		if (!probed || info.pixelFormat != loadedFormat) {
+			printf("FAILED: color type %d, bit depth %u: probe says %d, loadImage says %d\n",
+				(int)c.colorType, c.bitDepth, probed ? (int)info.pixelFormat : -1, (int)loadedFormat);
+			++failures;
+		}
+		else if (loadedFormat != PixelFormat::PixelFormatNone && (info.width != width || info.height != height)) {
+			printf("FAILED: color type %d, bit depth %u: probe size %ux%u, loaded %ux%u\n",
+				(int)c.colorType, c.bitDepth, info.width, info.height, width, height);
+			++failures;
+		}
+		unlink(filename.c_str());
+	}
+	rmdir(dir);
+
+	if (failures == 0)
+		printf("media_probe_test: OK\n");
+	return failures == 0 ? 0 : 1;
+}
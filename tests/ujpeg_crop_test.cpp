@@ -0,0 +1,145 @@
+// uJPEG regions (ujSetCrop) must match the same pixels of a full decode at the same scale, including the
+// subsampled chroma along the region's right and bottom edges. Only the first few columns (rows) of a region
+// whose origin isn't the picture's left (top) edge may differ. Returns non-zero on failure.
+//
+// usage: ujpeg_crop_test tests/data/crop-*.jpg
+
+#include "ujpeg.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace FCInterface;
+
+static bool readFile(const char* filename, std::vector<unsigned char>& out)
+{
+	FILE* f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	unsigned char buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+		out.insert(out.end(), buffer, buffer + n);
+	fclose(f);
+	return !out.empty();
+}
+
+// macroblock size from the SOF0 segment, which is all uJPEG decodes
+static bool macroblockSize(const std::vector<unsigned char>& jpeg, int& mbWidth, int& mbHeight)
+{
+	for (size_t i = 2; i + 10 < jpeg.size(); ++i) {
+		if (jpeg[i] != 0xFF || jpeg[i + 1] != 0xC0)
+			continue;
+		int ncomp = jpeg[i + 9], ssxmax = 1, ssymax = 1;
+		for (int k = 0; k < ncomp && i + 12 + k * 3 < jpeg.size(); ++k) {
+			int ss = jpeg[i + 11 + k * 3];
+			if ((ss >> 4) > ssxmax) ssxmax = ss >> 4;
+			if ((ss & 15) > ssymax) ssymax = ss & 15;
+		}
+		mbWidth = ssxmax * 8;
+		mbHeight = ssymax * 8;
+		return true;
+	}
+	return false;
+}
+
+static bool decode(const std::vector<unsigned char>& jpeg, int x, int y, int width, int height, unsigned int maxWidth, unsigned int maxHeight,
+	ByteVector& rgba, int& widthOut, int& heightOut, int& xOut, int& yOut)
+{
+	uJPEG decoder;
+	decoder.setMaxDimensions(maxWidth, maxHeight);
+	if (width > 0)
+		decoder.setCrop(x, y, width, height);
+	if (!decoder.decode(&jpeg[0], (int)jpeg.size()) || !decoder.getImage(rgba))
+		return false;
+	widthOut = decoder.getWidth();
+	heightOut = decoder.getHeight();
+	decoder.getCropOffset(xOut, yOut);
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	int failures = 0, checked = 0;
+	for (int a = 1; a < argc; ++a) {
+		std::vector<unsigned char> jpeg;
+		int mbWidth, mbHeight;
+		if (!readFile(argv[a], jpeg) || !macroblockSize(jpeg, mbWidth, mbHeight)) {
+			printf("FAILED: could not read %s\n", argv[a]);
+			++failures;
+			continue;
+		}
+
+		ByteVector full;
+		int fullWidth, fullHeight, x0, y0;
+		if (!decode(jpeg, 0, 0, 0, 0, 0, 0, full, fullWidth, fullHeight, x0, y0)) {
+			printf("FAILED: could not decode %s\n", argv[a]);
+			++failures;
+			continue;
+		}
+		const int pictureWidth = fullWidth, pictureHeight = fullHeight;
+
+		// regions ending inside a macroblock, on a macroblock boundary, next to and at the picture's edges
+		const int crops[][4] = {
+			{ 0, 0, 100, 100 }, { 0, 0, 64, 48 }, { 16, 16, 64, 48 }, { 20, 30, 90, 60 }, { 33, 17, pictureWidth - 33, pictureHeight - 17 },
+			{ 0, 0, pictureWidth - 3, pictureHeight - 2 }, { 0, 0, pictureWidth - 1, pictureHeight - 1 }, { 100, 80, 24, 24 },
+		};
+		// the chroma upsampled across a region's origin differs for up to 2n+1 pixels with n-times subsampling
+		const int skipX = mbWidth / 4 + 1, skipY = mbHeight / 4 + 1;
+		for (const int* crop : crops) {
+			if (crop[2] <= 0 || crop[3] <= 0 || crop[0] + crop[2] > pictureWidth || crop[1] + crop[3] > pictureHeight)
+				continue;
+			for (int scale = 0; scale <= 2; ++scale) {
+				// limits that make the full picture and the region come out at the same scale
+				int regionX = crop[0] / mbWidth * mbWidth, regionY = crop[1] / mbHeight * mbHeight;
+				int regionWidth = crop[0] + crop[2] - regionX, regionHeight = crop[1] + crop[3] - regionY;
+				unsigned int step = 1u << scale;
+				// too few chroma samples to upsample, which uJPEG only fixes by growing the region past the limits
+				if (((regionWidth >> scale) * 8 / mbWidth < 3 && mbWidth > 8) || ((regionHeight >> scale) * 8 / mbHeight < 3 && mbHeight > 8))
+					continue;
+				if (!decode(jpeg, 0, 0, 0, 0, (pictureWidth + step - 1) >> scale, (pictureHeight + step - 1) >> scale, full, fullWidth, fullHeight, x0, y0)) {
+					printf("FAILED: %s could not be decoded at 1/%u\n", argv[a], step);
+					++failures;
+					continue;
+				}
+
+				ByteVector region;
+				int width, height;
+				if (!decode(jpeg, crop[0], crop[1], crop[2], crop[3], (regionWidth + step - 1) >> scale, (regionHeight + step - 1) >> scale,
+						region, width, height, x0, y0)) {
+					printf("FAILED: %s region %d,%d %dx%d could not be decoded at 1/%u\n", argv[a], crop[0], crop[1], crop[2], crop[3], step);
+					++failures;
+					continue;
+				}
+
+				const int bpp = (int)(full.size() / ((size_t)fullWidth * fullHeight));
+				int worst = 0, worstX = 0, worstY = 0;
+				for (int y = (y0 > 0 ? skipY : 0); y < height; ++y) {
+					for (int x = (x0 > 0 ? skipX : 0); x < width; ++x) {
+						const unsigned char* p = &region[(y * width + x) * bpp];
+						const unsigned char* q = &full[((y0 + y) * fullWidth + x0 + x) * bpp];
+						for (int k = 0; k < bpp && k < 3; ++k) {
+							if (abs(p[k] - q[k]) > worst) {
+								worst = abs(p[k] - q[k]);
+								worstX = x;
+								worstY = y;
+							}
+						}
+					}
+				}
+				++checked;
+				if (worst != 0) {
+					printf("FAILED: %s region %d,%d %dx%d at 1/%u (%dx%d at %d,%d): differs by %d at %d,%d\n", argv[a], crop[0], crop[1], crop[2], crop[3],
+						step, width, height, x0, y0, worst, worstX, worstY);
+					++failures;
+				}
+			}
+		}
+	}
+
+	if (failures == 0 && checked > 0)
+		printf("ujpeg_crop_test: OK, %d regions\n", checked);
+	return (failures == 0 && checked > 0) ? 0 : 1;
+}
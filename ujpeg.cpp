@@ -26,9 +26,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "ujpeg.h"
 
+#include <pthread.h>
+
+/* UJ_MAX_THREADS: upper bound for the number of threads used to decode
+ * restart intervals in parallel (see ujSetThreadCount()). */
+#define UJ_MAX_THREADS 8
+
+/* UJ_NO_SIMD: if #defined, the NEON/SSE2 IDCT kernels are not compiled in and
+ * the portable scalar code is always used. */
+#if !defined(UJ_NO_SIMD)
+    #if defined(__ARM_NEON) || defined(__ARM_NEON__)
+        #define UJ_USE_NEON
+        #include <arm_neon.h>
+        #if defined(__linux__) && !defined(__aarch64__)
+            #include <sys/auxv.h>
+            #include <asm/hwcap.h>
+        #endif
+    #elif defined(__SSE2__)
+        #define UJ_USE_SSE2
+        #include <emmintrin.h>
+    #endif
+#endif
+
 /* UJ_NODECODE_BLOCK_SIZE: if #defined, this specifies the amount of bytes
  * to load from disk if ujDecodeFile() is used after ujDisableDecoding().
  * This will speed up checking of large files, because not the whole file has
@@ -53,17 +76,38 @@ typedef struct _uj_code {
     unsigned char bits, code;
 } ujVLCCode;
 
+// Huffman codes of up to UJ_VLC_FAST_BITS bits are resolved with a single
+// lookup into 'fast'; longer ones fall back to a canonical-code search.
+#define UJ_VLC_FAST_BITS 9
+
+typedef struct _uj_huff {
+    ujVLCCode fast[1 << UJ_VLC_FAST_BITS];  // bits == 0: longer (or invalid) code
+    unsigned int maxcode[17];   // first 16-bit left-aligned code past each length
+    int delta[17];              // value index minus first code for each length
+    unsigned char values[256];
+} ujHuffTable;
+
 typedef struct _uj_cmp {
     int width, height;
+    int picw, pich;     // samples from the region's origin to the picture's right/bottom edge
     int stride;
     FCInterface::ByteVector pixels;
     int cid;
     int ssx, ssy;
     int qtsel;
     int actabsel, dctabsel;
-    int dcpred;
 } ujComponent;
 
+typedef struct _uj_scan {
+    const unsigned char *pos;
+    int size;
+    uint64_t buf;       // bit reservoir, next bit in the MSB
+    int bufbits;
+    int block[64];
+    int dcpred[3];
+    ujResult error;
+} ujScanState;
+
 typedef struct _uj_ctx {
     const unsigned char *pos;
     int valid, decoded;
@@ -79,19 +123,33 @@ typedef struct _uj_ctx {
     ujComponent comp[3];
     int qtused, qtavail;
     unsigned char qtab[4][64];
-    ujVLCCode vlctab[4][65536];
-    int buf, bufbits;
-    int block[64];
+    ujHuffTable vlctab[4];
+    unsigned char vlcdef[4][17 + 256];  // DHT data each table was built from
+    int vlcdeflen[4];
+    int stream;         // tables are kept across decodes (Motion-JPEG)
+    int orientation;    // EXIF orientation (1..8, 0 = none given)
+    int auto_orient;    // apply it in ujConvert/ujConvertYUV
+    int force_orientation;  // used instead of the file's (0 = the file's)
     int rstinterval;
-	FCInterface::ByteVector rgb;
-	FCInterface::ByteVector thumbnail;
+    int threads;
+    int scale;          // output is downscaled by 1 << scale (0..3)
+    int cropx, cropy, cropw, croph;   // requested region (full-size pixels)
+    int mbx0, mby0, mbx1, mby1;       // macroblocks covering the region
+    int originx, originy;             // decoded region's origin (output pixels)
+    ujResult error;
+	const unsigned char* thumbPos;     // EXIF thumbnail, inside the JPEG data being decoded
+	unsigned int thumbSize;
+	FCInterface::ByteVector scratch;  // line buffers, restart segment table
+	FCInterface::ByteVector band;     // staging for mirrored/transposed output lines
     int exif_le;
     int co_sited_chroma;
 	unsigned int maxHeight;
 	unsigned int maxWidth;
 } ujContext;
 
-static ujResult ujError = UJ_OK;
+// error of the last call that had no context to record it in (a NULL handle
+// or a failed ujCreate()/ujDecode(NULL, ...)); every context keeps its own
+static thread_local ujResult ujErrorNoContext = UJ_OK;
 
 static const char ujZZ[64] = { 0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18,
 11, 4, 5, 12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28, 35,
@@ -205,69 +263,448 @@ UJ_INLINE void ujColIDCT(const int* blk, unsigned char *out, int stride) {
     *out = ujClip(((x7 - x1) >> 14) + 128);
 }
 
+static void ujIDCTScalar(int* blk, unsigned char *out, int stride) {
+    int coef;
+    for (coef = 0;  coef < 64;  coef += 8)
+        ujRowIDCT(&blk[coef]);
+    for (coef = 0;  coef < 8;  ++coef)
+        ujColIDCT(&blk[coef], &out[coef], stride);
+}
+
+// The SIMD kernels below compute exactly the same 32-bit integer arithmetic
+// as ujRowIDCT/ujColIDCT, four rows or columns per vector, so their output
+// is bit-identical to the scalar path. The "all AC zero" shortcuts of the
+// scalar code produce the same values as the full computation, so they are
+// not replicated here.
+
+#if defined(UJ_USE_SSE2)
+
+UJ_FORCE_INLINE __m128i ujMulSSE2(__m128i a, int k) {
+    // SSE2 has no 32-bit mullo; build it from two 32x32->64 multiplies
+    const __m128i b = _mm_set1_epi32(k);
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), b);
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+UJ_FORCE_INLINE void ujTranspose4SSE2(__m128i* a, __m128i* b, __m128i* c, __m128i* d) {
+    __m128i t0 = _mm_unpacklo_epi32(*a, *b);
+    __m128i t1 = _mm_unpacklo_epi32(*c, *d);
+    __m128i t2 = _mm_unpackhi_epi32(*a, *b);
+    __m128i t3 = _mm_unpackhi_epi32(*c, *d);
+    *a = _mm_unpacklo_epi64(t0, t1);
+    *b = _mm_unpackhi_epi64(t0, t1);
+    *c = _mm_unpacklo_epi64(t2, t3);
+    *d = _mm_unpackhi_epi64(t2, t3);
+}
+
+// m[2 * r + h] holds row r, columns 4h..4h+3
+UJ_INLINE void ujTranspose8SSE2(__m128i* m) {
+    __m128i t;
+    ujTranspose4SSE2(&m[0], &m[2], &m[4], &m[6]);
+    ujTranspose4SSE2(&m[1], &m[3], &m[5], &m[7]);
+    ujTranspose4SSE2(&m[8], &m[10], &m[12], &m[14]);
+    ujTranspose4SSE2(&m[9], &m[11], &m[13], &m[15]);
+    t = m[1];  m[1] = m[8];  m[8] = t;
+    t = m[3];  m[3] = m[10];  m[10] = t;
+    t = m[5];  m[5] = m[12];  m[12] = t;
+    t = m[7];  m[7] = m[14];  m[14] = t;
+}
+
+// v[k] = coefficient k of four independent 1-D transforms, stride 2
+UJ_INLINE void ujRowIDCTSSE2(__m128i* v) {
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    x1 = _mm_slli_epi32(v[8], 11);
+    x2 = v[12];  x3 = v[4];  x4 = v[2];  x5 = v[14];  x6 = v[10];  x7 = v[6];
+    x0 = _mm_add_epi32(_mm_slli_epi32(v[0], 11), _mm_set1_epi32(128));
+    x8 = ujMulSSE2(_mm_add_epi32(x4, x5), W7);
+    x4 = _mm_add_epi32(x8, ujMulSSE2(x4, W1 - W7));
+    x5 = _mm_sub_epi32(x8, ujMulSSE2(x5, W1 + W7));
+    x8 = ujMulSSE2(_mm_add_epi32(x6, x7), W3);
+    x6 = _mm_sub_epi32(x8, ujMulSSE2(x6, W3 - W5));
+    x7 = _mm_sub_epi32(x8, ujMulSSE2(x7, W3 + W5));
+    x8 = _mm_add_epi32(x0, x1);
+    x0 = _mm_sub_epi32(x0, x1);
+    x1 = ujMulSSE2(_mm_add_epi32(x3, x2), W6);
+    x2 = _mm_sub_epi32(x1, ujMulSSE2(x2, W2 + W6));
+    x3 = _mm_add_epi32(x1, ujMulSSE2(x3, W2 - W6));
+    x1 = _mm_add_epi32(x4, x6);
+    x4 = _mm_sub_epi32(x4, x6);
+    x6 = _mm_add_epi32(x5, x7);
+    x5 = _mm_sub_epi32(x5, x7);
+    x7 = _mm_add_epi32(x8, x3);
+    x8 = _mm_sub_epi32(x8, x3);
+    x3 = _mm_add_epi32(x0, x2);
+    x0 = _mm_sub_epi32(x0, x2);
+    x2 = _mm_srai_epi32(_mm_add_epi32(ujMulSSE2(_mm_add_epi32(x4, x5), 181), _mm_set1_epi32(128)), 8);
+    x4 = _mm_srai_epi32(_mm_add_epi32(ujMulSSE2(_mm_sub_epi32(x4, x5), 181), _mm_set1_epi32(128)), 8);
+    v[0]  = _mm_srai_epi32(_mm_add_epi32(x7, x1), 8);
+    v[2]  = _mm_srai_epi32(_mm_add_epi32(x3, x2), 8);
+    v[4]  = _mm_srai_epi32(_mm_add_epi32(x0, x4), 8);
+    v[6]  = _mm_srai_epi32(_mm_add_epi32(x8, x6), 8);
+    v[8]  = _mm_srai_epi32(_mm_sub_epi32(x8, x6), 8);
+    v[10] = _mm_srai_epi32(_mm_sub_epi32(x0, x4), 8);
+    v[12] = _mm_srai_epi32(_mm_sub_epi32(x3, x2), 8);
+    v[14] = _mm_srai_epi32(_mm_sub_epi32(x7, x1), 8);
+}
+
+// same as ujRowIDCTSSE2 but with the column pass' scaling; results are left
+// biased by +128 and still need to be clipped
+UJ_INLINE void ujColIDCTSSE2(__m128i* v) {
+    const __m128i four = _mm_set1_epi32(4);
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    x1 = _mm_slli_epi32(v[8], 8);
+    x2 = v[12];  x3 = v[4];  x4 = v[2];  x5 = v[14];  x6 = v[10];  x7 = v[6];
+    x0 = _mm_add_epi32(_mm_slli_epi32(v[0], 8), _mm_set1_epi32(8192));
+    x8 = _mm_add_epi32(ujMulSSE2(_mm_add_epi32(x4, x5), W7), four);
+    x4 = _mm_srai_epi32(_mm_add_epi32(x8, ujMulSSE2(x4, W1 - W7)), 3);
+    x5 = _mm_srai_epi32(_mm_sub_epi32(x8, ujMulSSE2(x5, W1 + W7)), 3);
+    x8 = _mm_add_epi32(ujMulSSE2(_mm_add_epi32(x6, x7), W3), four);
+    x6 = _mm_srai_epi32(_mm_sub_epi32(x8, ujMulSSE2(x6, W3 - W5)), 3);
+    x7 = _mm_srai_epi32(_mm_sub_epi32(x8, ujMulSSE2(x7, W3 + W5)), 3);
+    x8 = _mm_add_epi32(x0, x1);
+    x0 = _mm_sub_epi32(x0, x1);
+    x1 = _mm_add_epi32(ujMulSSE2(_mm_add_epi32(x3, x2), W6), four);
+    x2 = _mm_srai_epi32(_mm_sub_epi32(x1, ujMulSSE2(x2, W2 + W6)), 3);
+    x3 = _mm_srai_epi32(_mm_add_epi32(x1, ujMulSSE2(x3, W2 - W6)), 3);
+    x1 = _mm_add_epi32(x4, x6);
+    x4 = _mm_sub_epi32(x4, x6);
+    x6 = _mm_add_epi32(x5, x7);
+    x5 = _mm_sub_epi32(x5, x7);
+    x7 = _mm_add_epi32(x8, x3);
+    x8 = _mm_sub_epi32(x8, x3);
+    x3 = _mm_add_epi32(x0, x2);
+    x0 = _mm_sub_epi32(x0, x2);
+    x2 = _mm_srai_epi32(_mm_add_epi32(ujMulSSE2(_mm_add_epi32(x4, x5), 181), _mm_set1_epi32(128)), 8);
+    x4 = _mm_srai_epi32(_mm_add_epi32(ujMulSSE2(_mm_sub_epi32(x4, x5), 181), _mm_set1_epi32(128)), 8);
+    const __m128i bias = _mm_set1_epi32(128);
+    v[0]  = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(x7, x1), 14), bias);
+    v[2]  = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(x3, x2), 14), bias);
+    v[4]  = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(x0, x4), 14), bias);
+    v[6]  = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(x8, x6), 14), bias);
+    v[8]  = _mm_add_epi32(_mm_srai_epi32(_mm_sub_epi32(x8, x6), 14), bias);
+    v[10] = _mm_add_epi32(_mm_srai_epi32(_mm_sub_epi32(x0, x4), 14), bias);
+    v[12] = _mm_add_epi32(_mm_srai_epi32(_mm_sub_epi32(x3, x2), 14), bias);
+    v[14] = _mm_add_epi32(_mm_srai_epi32(_mm_sub_epi32(x7, x1), 14), bias);
+}
+
+static void ujIDCTSSE2(int* blk, unsigned char *out, int stride) {
+    __m128i m[16];
+    int i;
+    for (i = 0;  i < 16;  ++i)
+        m[i] = _mm_loadu_si128((const __m128i*) &blk[i << 2]);
+    // row pass: transpose so that each vector lane is one row
+    ujTranspose8SSE2(m);
+    ujRowIDCTSSE2(&m[0]);
+    ujRowIDCTSSE2(&m[1]);
+    // column pass: transpose back so that each vector lane is one column
+    ujTranspose8SSE2(m);
+    ujColIDCTSSE2(&m[0]);
+    ujColIDCTSSE2(&m[1]);
+    // saturating packs implement ujClip()
+    for (i = 0;  i < 16;  i += 4) {
+        __m128i px = _mm_packus_epi16(_mm_packs_epi32(m[i], m[i + 1]), _mm_packs_epi32(m[i + 2], m[i + 3]));
+        _mm_storel_epi64((__m128i*) out, px);  out += stride;
+        _mm_storel_epi64((__m128i*) out, _mm_srli_si128(px, 8));  out += stride;
+    }
+}
+
+#endif // UJ_USE_SSE2
+
+#if defined(UJ_USE_NEON)
+
+UJ_FORCE_INLINE void ujTranspose4NEON(int32x4_t* a, int32x4_t* b, int32x4_t* c, int32x4_t* d) {
+    int32x4x2_t ab = vtrnq_s32(*a, *b);
+    int32x4x2_t cd = vtrnq_s32(*c, *d);
+    *a = vcombine_s32(vget_low_s32(ab.val[0]), vget_low_s32(cd.val[0]));
+    *b = vcombine_s32(vget_low_s32(ab.val[1]), vget_low_s32(cd.val[1]));
+    *c = vcombine_s32(vget_high_s32(ab.val[0]), vget_high_s32(cd.val[0]));
+    *d = vcombine_s32(vget_high_s32(ab.val[1]), vget_high_s32(cd.val[1]));
+}
+
+// m[2 * r + h] holds row r, columns 4h..4h+3
+UJ_INLINE void ujTranspose8NEON(int32x4_t* m) {
+    int32x4_t t;
+    ujTranspose4NEON(&m[0], &m[2], &m[4], &m[6]);
+    ujTranspose4NEON(&m[1], &m[3], &m[5], &m[7]);
+    ujTranspose4NEON(&m[8], &m[10], &m[12], &m[14]);
+    ujTranspose4NEON(&m[9], &m[11], &m[13], &m[15]);
+    t = m[1];  m[1] = m[8];  m[8] = t;
+    t = m[3];  m[3] = m[10];  m[10] = t;
+    t = m[5];  m[5] = m[12];  m[12] = t;
+    t = m[7];  m[7] = m[14];  m[14] = t;
+}
+
+// v[k] = coefficient k of four independent 1-D transforms, stride 2
+UJ_INLINE void ujRowIDCTNEON(int32x4_t* v) {
+    int32x4_t x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    x1 = vshlq_n_s32(v[8], 11);
+    x2 = v[12];  x3 = v[4];  x4 = v[2];  x5 = v[14];  x6 = v[10];  x7 = v[6];
+    x0 = vaddq_s32(vshlq_n_s32(v[0], 11), vdupq_n_s32(128));
+    x8 = vmulq_n_s32(vaddq_s32(x4, x5), W7);
+    x4 = vmlaq_n_s32(x8, x4, W1 - W7);
+    x5 = vmlsq_n_s32(x8, x5, W1 + W7);
+    x8 = vmulq_n_s32(vaddq_s32(x6, x7), W3);
+    x6 = vmlsq_n_s32(x8, x6, W3 - W5);
+    x7 = vmlsq_n_s32(x8, x7, W3 + W5);
+    x8 = vaddq_s32(x0, x1);
+    x0 = vsubq_s32(x0, x1);
+    x1 = vmulq_n_s32(vaddq_s32(x3, x2), W6);
+    x2 = vmlsq_n_s32(x1, x2, W2 + W6);
+    x3 = vmlaq_n_s32(x1, x3, W2 - W6);
+    x1 = vaddq_s32(x4, x6);
+    x4 = vsubq_s32(x4, x6);
+    x6 = vaddq_s32(x5, x7);
+    x5 = vsubq_s32(x5, x7);
+    x7 = vaddq_s32(x8, x3);
+    x8 = vsubq_s32(x8, x3);
+    x3 = vaddq_s32(x0, x2);
+    x0 = vsubq_s32(x0, x2);
+    x2 = vshrq_n_s32(vmlaq_n_s32(vdupq_n_s32(128), vaddq_s32(x4, x5), 181), 8);
+    x4 = vshrq_n_s32(vmlaq_n_s32(vdupq_n_s32(128), vsubq_s32(x4, x5), 181), 8);
+    v[0]  = vshrq_n_s32(vaddq_s32(x7, x1), 8);
+    v[2]  = vshrq_n_s32(vaddq_s32(x3, x2), 8);
+    v[4]  = vshrq_n_s32(vaddq_s32(x0, x4), 8);
+    v[6]  = vshrq_n_s32(vaddq_s32(x8, x6), 8);
+    v[8]  = vshrq_n_s32(vsubq_s32(x8, x6), 8);
+    v[10] = vshrq_n_s32(vsubq_s32(x0, x4), 8);
+    v[12] = vshrq_n_s32(vsubq_s32(x3, x2), 8);
+    v[14] = vshrq_n_s32(vsubq_s32(x7, x1), 8);
+}
+
+// same as ujRowIDCTNEON but with the column pass' scaling; results are left
+// biased by +128 and still need to be clipped
+UJ_INLINE void ujColIDCTNEON(int32x4_t* v) {
+    const int32x4_t four = vdupq_n_s32(4);
+    const int32x4_t bias = vdupq_n_s32(128);
+    int32x4_t x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    x1 = vshlq_n_s32(v[8], 8);
+    x2 = v[12];  x3 = v[4];  x4 = v[2];  x5 = v[14];  x6 = v[10];  x7 = v[6];
+    x0 = vaddq_s32(vshlq_n_s32(v[0], 8), vdupq_n_s32(8192));
+    x8 = vmlaq_n_s32(four, vaddq_s32(x4, x5), W7);
+    x4 = vshrq_n_s32(vmlaq_n_s32(x8, x4, W1 - W7), 3);
+    x5 = vshrq_n_s32(vmlsq_n_s32(x8, x5, W1 + W7), 3);
+    x8 = vmlaq_n_s32(four, vaddq_s32(x6, x7), W3);
+    x6 = vshrq_n_s32(vmlsq_n_s32(x8, x6, W3 - W5), 3);
+    x7 = vshrq_n_s32(vmlsq_n_s32(x8, x7, W3 + W5), 3);
+    x8 = vaddq_s32(x0, x1);
+    x0 = vsubq_s32(x0, x1);
+    x1 = vmlaq_n_s32(four, vaddq_s32(x3, x2), W6);
+    x2 = vshrq_n_s32(vmlsq_n_s32(x1, x2, W2 + W6), 3);
+    x3 = vshrq_n_s32(vmlaq_n_s32(x1, x3, W2 - W6), 3);
+    x1 = vaddq_s32(x4, x6);
+    x4 = vsubq_s32(x4, x6);
+    x6 = vaddq_s32(x5, x7);
+    x5 = vsubq_s32(x5, x7);
+    x7 = vaddq_s32(x8, x3);
+    x8 = vsubq_s32(x8, x3);
+    x3 = vaddq_s32(x0, x2);
+    x0 = vsubq_s32(x0, x2);
+    x2 = vshrq_n_s32(vmlaq_n_s32(bias, vaddq_s32(x4, x5), 181), 8);
+    x4 = vshrq_n_s32(vmlaq_n_s32(bias, vsubq_s32(x4, x5), 181), 8);
+    v[0]  = vsraq_n_s32(bias, vaddq_s32(x7, x1), 14);
+    v[2]  = vsraq_n_s32(bias, vaddq_s32(x3, x2), 14);
+    v[4]  = vsraq_n_s32(bias, vaddq_s32(x0, x4), 14);
+    v[6]  = vsraq_n_s32(bias, vaddq_s32(x8, x6), 14);
+    v[8]  = vsraq_n_s32(bias, vsubq_s32(x8, x6), 14);
+    v[10] = vsraq_n_s32(bias, vsubq_s32(x0, x4), 14);
+    v[12] = vsraq_n_s32(bias, vsubq_s32(x3, x2), 14);
+    v[14] = vsraq_n_s32(bias, vsubq_s32(x7, x1), 14);
+}
+
+static void ujIDCTNEON(int* blk, unsigned char *out, int stride) {
+    int32x4_t m[16];
+    int i;
+    for (i = 0;  i < 16;  ++i)
+        m[i] = vld1q_s32(&blk[i << 2]);
+    // row pass: transpose so that each vector lane is one row
+    ujTranspose8NEON(m);
+    ujRowIDCTNEON(&m[0]);
+    ujRowIDCTNEON(&m[1]);
+    // column pass: transpose back so that each vector lane is one column
+    ujTranspose8NEON(m);
+    ujColIDCTNEON(&m[0]);
+    ujColIDCTNEON(&m[1]);
+    // saturating narrows implement ujClip()
+    for (i = 0;  i < 16;  i += 2) {
+        vst1_u8(out, vqmovun_s16(vcombine_s16(vqmovn_s32(m[i]), vqmovn_s32(m[i + 1]))));
+        out += stride;
+    }
+}
+
+#endif // UJ_USE_NEON
+
+typedef void (*ujIDCTFunc)(int* blk, unsigned char *out, int stride);
+
+static ujIDCTFunc ujSelectIDCT(void) {
+#if defined(UJ_USE_NEON)
+    #if defined(__linux__) && !defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_NEON)
+    #endif
+        return ujIDCTNEON;
+#elif defined(UJ_USE_SSE2)
+    #if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+    if (__builtin_cpu_supports("sse2"))
+    #endif
+        return ujIDCTSSE2;
+#endif
+    return ujIDCTScalar;
+}
+
+// selected once at load time; ujSetIDCTMode() can force the scalar path
+static ujIDCTFunc ujIDCT = ujSelectIDCT();
+
+// Reduced-size IDCTs for downscaled decoding: an n x n block (n = 4 or 2) is
+// computed from the n x n lowest-frequency coefficients. The basis functions
+// are the 8-point ones averaged over each group of 8 / n pixels, so every
+// output pixel is the box-filtered average of the pixels it replaces (minus
+// the discarded high frequencies). 12-bit fixed point.
+static const int ujIDCT4x4[4][4] = {
+    { 1448,  1856,  1338,   652 },
+    { 1448,   769, -1338, -1573 },
+    { 1448,  -769, -1338,  1573 },
+    { 1448, -1856,  1338,  -652 } };
+static const int ujIDCT2x2[2][2] = {
+    { 1448,  1312 },
+    { 1448, -1312 } };
+
+static void ujIDCTReduced(const int* blk, unsigned char *out, int stride, int n) {
+    const int *m = (n == 4) ? &ujIDCT4x4[0][0] : &ujIDCT2x2[0][0];
+    int tmp[4][4];
+    int u, v, x, y, sum;
+    // rows; 3 extra fractional bits are kept for the column pass
+    for (v = 0;  v < n;  ++v)
+        for (x = 0;  x < n;  ++x) {
+            for (u = 0, sum = 256;  u < n;  ++u)
+                sum += m[x * n + u] * blk[(v << 3) + u];
+            tmp[v][x] = sum >> 9;
+        }
+    for (y = 0;  y < n;  ++y) {
+        for (x = 0;  x < n;  ++x) {
+            for (v = 0, sum = 16384;  v < n;  ++v)
+                sum += m[y * n + v] * tmp[v][x];
+            out[x] = ujClip((sum >> 15) + 128);
+        }
+        out += stride;
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
-#define ujThrow(e) do { ujError = e; return; } while (0)
-#define ujCheckError() do { if (ujError) return; } while (0)
+// grow v to at least size bytes; buffers are kept at their high-water mark,
+// so decoding another image of the same size doesn't allocate
+static int ujReserve(FCInterface::ByteVector& v, unsigned int size) {
+    if (v.size() >= size) return 1;
+    try {
+        v.resize(size);
+    }
+    catch (...) {
+        return 0;
+    }
+    return 1;
+}
 
-static int ujShowBits(ujContext *uj, int bits) {
-    unsigned char newbyte;
-    if (!bits) return 0;
-    while (uj->bufbits < bits) {
-        if (uj->size <= 0) {
-            uj->buf = (uj->buf << 8) | 0xFF;
-            uj->bufbits += 8;
-            continue;
+#define ujThrow(e) do { uj->error = e; return; } while (0)
+#define ujCheckError() do { if (uj->error) return; } while (0)
+
+// entropy decoding errors are recorded in the scan state, so that restart
+// intervals can be decoded on several threads at once
+#define ujScanThrow(s, e) do { (s)->error = e; return; } while (0)
+
+// Bit reader. The 64-bit reservoir is refilled with whole bytes; runs of
+// bytes without 0xFF are appended directly, four at a time where possible.
+// 0xFF bytes (stuffing and markers) and the end of the data are handled one
+// byte at a time and only once their bits are actually needed, so errors and
+// restart markers are seen exactly where a byte-by-byte reader would see them.
+
+// processes one byte that can't go through the fast path; needs bufbits <= 48
+static void ujFillBitsSlow(ujScanState *s) {
+    unsigned char marker;
+    if (s->size <= 0) {
+        s->buf |= (uint64_t) 0xFF << (56 - s->bufbits);
+        s->bufbits += 8;
+        return;
+    }
+    // *s->pos is 0xFF
+    s->pos++;
+    s->size--;
+    s->buf |= (uint64_t) 0xFF << (56 - s->bufbits);
+    s->bufbits += 8;
+    if (!s->size) {
+        s->error = UJ_SYNTAX_ERROR;
+        return;
+    }
+    marker = *s->pos++;
+    s->size--;
+    switch (marker) {
+        case 0x00:
+        case 0xFF:
+            break;
+        case 0xD9: s->size = 0; break;
+        default:
+            if ((marker & 0xF8) != 0xD0)
+                s->error = UJ_SYNTAX_ERROR;
+            else {
+                s->buf |= (uint64_t) marker << (56 - s->bufbits);
+                s->bufbits += 8;
+            }
+    }
+}
+
+// make at least 'bits' (<= 32) bits available
+static void ujFillBits(ujScanState *s, int bits) {
+    while (s->bufbits <= 56) {
+        if ((s->bufbits <= 32) && (s->size >= 4)) {
+            const uint32_t w = ((uint32_t) s->pos[0] << 24) | ((uint32_t) s->pos[1] << 16)
+                             | ((uint32_t) s->pos[2] << 8) | s->pos[3];
+            if (!((~w - 0x01010101u) & w & 0x80808080u)) {  // no 0xFF byte in w
+                s->buf |= (uint64_t) w << (32 - s->bufbits);
+                s->bufbits += 32;
+                s->pos += 4;
+                s->size -= 4;
+                continue;
+            }
         }
-        newbyte = *uj->pos++;
-        uj->size--;
-        uj->bufbits += 8;
-        uj->buf = (uj->buf << 8) | newbyte;
-        if (newbyte == 0xFF) {
-            if (uj->size) {
-                unsigned char marker = *uj->pos++;
-                uj->size--;
-                switch (marker) {
-                    case 0x00:
-                    case 0xFF:
-                        break;
-                    case 0xD9: uj->size = 0; break;
-                    default:
-                        if ((marker & 0xF8) != 0xD0)
-                            ujError = UJ_SYNTAX_ERROR;
-                        else {
-                            uj->buf = (uj->buf << 8) | marker;
-                            uj->bufbits += 8;
-                        }
-                }
-            } else
-                ujError = UJ_SYNTAX_ERROR;
+        if ((s->size > 0) && (*s->pos != 0xFF)) {
+            s->buf |= (uint64_t) *s->pos++ << (56 - s->bufbits);
+            s->size--;
+            s->bufbits += 8;
+            continue;
         }
+        if (s->bufbits >= bits) return;
+        ujFillBitsSlow(s);
     }
-    return (uj->buf >> (uj->bufbits - bits)) & ((1 << bits) - 1);
 }
 
-UJ_INLINE void ujSkipBits(ujContext *uj, int bits) {
-    if (uj->bufbits < bits)
-        (void) ujShowBits(uj, bits);
-    uj->bufbits -= bits;
+UJ_INLINE int ujShowBits(ujScanState *s, int bits) {
+    if (!bits) return 0;
+    if (s->bufbits < bits) ujFillBits(s, bits);
+    return (int) (s->buf >> (64 - bits));
+}
+
+UJ_INLINE void ujSkipBits(ujScanState *s, int bits) {
+    if (s->bufbits < bits) ujFillBits(s, bits);
+    s->buf <<= bits;
+    s->bufbits -= bits;
 }
 
-UJ_INLINE int ujGetBits(ujContext *uj, int bits) {
-    int res = ujShowBits(uj, bits);
-    ujSkipBits(uj, bits);
+UJ_INLINE int ujGetBits(ujScanState *s, int bits) {
+    int res = ujShowBits(s, bits);
+    ujSkipBits(s, bits);
     return res;
 }
 
-UJ_INLINE void ujByteAlign(ujContext *uj) {
-    uj->bufbits &= 0xF8;
+UJ_INLINE void ujByteAlign(ujScanState *s) {
+    s->buf <<= s->bufbits & 7;
+    s->bufbits &= ~7;
 }
 
 static void ujSkip(ujContext *uj, int count) {
     uj->pos += count;
     uj->size -= count;
     uj->length -= count;
-    if (uj->size < 0) ujError = UJ_SYNTAX_ERROR;
+    if (uj->size < 0) uj->error = UJ_SYNTAX_ERROR;
 }
 
 UJ_INLINE unsigned short ujDecode16(const unsigned char *pos) {
@@ -287,7 +724,8 @@ UJ_INLINE void ujSkipMarker(ujContext *uj) {
 }
 
 UJ_INLINE void ujDecodeSOF(ujContext *uj) {
-    int i, ssxmax = 0, ssymax = 0, size;
+    int i, ssxmax = 0, ssymax = 0, size, x0, y0, x1, y1, w, h, maxscale = 3, small, mx, my, picw, pich;
+    unsigned int maxw = uj->maxWidth, maxh = uj->maxHeight;
     ujComponent* c;
     ujDecodeLength(uj);
     ujCheckError();
@@ -296,9 +734,6 @@ UJ_INLINE void ujDecodeSOF(ujContext *uj) {
     uj->height = ujDecode16(uj->pos+1);
     uj->width = ujDecode16(uj->pos+3);
     if (!uj->width || !uj->height) ujThrow(UJ_SYNTAX_ERROR);
-	if ((uj->maxWidth > 0 && uj->width > uj->maxWidth) || (uj->maxHeight > 0 && uj->height > uj->maxHeight)) {
-		ujThrow(UJ_DIMENSIONS_EXCEEDED);
-	}
 
     uj->ncomp = uj->pos[5];
     ujSkip(uj, 6);
@@ -330,19 +765,96 @@ UJ_INLINE void ujDecodeSOF(ujContext *uj) {
     uj->mbsizey = ssymax << 3;
     uj->mbwidth = (uj->width + uj->mbsizex - 1) / uj->mbsizex;
     uj->mbheight = (uj->height + uj->mbsizey - 1) / uj->mbsizey;
+	// region of interest, in full-size pixels: the crop rectangle with its
+	// origin moved to a macroblock boundary
+	x0 = y0 = 0;
+	x1 = uj->width;
+	y1 = uj->height;
+	if (uj->cropw > 0 && uj->croph > 0) {
+		if (uj->cropx >= uj->width || uj->cropy >= uj->height) ujThrow(UJ_INVALID_ARG);
+		x0 = uj->cropx / uj->mbsizex * uj->mbsizex;
+		y0 = uj->cropy / uj->mbsizey * uj->mbsizey;
+		if (uj->cropx + uj->cropw < uj->width) x1 = uj->cropx + uj->cropw;
+		if (uj->cropy + uj->croph < uj->height) y1 = uj->cropy + uj->croph;
+	}
+	// the limits are meant for the picture as it will be shown; the Exif
+	// segment comes before the frame header, so the orientation is known
+	if (uj->auto_orient && (uj->orientation >= 5)) {
+		maxw = uj->maxHeight;
+		maxh = uj->maxWidth;
+	}
+	for (;;) {
+		int growx = 0, growy = 0;
+		// images (or regions) over the maximum size are decoded at the largest
+		// of 1/2, 1/4 or 1/8 scale that fits, using reduced IDCTs
+		uj->scale = 0;
+		while ((maxw > 0 && (unsigned int) ((x1 - x0 + (1 << uj->scale) - 1) >> uj->scale) > maxw) ||
+			   (maxh > 0 && (unsigned int) ((y1 - y0 + (1 << uj->scale) - 1) >> uj->scale) > maxh)) {
+			if (uj->scale == 3)
+				ujThrow(UJ_DIMENSIONS_EXCEEDED);
+			if (uj->scale == maxscale)
+				break;
+			++uj->scale;
+		}
+		w = (x1 - x0 + (1 << uj->scale) - 1) >> uj->scale;
+		h = (y1 - y0 + (1 << uj->scale) - 1) >> uj->scale;
+		// the chroma upsamplers need at least 3 samples; a region that is too
+		// small is grown by a macroblock to the right/bottom (or left/top)
+		for (i = 1, c = &uj->comp[1];  i < uj->ncomp;  ++i, ++c) {
+			if (((w * c->ssx + ssxmax - 1) / ssxmax < 3) && (c->ssx != ssxmax)) growx = 1;
+			if (((h * c->ssy + ssymax - 1) / ssymax < 3) && (c->ssy != ssymax)) growy = 1;
+		}
+		small = growx || growy;
+		if (growx && (x1 < uj->width))
+			x1 = (x1 / uj->mbsizex + 1) * uj->mbsizex;
+		else if (growx && (x0 > 0))
+			x0 -= uj->mbsizex;
+		else
+			growx = 0;
+		if (growy && (y1 < uj->height))
+			y1 = (y1 / uj->mbsizey + 1) * uj->mbsizey;
+		else if (growy && (y0 > 0))
+			y0 -= uj->mbsizey;
+		else
+			growy = 0;
+		if (x1 > uj->width) x1 = uj->width;
+		if (y1 > uj->height) y1 = uj->height;
+		if (!growx && !growy) {
+			// the whole picture is too small for the chroma at this scale: use the
+			// smallest scale that leaves enough samples, even if it exceeds the limits
+			if (small && (uj->scale > 0)) {
+				maxscale = uj->scale - 1;
+				continue;
+			}
+			break;
+		}
+	}
+	// subsampled chroma along the region's right and bottom edges is upsampled
+	// from the samples past them, as in a full decode, so a few more are decoded
+	mx = (ssxmax > 1) ? ((5 * ssxmax) << uj->scale) : 0;
+	my = (ssymax > 1) ? ((5 * ssymax) << uj->scale) : 0;
+	uj->mbx0 = x0 / uj->mbsizex;
+	uj->mby0 = y0 / uj->mbsizey;
+	uj->mbx1 = (((x1 + mx < uj->width) ? (x1 + mx) : uj->width) + uj->mbsizex - 1) / uj->mbsizex;
+	uj->mby1 = (((y1 + my < uj->height) ? (y1 + my) : uj->height) + uj->mbsizey - 1) / uj->mbsizey;
+	picw = (uj->width + (1 << uj->scale) - 1) >> uj->scale;
+	pich = (uj->height + (1 << uj->scale) - 1) >> uj->scale;
+	// from here on, width and height are the (scaled) output dimensions
+	uj->width = w;
+	uj->height = h;
+	uj->originx = x0 >> uj->scale;
+	uj->originy = y0 >> uj->scale;
     for (i = 0, c = uj->comp;  i < uj->ncomp;  ++i, ++c) {
         c->width = (uj->width * c->ssx + ssxmax - 1) / ssxmax;
         c->height = (uj->height * c->ssy + ssymax - 1) / ssymax;
-        c->stride = uj->mbwidth * c->ssx << 3;
+        c->picw = (picw * c->ssx + ssxmax - 1) / ssxmax - ((uj->mbx0 * c->ssx) << (3 - uj->scale));
+        c->pich = (pich * c->ssy + ssymax - 1) / ssymax - ((uj->mby0 * c->ssy) << (3 - uj->scale));
+        c->stride = (uj->mbx1 - uj->mbx0) * c->ssx << (3 - uj->scale);
         if (((c->width < 3) && (c->ssx != ssxmax)) || ((c->height < 3) && (c->ssy != ssymax))) ujThrow(UJ_UNSUPPORTED);
         if (!uj->no_decode) {
-            size = c->stride * uj->mbheight * c->ssy << 3;
-			try {
-				c->pixels.resize(size); //TODO - was zeroing - still needed?
-			}
-			catch (...) {
+            size = c->stride * (uj->mby1 - uj->mby0) * c->ssy << (3 - uj->scale);
+			if (!ujReserve(c->pixels, size)) //TODO - was zeroing - still needed?
 				ujThrow(UJ_OUT_OF_MEM);
-			}
 
         }
     }
@@ -350,46 +862,114 @@ UJ_INLINE void ujDecodeSOF(ujContext *uj) {
 }
 
 UJ_INLINE void ujDecodeDHT(ujContext *uj) {
-    int codelen, currcnt, remain, spread, i, j;
+    int codelen, currcnt, remain, spread, nvalues, code, i, j, tab, deflen;
+    ujHuffTable *huff;
     ujVLCCode *vlc;
-    static unsigned char counts[16];
+    const unsigned char *def;
+    unsigned char counts[16];
     ujDecodeLength(uj);
     ujCheckError();
     while (uj->length >= 17) {
         i = uj->pos[0];
         if (i & 0xEC) ujThrow(UJ_SYNTAX_ERROR);
         if (i & 0x02) ujThrow(UJ_UNSUPPORTED);
-        i = (i | (i >> 3)) & 3;  // combined DC/AC + tableid value
+        tab = (i | (i >> 3)) & 3;  // combined DC/AC + tableid value
+        def = uj->pos;
+        deflen = 17;
         for (codelen = 1;  codelen <= 16;  ++codelen)
-            counts[codelen - 1] = uj->pos[codelen];
+            deflen += counts[codelen - 1] = uj->pos[codelen];
+        // Motion-JPEG frames usually repeat the same tables; don't rebuild them
+        if ((deflen == uj->vlcdeflen[tab]) && (deflen <= uj->length) && !memcmp(def, uj->vlcdef[tab], deflen)) {
+            ujSkip(uj, deflen);
+            continue;
+        }
+        uj->vlcdeflen[tab] = 0;
         ujSkip(uj, 17);
-        vlc = &uj->vlctab[i][0];
-        remain = spread = 65536;
-        for (codelen = 1;  codelen <= 16;  ++codelen) {
+        huff = &uj->vlctab[tab];
+        vlc = huff->fast;
+        remain = 65536;
+        spread = 1 << UJ_VLC_FAST_BITS;
+        nvalues = code = 0;
+        for (codelen = 1;  codelen <= 16;  ++codelen, code <<= 1) {
             spread >>= 1;
             currcnt = counts[codelen - 1];
-            if (!currcnt) continue;
-            if (uj->length < currcnt) ujThrow(UJ_SYNTAX_ERROR);
-            remain -= currcnt << (16 - codelen);
-            if (remain < 0) ujThrow(UJ_SYNTAX_ERROR);
-            for (i = 0;  i < currcnt;  ++i) {
-                register unsigned char code = uj->pos[i];
-                for (j = spread;  j;  --j) {
-                    vlc->bits = (unsigned char) codelen;
-                    vlc->code = code;
-                    ++vlc;
+            huff->delta[codelen] = nvalues - code;
+            if (currcnt) {
+                if (uj->length < currcnt) ujThrow(UJ_SYNTAX_ERROR);
+                remain -= currcnt << (16 - codelen);
+                if (remain < 0) ujThrow(UJ_SYNTAX_ERROR);
+                if (nvalues + currcnt > 256) ujThrow(UJ_SYNTAX_ERROR);
+                for (i = 0;  i < currcnt;  ++i) {
+                    register unsigned char value = uj->pos[i];
+                    huff->values[nvalues++] = value;
+                    if (codelen <= UJ_VLC_FAST_BITS)
+                        for (j = spread;  j;  --j) {
+                            vlc->bits = (unsigned char) codelen;
+                            vlc->code = value;
+                            ++vlc;
+                        }
                 }
+                code += currcnt;
+                ujSkip(uj, currcnt);
             }
-            ujSkip(uj, currcnt);
+            huff->maxcode[codelen] = (unsigned int) code << (16 - codelen);
         }
-        while (remain--) {
+        while (vlc < &huff->fast[1 << UJ_VLC_FAST_BITS]) {
             vlc->bits = 0;
             ++vlc;
         }
+        if (deflen <= (int) sizeof(uj->vlcdef[tab])) {
+            memcpy(uj->vlcdef[tab], def, deflen);
+            uj->vlcdeflen[tab] = deflen;
+        }
     }
     if (uj->length) ujThrow(UJ_SYNTAX_ERROR);
 }
 
+// the Huffman tables of JPEG Annex K.3, as a DHT segment; Motion-JPEG frames
+// (AVI "MJPG", most webcams) leave them out and expect these
+static const unsigned char ujDefaultDHT[] = {
+    0x01, 0xA2,
+    0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,
+    0x01, 0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,
+    0x10, 0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00, 0x01, 0x7D,
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+    0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+    0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+    0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA,
+    0x11, 0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04, 0x04, 0x00, 0x01, 0x02, 0x77,
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+    0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+    0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+    0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+    0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+    0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA,
+};
+
+static void ujLoadDefaultDHT(ujContext *uj) {
+    const unsigned char *pos = uj->pos;
+    int size = uj->size;
+    uj->pos = ujDefaultDHT;
+    uj->size = (int) sizeof(ujDefaultDHT);
+    ujDecodeDHT(uj);
+    uj->pos = pos;
+    uj->size = size;
+}
+
 UJ_INLINE void ujDecodeDQT(ujContext *uj) {
     int i;
     unsigned char *t;
@@ -415,45 +995,199 @@ UJ_INLINE void ujDecodeDRI(ujContext *uj) {
     ujSkip(uj, uj->length);
 }
 
-static int ujGetVLC(ujContext *uj, ujVLCCode* vlc, unsigned char* code) {
-    int value = ujShowBits(uj, 16);
-    int bits = vlc[value].bits;
-    if (!bits) { ujError = UJ_SYNTAX_ERROR; return 0; }
-    ujSkipBits(uj, bits);
-    value = vlc[value].code;
+static int ujGetVLC(ujScanState *s, const ujHuffTable* huff, unsigned char* code) {
+    int value = ujShowBits(s, 16);
+    const ujVLCCode *vlc = &huff->fast[value >> (16 - UJ_VLC_FAST_BITS)];
+    int bits = vlc->bits;
+    if (bits)
+        value = vlc->code;
+    else {
+        for (bits = UJ_VLC_FAST_BITS + 1;  (bits <= 16) && ((unsigned int) value >= huff->maxcode[bits]);  ++bits);
+        if (bits > 16) { s->error = UJ_SYNTAX_ERROR; return 0; }
+        value = huff->values[(value >> (16 - bits)) + huff->delta[bits]];
+    }
+    ujSkipBits(s, bits);
     if (code) *code = (unsigned char) value;
     bits = value & 15;
     if (!bits) return 0;
-    value = ujGetBits(uj, bits);
+    value = ujGetBits(s, bits);
     if (value < (1 << (bits - 1)))
         value += ((-1) << bits) + 1;
     return value;
 }
 
-UJ_INLINE void ujDecodeBlock(ujContext *uj, ujComponent* c, unsigned char* out) {
+UJ_INLINE void ujDecodeBlock(ujContext *uj, ujScanState *s, ujComponent* c, unsigned char* out) {
     unsigned char code = 0;
-    int value, coef = 0;
-    memset(uj->block, 0, sizeof(uj->block));
-    c->dcpred += ujGetVLC(uj, &uj->vlctab[c->dctabsel][0], NULL);
-    uj->block[0] = (c->dcpred) * uj->qtab[c->qtsel][0];
+    int value, coef = 0, ac = 0;
+    int *dcpred = &s->dcpred[c - uj->comp];
+    memset(s->block, 0, sizeof(s->block));
+    *dcpred += ujGetVLC(s, &uj->vlctab[c->dctabsel], NULL);
+    s->block[0] = (*dcpred) * uj->qtab[c->qtsel][0];
     do {
-        value = ujGetVLC(uj, &uj->vlctab[c->actabsel][0], &code);
+        value = ujGetVLC(s, &uj->vlctab[c->actabsel], &code);
         if (!code) break;  // EOB
-        if (!(code & 0x0F) && (code != 0xF0)) ujThrow(UJ_SYNTAX_ERROR);
+        if (!(code & 0x0F) && (code != 0xF0)) ujScanThrow(s, UJ_SYNTAX_ERROR);
         coef += (code >> 4) + 1;
-        if (coef > 63) ujThrow(UJ_SYNTAX_ERROR);
-        uj->block[(int) ujZZ[coef]] = value * uj->qtab[c->qtsel][coef];
+        if (coef > 63) ujScanThrow(s, UJ_SYNTAX_ERROR);
+        ac |= s->block[(int) ujZZ[coef]] = value * uj->qtab[c->qtsel][coef];
     } while (coef < 63);
-    for (coef = 0;  coef < 64;  coef += 8)
-        ujRowIDCT(&uj->block[coef]);
-    for (coef = 0;  coef < 8;  ++coef)
-        ujColIDCT(&uj->block[coef], &out[coef], c->stride);
+    if (!ac || (uj->scale == 3)) {
+        // DC-only block (or 1/8 scale): every output pixel has the same value
+        const int n = 8 >> uj->scale;
+        value = ujClip((((s->block[0] << 3) + 32) >> 6) + 128);
+        for (coef = 0;  coef < n;  ++coef)
+            memset(&out[coef * c->stride], value, n);
+        return;
+    }
+    if (uj->scale)
+        ujIDCTReduced(s->block, out, c->stride, 8 >> uj->scale);
+    else
+        ujIDCT(s->block, out, c->stride);
+}
+
+// entropy decode a block outside the region of interest; only the DC
+// predictor is kept
+UJ_INLINE void ujSkipBlock(ujContext *uj, ujScanState *s, ujComponent* c) {
+    unsigned char code = 0;
+    int coef = 0;
+    s->dcpred[c - uj->comp] += ujGetVLC(s, &uj->vlctab[c->dctabsel], NULL);
+    do {
+        ujGetVLC(s, &uj->vlctab[c->actabsel], &code);
+        if (!code) break;  // EOB
+        if (!(code & 0x0F) && (code != 0xF0)) ujScanThrow(s, UJ_SYNTAX_ERROR);
+        coef += (code >> 4) + 1;
+        if (coef > 63) ujScanThrow(s, UJ_SYNTAX_ERROR);
+    } while (coef < 63);
+}
+
+// decode all blocks of macroblock number mb (in raster order)
+UJ_INLINE void ujDecodeMCU(ujContext *uj, ujScanState *s, int mb) {
+    const int mbx = mb % uj->mbwidth, mby = mb / uj->mbwidth;
+    const int inside = (mbx >= uj->mbx0) && (mbx < uj->mbx1) && (mby >= uj->mby0) && (mby < uj->mby1);
+    int i, sbx, sby;
+    ujComponent* c;
+    for (i = 0, c = uj->comp;  i < uj->ncomp;  ++i, ++c)
+        for (sby = 0;  sby < c->ssy;  ++sby)
+            for (sbx = 0;  sbx < c->ssx;  ++sbx) {
+                if (inside)
+                    ujDecodeBlock(uj, s, c, &c->pixels[(((mby - uj->mby0) * c->ssy + sby) * c->stride
+                                                        + (mbx - uj->mbx0) * c->ssx + sbx) << (3 - uj->scale)]);
+                else
+                    ujSkipBlock(uj, s, c);
+                if (s->error) return;
+            }
+}
+
+// fill the macroblocks mbfrom..mbto-1 (raster order) of the region of interest
+// with grey; a scan that stops early leaves them unwritten, and the planes are
+// reused, so they would show the previous image
+static void ujClearMCUs(ujContext *uj, int mbfrom, int mbto) {
+    int mb, i, y;
+    ujComponent* c;
+    for (mb = mbfrom;  mb < mbto;  ++mb) {
+        const int mbx = mb % uj->mbwidth, mby = mb / uj->mbwidth;
+        if ((mbx < uj->mbx0) || (mbx >= uj->mbx1) || (mby < uj->mby0) || (mby >= uj->mby1)) continue;
+        for (i = 0, c = uj->comp;  i < uj->ncomp;  ++i, ++c) {
+            unsigned char *out = &c->pixels[((mby - uj->mby0) * c->ssy * c->stride + (mbx - uj->mbx0) * c->ssx) << (3 - uj->scale)];
+            for (y = 0;  y < (c->ssy << (3 - uj->scale));  ++y)
+                memset(&out[y * c->stride], 128, c->ssx << (3 - uj->scale));
+        }
+    }
+}
+
+// Parallel restart interval decoding. Each restart interval is an
+// independent entropy-coded segment (the DC predictors are reset at every
+// RSTn marker), so once the marker positions are known, the intervals can be
+// decoded by several threads; each one writes a disjoint set of macroblocks.
+
+typedef struct _uj_rst_job {
+    ujContext *uj;
+    const unsigned char **segments;  // segment i spans segments[i]..segments[i+1]
+    int nsegments;
+    volatile int next;               // next segment to be decoded
+    ujResult *errors;                // per segment
+} ujRestartJob;
+
+static void* ujRestartWorker(void *arg) {
+    ujRestartJob *job = (ujRestartJob*) arg;
+    ujContext *uj = job->uj;
+    const int mbcount = uj->mbwidth * uj->mbheight;
+    ujScanState s;
+    int seg, mb, mbend;
+    while ((seg = __sync_fetch_and_add(&job->next, 1)) < job->nsegments) {
+        if (((seg + 1) * uj->rstinterval <= uj->mby0 * uj->mbwidth) || (seg * uj->rstinterval >= uj->mby1 * uj->mbwidth)) {
+            job->errors[seg] = UJ_OK;  // no macroblock of the region of interest
+            continue;
+        }
+        memset(&s, 0, sizeof(s));
+        s.pos = job->segments[seg];
+        s.size = (int) (job->segments[seg + 1] - job->segments[seg]);
+        if (seg + 1 < job->nsegments) s.size -= 2;  // the RSTn marker itself
+        mbend = (seg + 1) * uj->rstinterval;
+        if (mbend > mbcount) mbend = mbcount;
+        for (mb = seg * uj->rstinterval;  (mb < mbend) && !s.error;  ++mb)
+            ujDecodeMCU(uj, &s, mb);
+        if (s.error) ujClearMCUs(uj, mb - 1, mbend);
+        job->errors[seg] = s.error;
+    }
+    return NULL;
+}
+
+// try to decode the scan starting at uj->pos in parallel; returns 0 if the
+// restart markers don't match the expected layout, in which case the
+// sequential decoder should be used
+static int ujDecodeScanParallel(ujContext *uj) {
+    const int mbcount = uj->mbwidth * uj->mbheight;
+    const int nsegments = (mbcount + uj->rstinterval - 1) / uj->rstinterval;
+    const unsigned char *p = uj->pos, *end = uj->pos + uj->size;
+    ujRestartJob job;
+    pthread_t threads[UJ_MAX_THREADS];
+    int i, nthreads, started = 0;
+    if (nsegments < 2) return 0;
+    if (!ujReserve(uj->scratch, (nsegments + 1) * sizeof(const unsigned char*) + nsegments * sizeof(ujResult)))
+        return 0;
+    job.uj = uj;
+    job.segments = (const unsigned char**) uj->scratch.buffer();
+    job.errors = (ujResult*) (uj->scratch.buffer() + (nsegments + 1) * sizeof(const unsigned char*));
+    job.nsegments = nsegments;
+    job.next = 0;
+    job.segments[0] = p;
+    // locate the RSTn markers; any other marker ends the entropy-coded data
+    for (i = 1;  p + 1 < end;  ) {
+        if (p[0] != 0xFF) { ++p;  continue; }
+        if (!p[1] || (p[1] == 0xFF)) { p += 2;  continue; }
+        if ((p[1] & 0xF8) != 0xD0) break;
+        if ((i >= nsegments) || ((p[1] & 7) != ((i - 1) & 7))) return 0;
+        p += 2;
+        job.segments[i++] = p;
+    }
+    if (i != nsegments) return 0;
+    job.segments[nsegments] = p;
+    nthreads = (uj->threads < nsegments) ? uj->threads : nsegments;
+    if (nthreads > UJ_MAX_THREADS) nthreads = UJ_MAX_THREADS;
+    for (i = 1;  i < nthreads;  ++i)
+        if (!pthread_create(&threads[started], NULL, ujRestartWorker, &job))
+            ++started;
+    ujRestartWorker(&job);
+    for (i = 0;  i < started;  ++i)
+        pthread_join(threads[i], NULL);
+    uj->size -= (int) (p - uj->pos);
+    uj->pos = p;
+    // report the first error in stream order, as the sequential decoder would
+    uj->error = __UJ_FINISHED;
+    for (i = 0;  i < nsegments;  ++i)
+        if (job.errors[i]) {
+            uj->error = job.errors[i];
+            break;
+        }
+    return 1;
 }
 
 UJ_INLINE void ujDecodeScan(ujContext *uj) {
-    int i, mbx, mby, sbx, sby;
+    int i, mb, mbcount;
     int rstcount = uj->rstinterval, nextrst = 0;
     ujComponent* c;
+    ujScanState s;
     ujDecodeLength(uj);
     ujCheckError();
     if (uj->length < (4 + 2 * uj->ncomp)) ujThrow(UJ_SYNTAX_ERROR);
@@ -469,33 +1203,39 @@ UJ_INLINE void ujDecodeScan(ujContext *uj) {
     if (uj->pos[0] || (uj->pos[1] != 63) || uj->pos[2]) ujThrow(UJ_UNSUPPORTED);
     ujSkip(uj, uj->length);
     uj->valid = 1;
-    if (uj->no_decode) { ujError = __UJ_FINISHED; return; }
+    if (uj->no_decode) { uj->error = __UJ_FINISHED; return; }
     uj->decoded = 1;  // mark the image as decoded now -- every subsequent error
                       // just means that the image hasn't been decoded
                       // completely
-    for (mbx = mby = 0;;) {
-        for (i = 0, c = uj->comp;  i < uj->ncomp;  ++i, ++c)
-            for (sby = 0;  sby < c->ssy;  ++sby)
-                for (sbx = 0;  sbx < c->ssx;  ++sbx) {
-                    ujDecodeBlock(uj, c, &c->pixels[((mby * c->ssy + sby) * c->stride + mbx * c->ssx + sbx) << 3]);
-                    ujCheckError();
-                }
-        if (++mbx >= uj->mbwidth) {
-            mbx = 0;
-            if (++mby >= uj->mbheight) break;
-        }
+    // with restart markers, intervals outside the region of interest can be
+    // skipped without entropy decoding them, even on a single thread
+    if (uj->rstinterval && ((uj->threads > 1) || uj->mby0 || (uj->mby1 < uj->mbheight)) && ujDecodeScanParallel(uj))
+        return;
+    memset(&s, 0, sizeof(s));
+    s.pos = uj->pos;
+    s.size = uj->size;
+    mbcount = uj->mby1 * uj->mbwidth;  // nothing below the region is needed
+    for (mb = 0;;) {
+        ujDecodeMCU(uj, &s, mb);
+        if (s.error) break;
+        if (++mb >= mbcount) break;
         if (uj->rstinterval && !(--rstcount)) {
-            ujByteAlign(uj);
-            i = ujGetBits(uj, 16);
-            if (((i & 0xFFF8) != 0xFFD0) || ((i & 7) != nextrst))
-                ujThrow(UJ_SYNTAX_ERROR);
+            ujByteAlign(&s);
+            i = ujGetBits(&s, 16);
+            if (((i & 0xFFF8) != 0xFFD0) || ((i & 7) != nextrst)) {
+                s.error = UJ_SYNTAX_ERROR;
+                break;
+            }
             nextrst = (nextrst + 1) & 7;
             rstcount = uj->rstinterval;
             for (i = 0;  i < 3;  ++i)
-                uj->comp[i].dcpred = 0;
+                s.dcpred[i] = 0;
         }
     }
-    ujError = __UJ_FINISHED;
+    if (s.error) ujClearMCUs(uj, mb, mbcount);
+    uj->pos = s.pos;
+    uj->size = s.size;
+    uj->error = s.error ? s.error : __UJ_FINISHED;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -514,13 +1254,44 @@ UJ_INLINE void ujDecodeScan(ujContext *uj) {
 #define CF2B (-11)
 #define CF(x) ujClip(((x) + 64) >> 7)
 
-UJ_INLINE void ujUpsampleHCentered(ujComponent* c) {
-    const int xmax = c->width - 3;
+// the samples of a line (or column) of a region that are upsampled: n for a
+// region that ends at the picture's edge (pic == n), otherwise 3 more, so the
+// region's last outputs are interpolated from the real samples past it, like in
+// a full decode, and the edge filters only touch outputs nobody uses. A pass
+// carries the extra samples of the other direction along if that is upsampled
+// later.
+UJ_INLINE int ujUpsampleSpan(int n, int pic) {
+    return (pic < n + 3) ? pic : (n + 3);
+}
+
+// upsample one line of 'width' samples to 2 * width; the right edge is taken
+// from the end of the line's stride, as the full-plane pass always did, which
+// matters only at the picture's edge (see ujUpsampleSpan())
+UJ_INLINE void ujUpsampleLineHCentered(const unsigned char *lin, int width, int stride, unsigned char *lout) {
+    const int xmax = width - 3;
+    int x;
+    lout[0] = CF(CF2A * lin[0] + CF2B * lin[1]);
+    lout[1] = CF(CF3X * lin[0] + CF3Y * lin[1] + CF3Z * lin[2]);
+    lout[2] = CF(CF3A * lin[0] + CF3B * lin[1] + CF3C * lin[2]);
+    for (x = 0;  x < xmax;  ++x) {
+        lout[(x << 1) + 3] = CF(CF4A * lin[x] + CF4B * lin[x + 1] + CF4C * lin[x + 2] + CF4D * lin[x + 3]);
+        lout[(x << 1) + 4] = CF(CF4D * lin[x] + CF4C * lin[x + 1] + CF4B * lin[x + 2] + CF4A * lin[x + 3]);
+    }
+    lin += stride;
+    lout += width << 1;
+    lout[-3] = CF(CF3A * lin[-1] + CF3B * lin[-2] + CF3C * lin[-3]);
+    lout[-2] = CF(CF3X * lin[-1] + CF3Y * lin[-2] + CF3Z * lin[-3]);
+    lout[-1] = CF(CF2A * lin[-1] + CF2B * lin[-2]);
+}
+
+UJ_INLINE void ujUpsampleHCentered(ujContext *uj, ujComponent* c) {
     unsigned char *lin, *lout;
 	FCInterface::ByteVector out;
-    int x, y;
+    const int w = ujUpsampleSpan(c->width, c->picw);
+    const int h = (c->height < uj->height) ? ujUpsampleSpan(c->height, c->pich) : c->height;
+    int y;
 	try {
-		out.resize((c->width * c->height) << 1);
+		out.resize((w * h) << 1);
 	}
 	catch (...)
 	{
@@ -529,34 +1300,28 @@ UJ_INLINE void ujUpsampleHCentered(ujComponent* c) {
 
     lin =& c->pixels[0];
     lout = &out[0];
-    for (y = c->height;  y;  --y) {
-        lout[0] = CF(CF2A * lin[0] + CF2B * lin[1]);
-        lout[1] = CF(CF3X * lin[0] + CF3Y * lin[1] + CF3Z * lin[2]);
-        lout[2] = CF(CF3A * lin[0] + CF3B * lin[1] + CF3C * lin[2]);
-        for (x = 0;  x < xmax;  ++x) {
-            lout[(x << 1) + 3] = CF(CF4A * lin[x] + CF4B * lin[x + 1] + CF4C * lin[x + 2] + CF4D * lin[x + 3]);
-            lout[(x << 1) + 4] = CF(CF4D * lin[x] + CF4C * lin[x + 1] + CF4B * lin[x + 2] + CF4A * lin[x + 3]);
-        }
+    for (y = h;  y;  --y) {
+        ujUpsampleLineHCentered(lin, w, c->stride, lout);
         lin += c->stride;
-        lout += c->width << 1;
-        lout[-3] = CF(CF3A * lin[-1] + CF3B * lin[-2] + CF3C * lin[-3]);
-        lout[-2] = CF(CF3X * lin[-1] + CF3Y * lin[-2] + CF3Z * lin[-3]);
-        lout[-1] = CF(CF2A * lin[-1] + CF2B * lin[-2]);
+        lout += w << 1;
     }
     c->width <<= 1;
-    c->stride = c->width;
+    c->picw <<= 1;
+    c->stride = w << 1;
 
 	c->pixels.swap(out);
 }
 
-UJ_INLINE void ujUpsampleVCentered(ujComponent* c) {
-    const int w = c->width, s1 = c->stride, s2 = s1 + s1;
+UJ_INLINE void ujUpsampleVCentered(ujContext *uj, ujComponent* c) {
+    const int w = (c->width < uj->width) ? ujUpsampleSpan(c->width, c->picw) : c->width;
+    const int h = ujUpsampleSpan(c->height, c->pich);
+    const int s1 = c->stride, s2 = s1 + s1;
     unsigned char *cin, *cout;
 	int x, y; 
 	
 	FCInterface::ByteVector out;
 	try {
-		out.resize((c->width * c->height) << 1);
+		out.resize((w * h) << 1);
 	}
 	catch (...)
 	{
@@ -570,7 +1335,7 @@ UJ_INLINE void ujUpsampleVCentered(ujComponent* c) {
         *cout = CF(CF3X * cin[0] + CF3Y * cin[s1] + CF3Z * cin[s2]);  cout += w;
         *cout = CF(CF3A * cin[0] + CF3B * cin[s1] + CF3C * cin[s2]);  cout += w;
         cin += s1;
-        for (y = c->height - 3;  y;  --y) {
+        for (y = h - 3;  y;  --y) {
             *cout = CF(CF4A * cin[-s1] + CF4B * cin[0] + CF4C * cin[s1] + CF4D * cin[s2]);  cout += w;
             *cout = CF(CF4D * cin[-s1] + CF4C * cin[0] + CF4B * cin[s1] + CF4A * cin[s2]);  cout += w;
             cin += s1;
@@ -581,20 +1346,39 @@ UJ_INLINE void ujUpsampleVCentered(ujComponent* c) {
         *cout = CF(CF2A * cin[0] + CF2B * cin[-s1]);
     }
     c->height <<= 1;
-    c->stride = c->width;
+    c->pich <<= 1;
+    c->stride = w;
 
     c->pixels.swap(out);
 }
 
 #define SF(x) ujClip(((x) + 8) >> 4)
 
-UJ_INLINE void ujUpsampleHCoSited(ujComponent* c) {
-    const int xmax = c->width - 1;
+UJ_INLINE void ujUpsampleLineHCoSited(const unsigned char *lin, int width, int stride, unsigned char *lout) {
+    const int xmax = width - 1;
+    int x;
+    lout[0] = lin[0];
+    lout[1] = SF((lin[0] << 3) + 9 * lin[1] - lin[2]);
+    lout[2] = lin[1];
+    for (x = 2;  x < xmax;  ++x) {
+        lout[(x << 1) - 1] = SF(9 * (lin[x-1] + lin[x]) - (lin[x-2] + lin[x+1]));
+        lout[x << 1] = lin[x];
+    }
+    lin += stride;
+    lout += width << 1;
+    lout[-3] = SF((lin[-1] << 3) + 9 * lin[-2] - lin[-3]);
+    lout[-2] = lin[-1];
+    lout[-1] = SF(17 * lin[-1] - lin[-2]);
+}
+
+UJ_INLINE void ujUpsampleHCoSited(ujContext *uj, ujComponent* c) {
     unsigned char *lin, *lout;
-    int x, y;
+    const int w = ujUpsampleSpan(c->width, c->picw);
+    const int h = (c->height < uj->height) ? ujUpsampleSpan(c->height, c->pich) : c->height;
+    int y;
 	FCInterface::ByteVector out;
 	try {
-		out.resize((c->width * c->height) << 1);
+		out.resize((w * h) << 1);
 	}
 	catch (...)
 	{
@@ -602,32 +1386,26 @@ UJ_INLINE void ujUpsampleHCoSited(ujComponent* c) {
 	}
     lin = &c->pixels[0];
     lout = &out[0];
-    for (y = c->height;  y;  --y) {
-        lout[0] = lin[0];
-        lout[1] = SF((lin[0] << 3) + 9 * lin[1] - lin[2]);
-        lout[2] = lin[1];
-        for (x = 2;  x < xmax;  ++x) {
-            lout[(x << 1) - 1] = SF(9 * (lin[x-1] + lin[x]) - (lin[x-2] + lin[x+1]));
-            lout[x << 1] = lin[x];
-        }
+    for (y = h;  y;  --y) {
+        ujUpsampleLineHCoSited(lin, w, c->stride, lout);
         lin += c->stride;
-        lout += c->width << 1;
-        lout[-3] = SF((lin[-1] << 3) + 9 * lin[-2] - lin[-3]);
-        lout[-2] = lin[-1];
-        lout[-1] = SF(17 * lin[-1] - lin[-2]);
+        lout += w << 1;
     }
     c->width <<= 1;
-    c->stride = c->width;
+    c->picw <<= 1;
+    c->stride = w << 1;
 	c->pixels.swap(out);
 }
 
-UJ_INLINE void ujUpsampleVCoSited(ujComponent* c) {
-    const int w = c->width, s1 = c->stride, s2 = s1 + s1;
+UJ_INLINE void ujUpsampleVCoSited(ujContext *uj, ujComponent* c) {
+    const int w = (c->width < uj->width) ? ujUpsampleSpan(c->width, c->picw) : c->width;
+    const int h = ujUpsampleSpan(c->height, c->pich);
+    const int s1 = c->stride, s2 = s1 + s1;
     unsigned char *cin, *cout;
     int x, y;
 	FCInterface::ByteVector out;
 	try {
-		out.resize((c->width * c->height) << 1);
+		out.resize((w * h) << 1);
 	}
 	catch (...)
 	{
@@ -640,7 +1418,7 @@ UJ_INLINE void ujUpsampleVCoSited(ujComponent* c) {
         *cout = SF((cin[0] << 3) + 9 * cin[s1] - cin[s2]);  cout += w;
         *cout = cin[s1];  cout += w;
         cin += s1;
-        for (y = c->height - 3;  y;  --y) {
+        for (y = h - 3;  y;  --y) {
             *cout = SF(9 * (cin[0] + cin[s1]) - (cin[-s1] + cin[s2]));  cout += w;
             *cout = cin[s1];  cout += w;
             cin += s1;
@@ -650,7 +1428,8 @@ UJ_INLINE void ujUpsampleVCoSited(ujComponent* c) {
         *cout = SF(17 * cin[s1] - cin[0]);
     }
     c->height <<= 1;
-    c->stride = c->width;
+    c->pich <<= 1;
+    c->stride = w;
 
     c->pixels.swap(out);
 }
@@ -682,9 +1461,415 @@ UJ_INLINE void ujUpsampleFast(ujContext *uj, ujComponent* c) {
     c->pixels.swap(out);
 }
 
-UJ_INLINE void ujConvert(ujContext *uj, unsigned char *pout) {
+// Streaming chroma upsampling and color conversion: instead of upsampling the
+// complete Cb and Cr planes (one new full-size plane per pass) and converting
+// afterwards, each output line is produced from a handful of cached chroma
+// lines. The arithmetic is identical to the full-plane passes above.
+
+// vertical filter taps for output line j of a component with n input lines,
+// expressed in the CF() domain (co-sited SF() weights are scaled by 8)
+UJ_INLINE int ujUpsampleTapsV(int j, int n, int co_sited, int *r, int *w) {
+    static const int centered[3][3] = { { CF2A, CF2B, 0 }, { CF3X, CF3Y, CF3Z }, { CF3A, CF3B, CF3C } };
+    int k, t;
+    if (!co_sited) {
+        if (j < 3 || j >= ((n << 1) - 3)) {
+            t = (j < 3) ? j : ((n << 1) - 1 - j);
+            for (k = 0;  k < 3;  ++k) {
+                r[k] = (j < 3) ? k : (n - 1 - k);
+                w[k] = centered[t][k];
+            }
+            return 3;
+        }
+        k = (j - 3) >> 1;
+        r[0] = k;  r[1] = k + 1;  r[2] = k + 2;  r[3] = k + 3;
+        if (j & 1) { w[0] = CF4A;  w[1] = CF4B;  w[2] = CF4C;  w[3] = CF4D; }
+              else { w[0] = CF4D;  w[1] = CF4C;  w[2] = CF4B;  w[3] = CF4A; }
+        return 4;
+    }
+    if (j < 3) {
+        if (j != 1) { r[0] = j >> 1;  w[0] = 128;  return 1; }
+        r[0] = 0;  r[1] = 1;  r[2] = 2;
+        w[0] = 64;  w[1] = 72;  w[2] = -8;
+        return 3;
+    }
+    if (j >= ((n << 1) - 3)) {
+        switch ((n << 1) - 1 - j) {
+            case 0:  r[0] = n - 1;  r[1] = n - 2;  w[0] = 136;  w[1] = -8;  return 2;
+            case 1:  r[0] = n - 3;  w[0] = 128;  return 1;  // sic, matches ujUpsampleVCoSited
+            default: r[0] = n - 1;  r[1] = n - 2;  r[2] = n - 3;
+                     w[0] = 64;  w[1] = 72;  w[2] = -8;  return 3;
+        }
+    }
+    k = (j - 3) >> 1;
+    if (!(j & 1)) { r[0] = k + 2;  w[0] = 128;  return 1; }
+    r[0] = k;  r[1] = k + 1;  r[2] = k + 2;  r[3] = k + 3;
+    w[0] = -8;  w[1] = 72;  w[2] = 72;  w[3] = -8;
+    return 4;
+}
+
+typedef struct _uj_stream_cmp {
+    ujComponent *c;
+    int xfactor, yfactor;        // 1 or 2 (accurate) / shift amounts (fast)
+    unsigned char *hlines[4];    // horizontally upsampled lines, ring buffer
+    int hline_index[4];
+    unsigned char *line;         // final chroma line for the current row
+} ujStreamComponent;
+
+// returns the horizontally upsampled component line y
+static const unsigned char* ujStreamLineH(ujContext *uj, ujStreamComponent *sc, int y) {
+    ujComponent *c = sc->c;
+    const unsigned char *lin = &c->pixels[y * c->stride];
+    int slot = y & 3;
+    if (sc->xfactor == 1) return lin;
+    if (sc->hline_index[slot] != y) {
+        const int w = ujUpsampleSpan(c->width, c->picw);
+        if (uj->co_sited_chroma) ujUpsampleLineHCoSited(lin, w, c->stride, sc->hlines[slot]);
+                            else ujUpsampleLineHCentered(lin, w, c->stride, sc->hlines[slot]);
+        sc->hline_index[slot] = y;
+    }
+    return sc->hlines[slot];
+}
+
+// returns the fully upsampled component line y (in luma coordinates)
+static const unsigned char* ujStreamLine(ujContext *uj, ujStreamComponent *sc, int y) {
+    ujComponent *c = sc->c;
+    const unsigned char *in[4];
+    int r[4], w[4], taps, x, k, sum;
+    if (uj->fast_chroma) {
+        const unsigned char *lin = &c->pixels[(y >> sc->yfactor) * c->stride];
+        if (!sc->xfactor) return lin;
+        for (x = 0;  x < uj->width;  ++x)
+            sc->line[x] = lin[x >> sc->xfactor];
+        return sc->line;
+    }
+    if (sc->yfactor == 1) return ujStreamLineH(uj, sc, y);
+    taps = ujUpsampleTapsV(y, c->pich, uj->co_sited_chroma, r, w);
+    for (k = 0;  k < taps;  ++k)
+        in[k] = ujStreamLineH(uj, sc, r[k]);
+    for (x = 0;  x < uj->width;  ++x) {
+        for (k = 0, sum = 0;  k < taps;  ++k)
+            sum += w[k] * in[k][x];
+        sc->line[x] = CF(sum);
+    }
+    return sc->line;
+}
+
+// converts pixels x..width-1 of a line; pout points to pixel x
+UJ_INLINE void ujConvertLineScalar(const unsigned char *py, const unsigned char *pcb, const unsigned char *pcr,
+                                   unsigned char *pout, int x, int width, int format) {
+    const int ri = (format == UJ_PIXEL_FORMAT_BGRA) ? 2 : 0, bi = 2 - ri;
+    const int bpp = (format == UJ_PIXEL_FORMAT_RGB) ? 3 : 4;
+    for (;  x < width;  ++x) {
+        register int y = py[x] << 8;
+        register int cb = pcb[x] - 128;
+        register int cr = pcr[x] - 128;
+        pout[ri] = ujClip((y            + 359 * cr + 128) >> 8);
+        pout[1]  = ujClip((y -  88 * cb - 183 * cr + 128) >> 8);
+        pout[bi] = ujClip((y + 454 * cb            + 128) >> 8);
+        if (bpp == 4) pout[3] = 0xff;
+        pout += bpp;
+    }
+}
+
+#if defined(UJ_USE_SSE2)
+
+static void ujConvertLineSSE2(const unsigned char *py, const unsigned char *pcb, const unsigned char *pcr,
+                              unsigned char *pout, int width, int format) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c128w = _mm_set1_epi16(128);
+    const __m128i round = _mm_set1_epi32(128);
+    const __m128i kr = _mm_set_epi16(359, 256, 359, 256, 359, 256, 359, 256);
+    const __m128i kg = _mm_set_epi16(-88, 256, -88, 256, -88, 256, -88, 256);
+    const __m128i kgcr = _mm_set_epi16(0, -183, 0, -183, 0, -183, 0, -183);
+    const __m128i kb = _mm_set_epi16(454, 256, 454, 256, 454, 256, 454, 256);
+    const __m128i alpha = _mm_set1_epi16(0xff);
+    int x = 0;
+    if (format == UJ_PIXEL_FORMAT_RGB) {  // no cheap 3-byte interleave in SSE2
+        ujConvertLineScalar(py, pcb, pcr, pout, 0, width, format);
+        return;
+    }
+    for (;  x + 8 <= width;  x += 8) {
+        __m128i y = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) &py[x]), zero);
+        __m128i cb = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) &pcb[x]), zero), c128w);
+        __m128i cr = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) &pcr[x]), zero), c128w);
+        __m128i ycr_l = _mm_unpacklo_epi16(y, cr), ycr_h = _mm_unpackhi_epi16(y, cr);
+        __m128i ycb_l = _mm_unpacklo_epi16(y, cb), ycb_h = _mm_unpackhi_epi16(y, cb);
+        __m128i cr0_l = _mm_unpacklo_epi16(cr, zero), cr0_h = _mm_unpackhi_epi16(cr, zero);
+        __m128i r = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(ycr_l, kr), round), 8),
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(ycr_h, kr), round), 8));
+        __m128i g = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(ycb_l, kg), _mm_madd_epi16(cr0_l, kgcr)), round), 8),
+            _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(ycb_h, kg), _mm_madd_epi16(cr0_h, kgcr)), round), 8));
+        __m128i b = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(ycb_l, kb), round), 8),
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(ycb_h, kb), round), 8));
+        if (format == UJ_PIXEL_FORMAT_BGRA) { __m128i t = r;  r = b;  b = t; }
+        // saturating packs implement ujClip()
+        __m128i rg = _mm_packus_epi16(r, g);
+        __m128i ba = _mm_packus_epi16(b, alpha);
+        rg = _mm_unpacklo_epi8(rg, _mm_srli_si128(rg, 8));
+        ba = _mm_unpacklo_epi8(ba, _mm_srli_si128(ba, 8));
+        _mm_storeu_si128((__m128i*) pout, _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i*) (pout + 16), _mm_unpackhi_epi16(rg, ba));
+        pout += 32;
+    }
+    ujConvertLineScalar(py, pcb, pcr, pout, x, width, format);
+}
+
+#define ujConvertLine ujConvertLineSSE2
+
+#elif defined(UJ_USE_NEON)
+
+static void ujConvertLineNEON(const unsigned char *py, const unsigned char *pcb, const unsigned char *pcr,
+                              unsigned char *pout, int width, int format) {
+    const int16x8_t c128 = vdupq_n_s16(128);
+    const int ri = (format == UJ_PIXEL_FORMAT_BGRA) ? 2 : 0, bi = 2 - ri;
+    const int bpp = (format == UJ_PIXEL_FORMAT_RGB) ? 3 : 4;
+    uint8x8x4_t px;
+    int x;
+    px.val[3] = vdup_n_u8(0xff);
+    for (x = 0;  x + 8 <= width;  x += 8) {
+        int16x8_t y = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(&py[x])));
+        int16x8_t cb = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(&pcb[x]))), c128);
+        int16x8_t cr = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(&pcr[x]))), c128);
+        int32x4_t y_l = vshll_n_s16(vget_low_s16(y), 8), y_h = vshll_n_s16(vget_high_s16(y), 8);
+        int32x4_t r_l = vmlal_n_s16(y_l, vget_low_s16(cr), 359);
+        int32x4_t r_h = vmlal_n_s16(y_h, vget_high_s16(cr), 359);
+        int32x4_t g_l = vmlsl_n_s16(vmlsl_n_s16(y_l, vget_low_s16(cb), 88), vget_low_s16(cr), 183);
+        int32x4_t g_h = vmlsl_n_s16(vmlsl_n_s16(y_h, vget_high_s16(cb), 88), vget_high_s16(cr), 183);
+        int32x4_t b_l = vmlal_n_s16(y_l, vget_low_s16(cb), 454);
+        int32x4_t b_h = vmlal_n_s16(y_h, vget_high_s16(cb), 454);
+        // rounding narrow is (x + 128) >> 8, saturating narrow implements ujClip()
+        px.val[ri] = vqmovun_s16(vcombine_s16(vrshrn_n_s32(r_l, 8), vrshrn_n_s32(r_h, 8)));
+        px.val[1]  = vqmovun_s16(vcombine_s16(vrshrn_n_s32(g_l, 8), vrshrn_n_s32(g_h, 8)));
+        px.val[bi] = vqmovun_s16(vcombine_s16(vrshrn_n_s32(b_l, 8), vrshrn_n_s32(b_h, 8)));
+        if (bpp == 4) {
+            vst4_u8(pout, px);
+        } else {
+            uint8x8x3_t px3 = { { px.val[0], px.val[1], px.val[2] } };
+            vst3_u8(pout, px3);
+        }
+        pout += bpp << 3;
+    }
+    ujConvertLineScalar(py, pcb, pcr, pout, x, width, format);
+}
+
+#define ujConvertLine ujConvertLineNEON
+
+#else
+
+UJ_INLINE void ujConvertLine(const unsigned char *py, const unsigned char *pcb, const unsigned char *pcr,
+                             unsigned char *pout, int width, int format) {
+    ujConvertLineScalar(py, pcb, pcr, pout, 0, width, format);
+}
+
+#endif
+
+UJ_INLINE int ujPixelSize(int format) {
+    switch (format) {
+        case UJ_PIXEL_FORMAT_RGBA:
+        case UJ_PIXEL_FORMAT_BGRA: return 4;
+        case UJ_PIXEL_FORMAT_RGB:  return 3;
+        case UJ_PIXEL_FORMAT_GRAY: return 1;
+        default:                   return 0;
+    }
+}
+
+// writes one output line in the given format; pcb and pcr are NULL for
+// grayscale images, which are replicated into the color channels
+static void ujOutputLine(const unsigned char *py, const unsigned char *pcb, const unsigned char *pcr,
+                         unsigned char *pout, int width, int format) {
+    int x;
+    if (format == UJ_PIXEL_FORMAT_GRAY) {
+        memcpy(pout, py, width);
+    } else if (pcb) {
+        ujConvertLine(py, pcb, pcr, pout, width, format);
+    } else if (format == UJ_PIXEL_FORMAT_RGB) {
+        for (x = 0;  x < width;  ++x, pout += 3)
+            pout[0] = pout[1] = pout[2] = py[x];
+    } else {
+        for (x = 0;  x < width;  ++x, pout += 4) {
+            pout[0] = pout[1] = pout[2] = py[x];
+            pout[3] = 0xff;
+        }
+    }
+}
+
+// stores the lines of a picture (or a YUV plane) in EXIF orientation order:
+// the converters write each line to the buffer ujOrientLine() returns, then
+// call ujOrientStore(). Orientations 1 and 4 go straight to the destination,
+// 2 and 3 are mirrored from a line buffer, and 5 to 8 are transposed from a
+// band of lines, so every line of the band becomes a short run (64 bytes for
+// RGBA) in each destination line instead of a scattered single pixel.
+typedef struct _uj_orient {
+    unsigned char *dest;
+    int stride, psize;      // of the destination
+    int width, height;      // stored size; the destination is height x width for 5..8
+    int orientation;
+    unsigned char *band;
+    int lines;              // lines per band
+} ujOrientWriter;
+
+static void ujOrientBegin(ujContext *uj, ujOrientWriter *ow, unsigned char *dest, int stride,
+                          int psize, int width, int height) {
+    ow->dest = dest;
+    ow->stride = stride;
+    ow->psize = psize;
+    ow->width = width;
+    ow->height = height;
+    ow->orientation = (uj->auto_orient && uj->orientation) ? uj->orientation : 1;
+    ow->band = NULL;
+    ow->lines = (ow->orientation < 5) ? 1 : ((psize >= 3) ? 16 : (64 / psize));
+    if ((ow->orientation != 1) && (ow->orientation != 4)) {
+        if (!ujReserve(uj->band, width * psize * ow->lines))
+            ujThrow(UJ_OUT_OF_MEM);
+        ow->band = uj->band.buffer();
+    }
+}
+
+UJ_INLINE unsigned char* ujOrientLine(const ujOrientWriter *ow, int y) {
+    switch (ow->orientation) {
+        case 1:  return ow->dest + y * ow->stride;
+        case 4:  return ow->dest + (ow->height - 1 - y) * ow->stride;
+        default: return ow->band + (y % ow->lines) * ow->width * ow->psize;
+    }
+}
+
+UJ_FORCE_INLINE void ujMirrorLine(const unsigned char *in, unsigned char *out, int width, const int psize) {
+    out += (width - 1) * psize;
+    for (;  width;  --width, in += psize, out -= psize)
+        memcpy(out, in, psize);
+}
+
+// column x of the n band lines starting at y0 goes to destination line x
+// (5, 6) or width - 1 - x (7, 8), at column y0 onwards (5, 8) or mirrored (6, 7)
+UJ_FORCE_INLINE void ujTransposeBand(const ujOrientWriter *ow, int y0, int n, const int psize) {
+    const int bstride = ow->width * psize;
+    const int flipx = (ow->orientation == 7) || (ow->orientation == 8);
+    const int flipy = (ow->orientation == 6) || (ow->orientation == 7);
+    const int step = flipy ? -psize : psize;
+    int x, k;
+    for (x = 0;  x < ow->width;  ++x) {
+        const unsigned char *in = ow->band + x * psize;
+        unsigned char *out = ow->dest + (flipx ? (ow->width - 1 - x) : x) * ow->stride
+                           + (flipy ? (ow->height - 1 - y0) : y0) * psize;
+        for (k = 0;  k < n;  ++k, in += bstride, out += step)
+            memcpy(out, in, psize);
+    }
+}
+
+static void ujOrientStore(const ujOrientWriter *ow, int y) {
+    int y0, n;
+    switch (ow->orientation) {
+        case 1:
+        case 4:
+            return;
+        case 2:
+        case 3: {
+            unsigned char *out = ow->dest + ((ow->orientation == 2) ? y : (ow->height - 1 - y)) * ow->stride;
+            switch (ow->psize) {
+                case 1:  ujMirrorLine(ow->band, out, ow->width, 1); break;
+                case 2:  ujMirrorLine(ow->band, out, ow->width, 2); break;
+                case 3:  ujMirrorLine(ow->band, out, ow->width, 3); break;
+                default: ujMirrorLine(ow->band, out, ow->width, 4); break;
+            }
+            return;
+        }
+        default:
+            if ((((y + 1) % ow->lines) != 0) && (y != ow->height - 1))
+                return;  // band not full yet
+            y0 = y - y % ow->lines;
+            n = y - y0 + 1;
+            switch (ow->psize) {
+                case 1:  ujTransposeBand(ow, y0, n, 1); break;
+                case 2:  ujTransposeBand(ow, y0, n, 2); break;
+                case 3:  ujTransposeBand(ow, y0, n, 3); break;
+                default: ujTransposeBand(ow, y0, n, 4); break;
+            }
+    }
+}
+
+// the size of the converted picture
+UJ_INLINE int ujOutputWidth(const ujContext *uj) {
+    return (uj->auto_orient && (uj->orientation >= 5)) ? uj->height : uj->width;
+}
+
+UJ_INLINE int ujOutputHeight(const ujContext *uj) {
+    return (uj->auto_orient && (uj->orientation >= 5)) ? uj->width : uj->height;
+}
+
+// whether ujConvertStreaming can handle the image's subsampling layout;
+// anything else goes through the full-plane upsamplers
+static int ujCanStream(ujContext *uj) {
     int i;
+    ujComponent *c;
+    if (uj->ncomp != 3) return 0;
+    if (uj->fast_chroma) return 1;
+    for (i = 1, c = &uj->comp[1];  i < 3;  ++i, ++c) {
+        if ((c->width << 1) < uj->width || (c->height << 1) < uj->height) return 0;
+        if (c->width > uj->width || c->height > uj->height) return 0;  // already upsampled
+    }
+    return 1;
+}
+
+static void ujConvertStreaming(ujContext *uj, const ujOrientWriter *ow, int format) {
+    ujStreamComponent sc[2];
+    unsigned char *mem;
+    int i, k, y, linesize = 0;
+    for (i = 0;  i < 2;  ++i) {
+        ujComponent *c = &uj->comp[i + 1];
+        sc[i].c = c;
+        if (uj->fast_chroma) {
+            int w = c->width, h = c->height;
+            sc[i].xfactor = sc[i].yfactor = 0;
+            while (w < uj->width) { w <<= 1; ++sc[i].xfactor; }
+            while (h < uj->height) { h <<= 1; ++sc[i].yfactor; }
+        } else {
+            sc[i].xfactor = (c->width < uj->width) ? 2 : 1;
+            sc[i].yfactor = (c->height < uj->height) ? 2 : 1;
+        }
+        k = ujUpsampleSpan(c->width, c->picw) << 1;
+        if (k > linesize) linesize = k;
+    }
+    if (uj->width > linesize) linesize = uj->width;
+    if (!ujReserve(uj->scratch, linesize * 5 * 2))
+        ujThrow(UJ_OUT_OF_MEM);
+    mem = uj->scratch.buffer();
+    for (i = 0;  i < 2;  ++i) {
+        for (k = 0;  k < 4;  ++k) {
+            sc[i].hlines[k] = mem;  mem += linesize;
+            sc[i].hline_index[k] = -1;
+        }
+        sc[i].line = mem;  mem += linesize;
+    }
+    for (y = 0;  y < uj->height;  ++y) {
+        const unsigned char *pcb = ujStreamLine(uj, &sc[0], y);
+        const unsigned char *pcr = ujStreamLine(uj, &sc[1], y);
+        ujOutputLine(&uj->comp[0].pixels[y * uj->comp[0].stride], pcb, pcr, ujOrientLine(ow, y), uj->width, format);
+        ujOrientStore(ow, y);
+    }
+}
+
+// writes the picture to pout, one line of the given format every stride bytes
+UJ_INLINE void ujConvert(ujContext *uj, unsigned char *pout, int stride, int format) {
+    int i, y;
     ujComponent* c;
+    ujOrientWriter ow;
+    ujOrientBegin(uj, &ow, pout, stride, ujPixelSize(format), uj->width, uj->height);
+    ujCheckError();
+    if (uj->ncomp == 1 || format == UJ_PIXEL_FORMAT_GRAY) {
+        // luma only -> no chroma to upsample
+        for (y = 0;  y < uj->height;  ++y) {
+            ujOutputLine(&uj->comp[0].pixels[y * uj->comp[0].stride], NULL, NULL, ujOrientLine(&ow, y), uj->width, format);
+            ujOrientStore(&ow, y);
+        }
+        return;
+    }
+    if (ujCanStream(uj)) {
+        ujConvertStreaming(uj, &ow, format);
+        return;
+    }
     for (i = 0, c = uj->comp;  i < uj->ncomp;  ++i, ++c) {
         if (uj->fast_chroma) {
             ujUpsampleFast(uj, c);
@@ -692,47 +1877,80 @@ UJ_INLINE void ujConvert(ujContext *uj, unsigned char *pout) {
         } else {
             while ((c->width < uj->width) || (c->height < uj->height)) {
                 if (c->width < uj->width) {
-                    if (uj->co_sited_chroma) ujUpsampleHCoSited(c);
-                                        else ujUpsampleHCentered(c);
+                    if (uj->co_sited_chroma) ujUpsampleHCoSited(uj, c);
+                                        else ujUpsampleHCentered(uj, c);
                 }
                 ujCheckError();
                 if (c->height < uj->height) {
-                    if (uj->co_sited_chroma) ujUpsampleVCoSited(c);
-                                        else ujUpsampleVCentered(c);
+                    if (uj->co_sited_chroma) ujUpsampleVCoSited(uj, c);
+                                        else ujUpsampleVCentered(uj, c);
                 }
                 ujCheckError();
             }
         }
         if ((c->width < uj->width) || (c->height < uj->height)) ujThrow(UJ_INTERNAL_ERR);
     }
-    if (uj->ncomp == 3) {
-        // convert to RGB
-        int x, yy;
-        const unsigned char *py  = &uj->comp[0].pixels[0];
-        const unsigned char *pcb = &uj->comp[1].pixels[0];
-        const unsigned char *pcr = &uj->comp[2].pixels[0];
-        for (yy = uj->height;  yy;  --yy) {
-            for (x = 0;  x < uj->width;  ++x) {
-                register int y = py[x] << 8;
-                register int cb = pcb[x] - 128;
-                register int cr = pcr[x] - 128;
-                *pout++ = ujClip((y            + 359 * cr + 128) >> 8);
-                *pout++ = ujClip((y -  88 * cb - 183 * cr + 128) >> 8);
-                *pout++ = ujClip((y + 454 * cb            + 128) >> 8);
-				*pout++ = 0xff;
-            }
-            py += uj->comp[0].stride;
-            pcb += uj->comp[1].stride;
-            pcr += uj->comp[2].stride;
-        }
-    } else {
-        // grayscale -> only remove stride
-        unsigned char *pin = &uj->comp[0].pixels[uj->comp[0].stride];
-        int y;
-        for (y = uj->height - 1;  y;  --y) {
-            memcpy(pout, pin, uj->width);
-            pin += uj->comp[0].stride;
-            pout += uj->width;
+    // convert to RGB
+    for (y = 0;  y < uj->height;  ++y) {
+        ujOutputLine(&uj->comp[0].pixels[y * uj->comp[0].stride],
+                     &uj->comp[1].pixels[y * uj->comp[1].stride],
+                     &uj->comp[2].pixels[y * uj->comp[2].stride],
+                     ujOrientLine(&ow, y), uj->width, format);
+        ujOrientStore(&ow, y);
+    }
+}
+
+// writes line y of component c resampled to the 4:2:0 grid (half the output
+// size, rounded up) to every step-th byte of out. Chroma with more resolution
+// than 4:2:0 is box-averaged, chroma with less is repeated.
+static void ujChromaLine420(ujContext *uj, const ujComponent *c, int y, unsigned char *out, int step) {
+    const int width = (uj->width + 1) >> 1;
+    const unsigned char *l0, *l1;
+    int x, x0, x1, y0, y1, sx = 1, sy = 1;
+    while ((c->width * sx) < uj->width) sx <<= 1;
+    while ((c->height * sy) < uj->height) sy <<= 1;
+    y0 = (y << 1) / sy;
+    if (y0 >= c->height) y0 = c->height - 1;
+    y1 = ((sy == 1) && (y0 + 1 < c->height)) ? (y0 + 1) : y0;
+    l0 = &c->pixels[y0 * c->stride];
+    l1 = &c->pixels[y1 * c->stride];
+    if ((sx == 2) && (y0 == y1) && (step == 1)) {
+        memcpy(out, l0, width);
+        return;
+    }
+    for (x = 0;  x < width;  ++x, out += step) {
+        x0 = (x << 1) / sx;
+        if (x0 >= c->width) x0 = c->width - 1;
+        x1 = ((sx == 1) && (x0 + 1 < c->width)) ? (x0 + 1) : x0;
+        *out = (unsigned char) ((l0[x0] + l0[x1] + l1[x0] + l1[x1] + 2) >> 2);
+    }
+}
+
+static void ujConvertYUV(ujContext *uj, unsigned char* const planes[3], const int strides[3], int format) {
+    const int cwidth = (uj->width + 1) >> 1, cheight = (uj->height + 1) >> 1;
+    const int nv12 = (format == UJ_YUV_FORMAT_NV12);
+    ujOrientWriter ow;
+    int i, y;
+    ujOrientBegin(uj, &ow, planes[0], strides[0], 1, uj->width, uj->height);
+    ujCheckError();
+    for (y = 0;  y < uj->height;  ++y) {
+        memcpy(ujOrientLine(&ow, y), &uj->comp[0].pixels[y * uj->comp[0].stride], uj->width);
+        ujOrientStore(&ow, y);
+    }
+    // NV12 stores both chroma components of a line in one pass
+    for (i = 1;  i < (nv12 ? 2 : 3);  ++i) {
+        ujOrientBegin(uj, &ow, planes[i], strides[i], nv12 ? 2 : 1, cwidth, cheight);
+        ujCheckError();
+        for (y = 0;  y < cheight;  ++y) {
+            unsigned char *out = ujOrientLine(&ow, y);
+            if (uj->ncomp == 1)
+                memset(out, 128, cwidth * ow.psize);
+            else if (nv12) {
+                ujChromaLine420(uj, &uj->comp[1], y, out, 2);
+                ujChromaLine420(uj, &uj->comp[2], y, out + 1, 2);
+            } else
+                ujChromaLine420(uj, &uj->comp[i], y, out, 1);
+            ujOrientStore(&ow, y);
         }
     }
 }
@@ -744,21 +1962,68 @@ void ujDone(ujContext *uj) {
 		uj->comp[i].pixels.clear();
 	}
 
-	uj->rgb.clear();
+	uj->scratch.clear();
+	uj->band.clear();
 }
 
+// reset the context for a new decode; settings and the component plane and
+// scratch buffers (at their current capacity) are kept
 void ujInit(ujContext *uj) {
+    int i;
     int save_no_decode = uj->no_decode;
     int save_fast_chroma = uj->fast_chroma;
+    int save_threads = uj->threads;
 	bool save_load_thumbnail = uj->loadThumbnail;
 	unsigned int saveMaxWidth = uj->maxWidth, saveMaxHeight = uj->maxHeight;
+	int saveCrop[4] = { uj->cropx, uj->cropy, uj->cropw, uj->croph };
+	int save_stream = uj->stream;
+	int save_auto_orient = uj->auto_orient;
+	int save_force_orientation = uj->force_orientation;
+	FCInterface::ByteVector planes[3], scratch, band;
+	for (i = 0; i < 3; ++i)
+		planes[i].swap(uj->comp[i].pixels);
+	scratch.swap(uj->scratch);
+	band.swap(uj->band);
+	// in stream mode, the tables carry over to the next frame
+	int saveQtavail = uj->qtavail;
+	unsigned char saveQtab[4][64];
+	ujHuffTable saveVlctab[4];
+	unsigned char saveVlcdef[4][17 + 256];
+	int saveVlcdeflen[4] = { 0, 0, 0, 0 };
+	if (save_stream) {
+		memcpy(saveQtab, uj->qtab, sizeof(saveQtab));
+		memcpy(saveVlctab, uj->vlctab, sizeof(saveVlctab));
+		memcpy(saveVlcdef, uj->vlcdef, sizeof(saveVlcdef));
+		memcpy(saveVlcdeflen, uj->vlcdeflen, sizeof(saveVlcdeflen));
+	}
     ujDone(uj);
     memset(uj, 0, sizeof(ujContext));
+	if (save_stream) {
+		uj->stream = save_stream;
+		uj->qtavail = saveQtavail;
+		memcpy(uj->qtab, saveQtab, sizeof(saveQtab));
+		memcpy(uj->vlctab, saveVlctab, sizeof(saveVlctab));
+		memcpy(uj->vlcdef, saveVlcdef, sizeof(saveVlcdef));
+		memcpy(uj->vlcdeflen, saveVlcdeflen, sizeof(saveVlcdeflen));
+	}
+	for (i = 0; i < 3; ++i)
+		uj->comp[i].pixels.swap(planes[i]);
+	uj->scratch.swap(scratch);
+	uj->band.swap(band);
     uj->no_decode = save_no_decode;
     uj->fast_chroma = save_fast_chroma;
+    uj->threads = save_threads;
 	uj->loadThumbnail = save_load_thumbnail;
 	uj->maxWidth = saveMaxWidth;
 	uj->maxHeight = saveMaxHeight;
+	uj->cropx = saveCrop[0];
+	uj->cropy = saveCrop[1];
+	uj->cropw = saveCrop[2];
+	uj->croph = saveCrop[3];
+	uj->auto_orient = save_auto_orient;
+	// a forced orientation keeps ujDecodeExif() from taking the file's
+	uj->force_orientation = save_force_orientation;
+	uj->orientation = save_force_orientation;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -779,11 +2044,8 @@ UJ_INLINE int ujGetExif32(ujContext* uj, const unsigned char *p) {
 
 UJ_INLINE void ujDecodeExif(ujContext* uj) {
     const unsigned char *ptr, *segStart;
-    int segSize,size, count, i;
-    if (uj->no_decode || uj->fast_chroma) {
-        ujSkipMarker(uj);
-        return;
-    }
+    int segSize,size, count, i, ifd = 0;
+    // parsed in every mode: header-only decodes report the orientation, too
     ujDecodeLength(uj);
     ujCheckError();
 	segStart = ptr = uj->pos;
@@ -815,7 +2077,16 @@ UJ_INLINE void ujDecodeExif(ujContext* uj) {
 		short tag;
 		while (count--) {
 			tag = ujGetExif16(uj, ptr);
-			if ((tag == 0x0213) // tag = YCbCrPositioning
+			if ((tag == 0x0112) // tag = Orientation
+				&& (ifd == 0)   // IFD1 describes the thumbnail
+				&& !uj->orientation  // the first Exif segment counts
+				&& (ujGetExif16(uj, ptr + 2) == 3)  // type = SHORT
+				&& (ujGetExif32(uj, ptr + 4) == 1)  // length = 1
+				) {
+				i = ujGetExif16(uj, ptr + 8);
+				uj->orientation = ((i >= 1) && (i <= 8)) ? i : 1;
+			}
+			else if ((tag == 0x0213) // tag = YCbCrPositioning
 				&& (ujGetExif16(uj, ptr + 2) == 3)  // type = SHORT
 				&& (ujGetExif32(uj, ptr + 4) == 1)  // length = 1
 				) {
@@ -840,20 +2111,19 @@ UJ_INLINE void ujDecodeExif(ujContext* uj) {
 		int offset = ujGetExif32(uj, ptr);
 		ptr += 4;
 
-		if (offset == 0)
+		if ((offset <= 0) || (offset + 6 >= segSize))
 			break;
-		
+		++ifd;
+
 		ptr = segStart + offset + 6;
 		size = segSize - (ptr - segStart);
 	}
 
-	if (thumbOffset > 0 && thumbLength > 0 && uj->loadThumbnail) {
-		unsigned char* thumbPtr = (unsigned char*)segStart +thumbOffset + 6;
-		unsigned int reqSize = (thumbPtr + thumbLength) - segStart;
-		if (reqSize <= segSize) {
-			uj->thumbnail.resize(thumbLength);
-			memcpy(uj->thumbnail.buffer(), thumbPtr, thumbLength);
-		}
+	// the thumbnail is handed out in place, so it has to lie within the segment
+	if (thumbOffset > 0 && thumbLength > 0 && uj->loadThumbnail
+		&& thumbOffset <= (unsigned int)segSize - 6 && thumbLength <= (unsigned int)segSize - 6 - thumbOffset) {
+		uj->thumbPos = segStart + thumbOffset + 6;
+		uj->thumbSize = thumbLength;
 	}
 }
 
@@ -861,7 +2131,7 @@ UJ_INLINE void ujDecodeExif(ujContext* uj) {
 
 ujImage ujCreate(void) {
     ujContext *uj = (ujContext*) calloc(1, sizeof(ujContext));
-    ujError = uj ? UJ_OK : UJ_OUT_OF_MEM;
+    if (!uj) ujErrorNoContext = UJ_OUT_OF_MEM;
     return (ujImage) uj;
 }
 
@@ -869,18 +2139,18 @@ void ujDisableDecoding(ujImage img) {
     ujContext *uj = (ujContext*) img;
     if (uj) {
         uj->no_decode = 1;
-        ujError = UJ_OK;
+        uj->error = UJ_OK;
     } else
-        ujError = UJ_NO_CONTEXT;
+        ujErrorNoContext = UJ_NO_CONTEXT;
 }
 
 void ujSetChromaMode(ujImage img, int mode) {
     ujContext *uj = (ujContext*) img;
     if (uj) {
         uj->fast_chroma = mode;
-        ujError = UJ_OK;
+        uj->error = UJ_OK;
     } else
-        ujError = UJ_NO_CONTEXT;
+        ujErrorNoContext = UJ_NO_CONTEXT;
 }
 
 void ujSetMaximumDimensions(ujImage img, unsigned int width, unsigned int height)
@@ -889,10 +2159,10 @@ void ujSetMaximumDimensions(ujImage img, unsigned int width, unsigned int height
 	if (uj) {
 		uj->maxWidth = width;
 		uj->maxHeight = height;
-		ujError = UJ_OK;
+		uj->error = UJ_OK;
 	}
 	else
-		ujError = UJ_NO_CONTEXT;
+		ujErrorNoContext = UJ_NO_CONTEXT;
 }
 
 void ujSetThumbnailMode(ujImage img, bool mode)
@@ -900,28 +2170,124 @@ void ujSetThumbnailMode(ujImage img, bool mode)
 	ujContext *uj = (ujContext*)img;
 	if (uj) {
 		uj->loadThumbnail = mode;
-		ujError = UJ_OK;
+		uj->error = UJ_OK;
+	}
+	else
+		ujErrorNoContext = UJ_NO_CONTEXT;
+}
+
+void ujSetThreadCount(ujImage img, int threads)
+{
+	ujContext *uj = (ujContext*)img;
+	if (uj) {
+		uj->threads = threads;
+		uj->error = UJ_OK;
+	}
+	else
+		ujErrorNoContext = UJ_NO_CONTEXT;
+}
+
+void ujSetStreamMode(ujImage img, int enable)
+{
+	ujContext *uj = (ujContext*)img;
+	if (!uj) {
+		ujErrorNoContext = UJ_NO_CONTEXT;
+		return;
+	}
+	if (enable && !uj->stream) {
+		// start from the standard tables until the stream defines its own
+		memset(uj->vlcdeflen, 0, sizeof(uj->vlcdeflen));
+		uj->error = UJ_OK;
+		ujLoadDefaultDHT(uj);
+		if (uj->error) return;
+	}
+	uj->stream = enable ? 1 : 0;
+	uj->error = UJ_OK;
+}
+
+void ujSetAutoOrient(ujImage img, int enable)
+{
+	ujContext *uj = (ujContext*)img;
+	if (uj) {
+		uj->auto_orient = enable ? 1 : 0;
+		uj->error = UJ_OK;
+	}
+	else
+		ujErrorNoContext = UJ_NO_CONTEXT;
+}
+
+void ujSetOrientation(ujImage img, int orientation)
+{
+	ujContext *uj = (ujContext*)img;
+	if (!uj) {
+		ujErrorNoContext = UJ_NO_CONTEXT;
+		return;
+	}
+	if (orientation < 0 || orientation > 8) {
+		uj->error = UJ_INVALID_ARG;
+		return;
+	}
+	uj->force_orientation = orientation;
+	uj->error = UJ_OK;
+}
+
+void ujSetCrop(ujImage img, int x, int y, int width, int height)
+{
+	ujContext *uj = (ujContext*)img;
+	if (!uj) {
+		ujErrorNoContext = UJ_NO_CONTEXT;
+		return;
+	}
+	if (x < 0 || y < 0 || width < 0 || height < 0) {
+		uj->error = UJ_INVALID_ARG;
+		return;
+	}
+	uj->cropx = x;
+	uj->cropy = y;
+	uj->cropw = width;
+	uj->croph = height;
+	uj->error = UJ_OK;
+}
+
+void ujResetOptions(ujImage img)
+{
+	ujContext *uj = (ujContext*)img;
+	if (uj) {
+		uj->no_decode = 0;
+		uj->fast_chroma = UJ_CHROMA_MODE_DEFAULT;
+		uj->loadThumbnail = false;
+		uj->maxWidth = uj->maxHeight = 0;
+		uj->cropx = uj->cropy = uj->cropw = uj->croph = 0;
+		uj->threads = 0;
+		uj->stream = 0;
+		uj->auto_orient = 0;
+		uj->force_orientation = 0;
+		uj->error = UJ_OK;
 	}
 	else
-		ujError = UJ_NO_CONTEXT;
+		ujErrorNoContext = UJ_NO_CONTEXT;
+}
+
+void ujSetIDCTMode(int mode)
+{
+	ujIDCT = (mode == UJ_IDCT_MODE_SCALAR) ? ujIDCTScalar : ujSelectIDCT();
 }
 
 ujImage ujDecode(ujImage img, const void* jpeg, const int size) {
     ujContext *uj = (ujContext*) (img ? img : ujCreate());
+    if (!uj) return NULL;  // ujCreate() recorded UJ_OUT_OF_MEM
     if (img) ujInit(uj);
-    ujError = UJ_OK;
-    if (!uj)
-        { ujError = UJ_OUT_OF_MEM; goto out; }
+    uj->error = UJ_OK;
     uj->pos = (const unsigned char*) jpeg;
     uj->size = size & 0x7FFFFFFF;
     if (uj->size < 2)
-        { ujError = UJ_NO_JPEG; goto out; }
+        { uj->error = UJ_NO_JPEG; goto out; }
     if ((uj->pos[0] ^ 0xFF) | (uj->pos[1] ^ 0xD8))
-        { ujError = UJ_NO_JPEG; goto out; }
+        { uj->error = UJ_NO_JPEG; goto out; }
     ujSkip(uj, 2);
-    while (!ujError) {
+    while (!uj->error) {
         if ((uj->size < 2) || (uj->pos[0] != 0xFF))
-            { ujError = UJ_SYNTAX_ERROR; goto out; }
+            { uj->error = UJ_SYNTAX_ERROR; goto out; }
         ujSkip(uj, 2);
         switch (uj->pos[-1]) {
             case 0xC0: 
@@ -950,8 +2316,9 @@ ujImage ujDecode(ujImage img, const void* jpeg, const int size) {
 					ujDecodeDRI(uj);
 				break;
             case 0xDA: 
+				// the EXIF thumbnail comes before the first scan, nothing after it is needed
 				if (uj->loadThumbnail)
-					ujSkipMarker(uj);
+					uj->error = __UJ_FINISHED;
 				else
 					ujDecodeScan(uj); 
 				break;
@@ -965,93 +2332,179 @@ ujImage ujDecode(ujImage img, const void* jpeg, const int size) {
                 if ((uj->pos[-1] & 0xF0) == 0xE0)
                     ujSkipMarker(uj);
                 else
-                    { ujError = UJ_UNSUPPORTED; goto out; }
+                    { uj->error = UJ_UNSUPPORTED; goto out; }
         }
     }
-    if (ujError == __UJ_FINISHED) ujError = UJ_OK;
+    if (uj->error == __UJ_FINISHED) uj->error = UJ_OK;
   out:
-    if ((ujError && !uj->valid && !uj->loadThumbnail) || (uj->loadThumbnail && (uj->thumbnail.empty() || ujError)) ){
-        if (!img)
+    if ((uj->error && !uj->valid && !uj->loadThumbnail) || (uj->loadThumbnail && (!uj->thumbSize || uj->error)) ){
+        if (!img) {
+            ujErrorNoContext = uj->error ? uj->error : UJ_NOT_DECODED;
             ujFree(uj);
+        }
         return NULL;
     }
     return (ujImage) uj;
 }
 
-ujResult ujGetError(void) {
-    return ujError;
+ujResult ujGetError(ujImage img) {
+    ujContext *uj = (ujContext*) img;
+    return uj ? uj->error : ujErrorNoContext;
+}
+
+// sets the context's error for a query that needs a valid (flag != 0) image
+// and returns nonzero if the query can be answered
+UJ_INLINE int ujCheckQuery(ujContext *uj, int flag) {
+    if (!uj) { ujErrorNoContext = UJ_NO_CONTEXT; return 0; }
+    uj->error = flag ? UJ_OK : UJ_NOT_DECODED;
+    return flag;
 }
 
 int ujIsValid(ujImage img) {
     ujContext *uj = (ujContext*) img;
-    if (!uj) { ujError = UJ_NO_CONTEXT; return 0; }
+    if (!uj) { ujErrorNoContext = UJ_NO_CONTEXT; return 0; }
     return uj->valid;
 }
 
 int ujGetWidth(ujImage img) {
     ujContext *uj = (ujContext*) img;
-    ujError = !uj ? UJ_NO_CONTEXT : (uj->valid ? UJ_OK : UJ_NOT_DECODED);
-    return ujError ? 0 : uj->width;
+    return ujCheckQuery(uj, uj && uj->valid) ? ujOutputWidth(uj) : 0;
 }
 
 int ujGetHeight(ujImage img) {
     ujContext *uj = (ujContext*) img;
-    ujError = !uj ? UJ_NO_CONTEXT : (uj->valid ? UJ_OK : UJ_NOT_DECODED);
-    return ujError ? 0 : uj->height;
+    return ujCheckQuery(uj, uj && uj->valid) ? ujOutputHeight(uj) : 0;
+}
+
+int ujGetOrientation(ujImage img) {
+    ujContext *uj = (ujContext*) img;
+    // a thumbnail decode stops before the frame, but the Exif segment was read
+    if (!ujCheckQuery(uj, uj && (uj->valid || uj->thumbSize))) return 0;
+    return uj->orientation ? uj->orientation : 1;
+}
+
+void ujGetCropOffset(ujImage img, int* x, int* y)
+{
+	ujContext *uj = (ujContext*)img;
+	int valid = ujCheckQuery(uj, uj && uj->valid);
+	if (x) *x = valid ? uj->originx : 0;
+	if (y) *y = valid ? uj->originy : 0;
 }
 
 int ujIsColor(ujImage img) {
     ujContext *uj = (ujContext*) img;
-    ujError = !uj ? UJ_NO_CONTEXT : (uj->valid ? UJ_OK : UJ_NOT_DECODED);
-    return ujError ? 0 : (uj->ncomp != 1);
+    return ujCheckQuery(uj, uj && uj->valid) ? (uj->ncomp != 1) : 0;
 }
 
 int ujGetImageSize(ujImage img) {
     ujContext *uj = (ujContext*) img;
-    ujError = !uj ? UJ_NO_CONTEXT : (uj->valid ? UJ_OK : UJ_NOT_DECODED);
+    if (!ujCheckQuery(uj, uj && uj->valid)) return 0;
 	unsigned int numComponents = uj->ncomp == 3 ? 4 : uj->ncomp;
-    return ujError ? 0 : (uj->width * uj->height * numComponents);
+    return uj->width * uj->height * numComponents;
 }
 
 ujPlane* ujGetPlane(ujImage img, int num) {
     ujContext *uj = (ujContext*) img;
-    ujError = !uj ? UJ_NO_CONTEXT : (uj->decoded ? UJ_OK : UJ_NOT_DECODED);
-    if (!ujError && (num >= uj->ncomp)) ujError = UJ_INVALID_ARG;
-    return ujError ? NULL : ((ujPlane*) &uj->comp[num]);
+    if (!ujCheckQuery(uj, uj && uj->decoded)) return NULL;
+    if (num >= uj->ncomp) { uj->error = UJ_INVALID_ARG; return NULL; }
+    return (ujPlane*) &uj->comp[num];
 }
 bool ujGetThumbData(ujImage img, FCInterface::ByteVector& dest) {
 	ujContext *uj = (ujContext*)img;
-	if (uj->thumbnail.empty()) {
+	if (!uj) {
+		ujErrorNoContext = UJ_NO_CONTEXT;
+		return false;
+	}
+	if (!uj->thumbSize) {
 		return false;
 	}
 	else {
-		dest.swap(uj->thumbnail);
+		dest.resize(uj->thumbSize);
+		memcpy(dest.buffer(), uj->thumbPos, uj->thumbSize);
 		return true;
 	}
 }
 
+bool ujGetThumbView(ujImage img, FCInterface::ByteView& dest) {
+	ujContext *uj = (ujContext*)img;
+	if (!uj) {
+		ujErrorNoContext = UJ_NO_CONTEXT;
+		return false;
+	}
+	if (!uj->thumbSize)
+		return false;
+	dest = FCInterface::ByteView(uj->thumbPos, uj->thumbSize);
+	return true;
+}
+
 bool ujGetImage(ujImage img, FCInterface::ByteVector& dest) {
     ujContext *uj = (ujContext*) img;
-    ujError = !uj ? UJ_NO_CONTEXT : (uj->decoded ? UJ_OK : UJ_NOT_DECODED);
-    if (ujError) return false;
-
-        if (!uj->rgb.empty())
-			dest.swap(uj->rgb);
-        else {
-			if(uj->ncomp == 3)
-				dest.resize(uj->width * uj->height * 4);
-			else
-				dest.resize(uj->width * uj->height * uj->ncomp);
-            ujConvert(uj, dest.buffer());
-            if (ujError) return false;
-        }
-        return true;
+    if (!ujCheckQuery(uj, uj && uj->decoded)) return false;
+    int format = (uj->ncomp == 3) ? UJ_PIXEL_FORMAT_RGBA : UJ_PIXEL_FORMAT_GRAY;
+    int stride = ujOutputWidth(uj) * ujPixelSize(format);
+    unsigned int size = stride * ujOutputHeight(uj);
+    if (dest.size() != size)  // reuse the caller's buffer if it fits exactly
+        dest.resize(size);
+    ujConvert(uj, dest.buffer(), stride, format);
+    return !uj->error;
+}
+
+bool ujGetImageTo(ujImage img, unsigned char* dest, int stride, int format) {
+	ujContext *uj = (ujContext*)img;
+	if (!ujCheckQuery(uj, uj && uj->decoded)) return false;
+	if (!dest || !ujPixelSize(format) || stride < ujOutputWidth(uj) * ujPixelSize(format)) {
+		uj->error = UJ_INVALID_ARG;
+		return false;
+	}
+	ujConvert(uj, dest, stride, format);
+	return !uj->error;
+}
+
+bool ujGetImageYUVTo(ujImage img, unsigned char* const planes[3], const int strides[3], int format) {
+	ujContext *uj = (ujContext*)img;
+	if (!ujCheckQuery(uj, uj && uj->decoded)) return false;
+	const int width = ujOutputWidth(uj), cwidth = (width + 1) >> 1;
+	bool ok;
+	if (format == UJ_YUV_FORMAT_NV12)
+		ok = planes[0] && planes[1] && (strides[0] >= width) && (strides[1] >= (cwidth << 1));
+	else if (format == UJ_YUV_FORMAT_I420)
+		ok = planes[0] && planes[1] && planes[2] && (strides[0] >= width) && (strides[1] >= cwidth) && (strides[2] >= cwidth);
+	else
+		ok = false;
+	if (!ok) {
+		uj->error = UJ_INVALID_ARG;
+		return false;
+	}
+	ujConvertYUV(uj, planes, strides, format);
+	return !uj->error;
+}
+
+bool ujGetImageYUV(ujImage img, FCInterface::ByteVector& dest, int format) {
+	ujContext *uj = (ujContext*)img;
+	if (!ujCheckQuery(uj, uj && uj->decoded)) return false;
+	const int width = ujOutputWidth(uj), height = ujOutputHeight(uj);
+	const int cwidth = (width + 1) >> 1, cheight = (height + 1) >> 1;
+	const unsigned int ysize = width * height, csize = cwidth * cheight;
+	unsigned char* planes[3];
+	int strides[3] = { width, cwidth, cwidth };
+	if (format == UJ_YUV_FORMAT_NV12)
+		strides[1] = cwidth << 1;
+	else if (format != UJ_YUV_FORMAT_I420) {
+		uj->error = UJ_INVALID_ARG;
+		return false;
+	}
+	if (dest.size() != ysize + 2 * csize)
+		dest.resize(ysize + 2 * csize);
+	planes[0] = dest.buffer();
+	planes[1] = planes[0] + ysize;
+	planes[2] = planes[1] + csize;
+	ujConvertYUV(uj, planes, strides, format);
+	return !uj->error;
 }
 
 
 void ujDestroy(ujImage img) {
-    ujError = UJ_OK;
-    if (!img) { ujError = UJ_NO_CONTEXT; return; }
+    if (!img) { ujErrorNoContext = UJ_NO_CONTEXT; return; }
     ujDone((ujContext*) img);
     free(img);
 }
@@ -1059,3 +2512,42 @@ void ujDestroy(ujImage img) {
 
 }
 
+////////////////////////////////////////////////////////////////////////////////
+
+uJPEGPool::uJPEGPool(unsigned int maxIdle) : maxIdle_(maxIdle)
+{
+}
+
+uJPEGPool::~uJPEGPool()
+{
+	for (size_t i = 0; i < idle_.size(); ++i)
+		delete idle_[i];
+}
+
+uJPEG* uJPEGPool::acquire()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!idle_.empty()) {
+			uJPEG* jpeg = idle_.back();
+			idle_.pop_back();
+			return jpeg;
+		}
+	}
+	return new uJPEG();
+}
+
+void uJPEGPool::release(uJPEG* jpeg)
+{
+	if (!jpeg)
+		return;
+	jpeg->resetOptions();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (idle_.size() < maxIdle_) {
+			idle_.push_back(jpeg);
+			return;
+		}
+	}
+	delete jpeg;
+}
@@ -57,6 +57,10 @@
 #define _UJPEG_H_
 
 #include "ByteVector.h"
+#include "ByteView.h"
+
+#include <mutex>
+#include <vector>
 
 // result codes for ujDecode()
 typedef enum _uj_result {
@@ -94,8 +98,12 @@ extern "C" {
 // data type for uJPEG image handles
 typedef void* ujImage;
 
-// return the error code of the last uJPEG operation
-extern ujResult ujGetError(void);
+// return the error code of the last uJPEG operation on img; every image handle
+// keeps its own error state, so several images can be decoded concurrently
+// on different threads. With img == NULL, returns the error of the calling
+// thread's last operation that had no handle to record it in (a NULL handle,
+// a failed ujCreate(), or a failed ujDecode(NULL, ...)).
+extern ujResult ujGetError(ujImage img);
 
 // create a uJPEG image context
 extern ujImage ujCreate(void);
@@ -109,7 +117,64 @@ extern void ujDisableDecoding(ujImage img);
 #define UJ_CHROMA_MODE_DEFAULT   0  // default mode: accurate
 extern void ujSetChromaMode(ujImage img, int mode);
 extern void ujSetThumbnailMode(ujImage img, bool mode);
+
+// select the IDCT implementation used by all contexts: the NEON/SSE2 kernels
+// (chosen at runtime if the CPU supports them) or the portable scalar code.
+// Both produce bit-identical output.
+#define UJ_IDCT_MODE_AUTO    0  // fastest implementation available
+#define UJ_IDCT_MODE_SCALAR  1  // always use the scalar reference code
+extern void ujSetIDCTMode(int mode);
+
+// decode restart intervals on up to 'threads' threads (at most 8) if the
+// image has restart markers; 0 or 1 decodes on the calling thread only
+extern void ujSetThreadCount(ujImage img, int threads);
+
+// limit the size of the decoded picture (0 = no limit). Larger images are
+// decoded directly at 1/2, 1/4 or 1/8 size -- the largest of these that fits
+// -- which is much faster than decoding at full size; ujGetWidth() and
+// ujGetHeight() report the scaled size. Images that don't fit even at 1/8
+// scale fail with UJ_DIMENSIONS_EXCEEDED.
 extern void ujSetMaximumDimensions(ujImage img, unsigned int width, unsigned int height);
+
+// decode only a region of the picture, given in pixels of the full-size
+// picture (width or height 0 = the whole picture). All macroblocks still
+// have to be entropy decoded (unless restart markers allow skipping them),
+// but only those covering the region are transformed and converted, and only
+// the region is allocated. The region's origin is moved up and left to the
+// nearest macroblock boundary (8, 16 or 32 pixels, depending on chroma
+// subsampling), and regions too small for chroma upsampling are grown by a
+// macroblock. The pixels match a full decode at the same scale, except that
+// subsampled chroma may differ slightly within a few pixels (up to 2n+1 for
+// n-times subsampling) of an origin that isn't the picture's edge. With
+// ujSetMaximumDimensions(), the limit applies to the region.
+extern void ujSetCrop(ujImage img, int x, int y, int width, int height);
+
+// keep the quantization and Huffman tables from one decode to the next, for
+// the frames of a Motion-JPEG stream: a frame without DQT or DHT segments is
+// decoded with the tables of an earlier frame, or with the standard tables of
+// JPEG Annex K.3 if the stream hasn't defined any (as AVI MJPEG requires).
+// DHT segments identical to the tables already loaded are not rebuilt.
+extern void ujSetStreamMode(ujImage img, int enable);
+
+// apply the EXIF orientation (see ujGetOrientation()) while converting, so
+// ujGetImage(), ujGetImageTo() and the YUV variants return the picture the
+// right way up; no separate rotation pass over the output is needed.
+// ujGetWidth() and ujGetHeight() then give the oriented size, i.e. width and
+// height are swapped for orientations 5 to 8. ujSetMaximumDimensions()
+// limits the oriented picture; crop rectangles and crop offsets stay in the
+// coordinates of the stored picture.
+extern void ujSetAutoOrient(ujImage img, int enable);
+
+// treat the picture as if its EXIF orientation were 'orientation' (1 to 8;
+// 0 = the one in the file, the default): ujGetOrientation() reports it and
+// ujSetAutoOrient() applies it. For an EXIF thumbnail, which is stored like the
+// picture it belongs to but has no orientation of its own.
+extern void ujSetOrientation(ujImage img, int orientation);
+
+// restore all of the above settings to their defaults; decoded data and
+// buffers are kept, so the context can be reused for an unrelated image
+extern void ujResetOptions(ujImage img);
+
 // decode a JPEG image from memory
 // img:  the handle to the uJPEG image to decode to;
 //       if it is NULL, a new instance will be created
@@ -133,6 +198,18 @@ extern int ujIsValid(ujImage img);
 extern int ujGetWidth(ujImage img);
 extern int ujGetHeight(ujImage img);
 
+// determine the EXIF orientation of a decoded picture (1 to 8, 1 = stored the
+// right way up, also for pictures without EXIF data). This is the orientation
+// as stored in the file (or set with ujSetOrientation()), whether or not
+// ujSetAutoOrient() applies it; also available after a ujSetThumbnailMode()
+// decode.
+extern int ujGetOrientation(ujImage img);
+
+// determine the origin of a picture decoded with ujSetCrop(), in output
+// pixels (i.e. after any downscaling); ujGetWidth() and ujGetHeight() give
+// the region's size
+extern void ujGetCropOffset(ujImage img, int* x, int* y);
+
 // determine whether a decoded picture is grayscale (0) or color (1)
 extern int ujIsColor(ujImage img);
 
@@ -157,6 +234,43 @@ extern ujPlane* ujGetPlane(ujImage img, int num);
 extern bool ujGetImage(ujImage img, FCInterface::ByteVector& dest);
 extern bool ujGetThumbData(ujImage img, FCInterface::ByteVector& dest);
 
+// the EXIF thumbnail found in thumbnail mode, in place inside the JPEG data
+// given to ujDecode(); valid as long as that data and until the next decode.
+// Returns false if there is none.
+extern bool ujGetThumbView(ujImage img, FCInterface::ByteView& dest);
+
+// convert the decoded picture straight into caller-supplied memory (e.g. a
+// mapped GBM buffer object) instead of an intermediate ByteVector. Lines are
+// written in order, each one exactly once (unless ujSetAutoOrient() rotates
+// or flips the picture).
+// dest:   first pixel of the top line; must hold height lines of stride bytes
+// stride: distance between lines in bytes, at least width * bytes per pixel
+// format: one of the pixel formats below; grayscale pictures are replicated
+//         into the color channels, color pictures are reduced to their luma
+//         plane for UJ_PIXEL_FORMAT_GRAY
+// returns false on failure; use ujGetError to get a more detailed error
+// description
+#define UJ_PIXEL_FORMAT_RGBA  0  // R, G, B, A bytes (DRM_FORMAT_ABGR8888), ujGetImage() default
+#define UJ_PIXEL_FORMAT_BGRA  1  // B, G, R, A bytes (DRM_FORMAT_ARGB8888)
+#define UJ_PIXEL_FORMAT_RGB   2  // R, G, B bytes (DRM_FORMAT_BGR888)
+#define UJ_PIXEL_FORMAT_GRAY  3  // one luma byte (DRM_FORMAT_R8)
+extern bool ujGetImageTo(ujImage img, unsigned char* dest, int stride, int format);
+
+// retrieve the decoded picture as 4:2:0 YUV without RGB conversion, e.g. for
+// import as an NV12 or YUV420 dmabuf. The samples are full-range (JFIF)
+// BT.601 YCbCr. The chroma planes are half the picture size, rounded up;
+// other chroma subsamplings are resampled, grayscale pictures get neutral
+// chroma.
+// planes/strides: Y and CbCr planes for NV12, Y, Cb and Cr planes for I420;
+//                 the CbCr plane of NV12 holds 2 bytes per chroma sample
+// ujGetImageYUV() stores the planes back to back in dest without padding.
+// return false on failure; use ujGetError to get a more detailed error
+// description
+#define UJ_YUV_FORMAT_NV12  0  // Y plane + interleaved CbCr plane (DRM_FORMAT_NV12)
+#define UJ_YUV_FORMAT_I420  1  // Y, Cb and Cr planes (DRM_FORMAT_YUV420)
+extern bool ujGetImageYUVTo(ujImage img, unsigned char* const planes[3], const int strides[3], int format);
+extern bool ujGetImageYUV(ujImage img, FCInterface::ByteVector& dest, int format);
+
 
 // destroy a uJPEG image handle
 extern void ujDestroy(ujImage img);
@@ -180,32 +294,89 @@ class uJPEG {
 public:
     uJPEG()                                       { img = ujCreate(); }
     virtual ~uJPEG()                              { ujFree(img); }
-    static ujResult getError()                    { return ujGetError(); }
+    ujResult getError()                           { return ujGetError(img); }
     void disableDecoding()                        { ujDisableDecoding(img); }
     void setChromaMode(int mode)                  { ujSetChromaMode(img, mode); }
 	void setThumbnailMode(bool mode)			  { ujSetThumbnailMode(img, mode); }
 	void setMaxDimensions(unsigned int width, unsigned int height) { ujSetMaximumDimensions(img, width, height); }
+	void setThreadCount(int threads)              { ujSetThreadCount(img, threads); }
+	void setCrop(int x, int y, int width, int height) { ujSetCrop(img, x, y, width, height); }
+	void setStreamMode(bool enable)               { ujSetStreamMode(img, enable ? 1 : 0); }
+	void setAutoOrient(bool enable)               { ujSetAutoOrient(img, enable ? 1 : 0); }
+	void setOrientation(int orientation)          { ujSetOrientation(img, orientation); }
+	void resetOptions()                           { ujResetOptions(img); }
     bool decode(const void* jpeg, const int size) { return ujDecode(img, jpeg, size) != NULL; }
+	bool decode(FCInterface::ByteView jpeg)       { return ujDecode(img, jpeg.buffer(), (int)jpeg.size()) != NULL; }
     bool isValid()                                { return (ujIsValid(img) != 0); }
     bool good()                                   { return  isValid(); }
     bool bad()                                    { return !isValid(); }
     int getWidth()                                { return ujGetWidth(img); }
     int getHeight()                               { return ujGetHeight(img); }
+	int getOrientation()                          { return ujGetOrientation(img); }
+	void getCropOffset(int& x, int& y)            { ujGetCropOffset(img, &x, &y); }
     bool isColor()                                { return (ujIsColor(img) != 0); }
     int getImageSize()                            { return ujGetImageSize(img); }
     ujPlane* getPlane(int num)                    { return ujGetPlane(img, num); }
     bool getImage(FCInterface::ByteVector& dest) {
 		return ujGetImage(img, dest); 
 	}
+	bool getImage(unsigned char* dest, int stride, int format = UJ_PIXEL_FORMAT_RGBA) {
+		return ujGetImageTo(img, dest, stride, format);
+	}
+	bool getImageYUV(FCInterface::ByteVector& dest, int format = UJ_YUV_FORMAT_NV12) {
+		return ujGetImageYUV(img, dest, format);
+	}
+	bool getImageYUV(unsigned char* const planes[3], const int strides[3], int format = UJ_YUV_FORMAT_NV12) {
+		return ujGetImageYUVTo(img, planes, strides, format);
+	}
 	bool getThumb(FCInterface::ByteVector& dest) {
 		return ujGetThumbData(img, dest);
 	}
+	bool getThumb(FCInterface::ByteView& dest) {
+		return ujGetThumbView(img, dest);
+	}
 
 private:
     ujImage img;
 };
 
 
+// Pool of decoders for decoding many images in a row. A decoder keeps its
+// component planes at their high-water mark between decodes, so a run of
+// equally sized images is decoded without any per-image allocation.
+// acquire() and release() are thread safe; released decoders have their
+// options reset. Use uJPEGPool::Handle to return a decoder automatically.
+class uJPEGPool {
+public:
+	explicit uJPEGPool(unsigned int maxIdle = 4);
+	~uJPEGPool();
+
+	uJPEG* acquire();
+	void release(uJPEG* jpeg);
+
+	class Handle {
+	public:
+		explicit Handle(uJPEGPool& pool) : pool_(pool), jpeg_(pool.acquire()) {}
+		~Handle()                                 { pool_.release(jpeg_); }
+		uJPEG* operator->() const                 { return jpeg_; }
+		uJPEG& operator*() const                  { return *jpeg_; }
+	private:
+		Handle(const Handle&);
+		Handle& operator=(const Handle&);
+		uJPEGPool& pool_;
+		uJPEG* jpeg_;
+	};
+
+private:
+	uJPEGPool(const uJPEGPool&);
+	uJPEGPool& operator=(const uJPEGPool&);
+
+	std::mutex mutex_;
+	std::vector<uJPEG*> idle_;
+	unsigned int maxIdle_;
+};
+
+
 
 #endif//_UJPEG_H_
 